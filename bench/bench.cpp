@@ -0,0 +1,950 @@
+#include <benchmark/benchmark.h>
+#include "../src/euluna.hpp"
+#include <dirent.h>
+
+////////////////////
+static std::string makeTempDir() {
+    char dir[] = "/tmp/eulunabenchXXXXXX";
+    if(!mkdtemp(dir))
+        abort();
+    return dir;
+}
+
+static void removeDirFiles(const std::string& dirName) {
+    DIR *dir = opendir(dirName.c_str());
+    if(!dir)
+        return;
+    while(struct dirent *entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if(name != "." && name != "..")
+            unlink((dirName + "/" + name).c_str());
+    }
+    closedir(dir);
+}
+
+// generates a set of scripts with some functions each, similar to a game script base
+static std::vector<std::string> makeScripts(const std::string& dir, int count) {
+    std::vector<std::string> scripts;
+    for(int i = 0; i < count; ++i) {
+        std::string source = euluna_tools::format("local M = {}\nscript%d = M\n", i);
+        for(int j = 0; j < 20; ++j) {
+            source += euluna_tools::format(
+                "function M.func%d(a, b)\n"
+                "  local t = {}\n"
+                "  for i=1,a do t[#t+1] = (i * b) %% 7 end\n"
+                "  if #t > 10 then return 'big' .. #t elseif #t > 5 then return 'medium' else return t end\n"
+                "end\n", j);
+        }
+        source += "return M\n";
+        std::string fileName = euluna_tools::format("%s/script%d.lua", dir, i);
+        euluna_tools::write_file_atomic(fileName, source.data(), source.size());
+        scripts.push_back(fileName);
+    }
+    return scripts;
+}
+
+static void loadScripts(EulunaEngine& euluna, const std::vector<std::string>& scripts) {
+    for(const std::string& script : scripts)
+        euluna.safeRunScript(script);
+}
+
+static void BM_ScriptStartupNoCache(benchmark::State& state) {
+    std::string dir = makeTempDir();
+    auto scripts = makeScripts(dir, state.range(0));
+    for(auto _ : state) {
+        EulunaEngine euluna;
+        loadScripts(euluna, scripts);
+    }
+    state.SetItemsProcessed(state.iterations() * scripts.size());
+}
+BENCHMARK(BM_ScriptStartupNoCache)->Arg(100)->Arg(1000)->Unit(benchmark::kMillisecond);
+
+static void BM_ScriptStartupColdCache(benchmark::State& state) {
+    std::string dir = makeTempDir();
+    std::string cacheDir = dir + "/cache";
+    auto scripts = makeScripts(dir, state.range(0));
+    for(auto _ : state) {
+        state.PauseTiming();
+        removeDirFiles(cacheDir);
+        state.ResumeTiming();
+        EulunaEngine euluna;
+        euluna.setScriptCacheDir(cacheDir);
+        loadScripts(euluna, scripts);
+    }
+    state.SetItemsProcessed(state.iterations() * scripts.size());
+}
+BENCHMARK(BM_ScriptStartupColdCache)->Arg(100)->Arg(1000)->Unit(benchmark::kMillisecond);
+
+static void BM_ScriptStartupWarmCache(benchmark::State& state) {
+    std::string dir = makeTempDir();
+    std::string cacheDir = dir + "/cache";
+    auto scripts = makeScripts(dir, state.range(0));
+    {
+        EulunaEngine euluna;
+        euluna.setScriptCacheDir(cacheDir);
+        loadScripts(euluna, scripts);
+    }
+    for(auto _ : state) {
+        EulunaEngine euluna;
+        euluna.setScriptCacheDir(cacheDir);
+        loadScripts(euluna, scripts);
+    }
+    state.SetItemsProcessed(state.iterations() * scripts.size());
+}
+BENCHMARK(BM_ScriptStartupWarmCache)->Arg(100)->Arg(1000)->Unit(benchmark::kMillisecond);
+
+////////////////////
+static const char *handlersScript = R"(
+    function onThink(a) return a end
+    events = { onStep = function(a) return a end }
+)";
+
+static void BM_CallGlobal(benchmark::State& state) {
+    EulunaEngine euluna;
+    euluna.safeRunBuffer(handlersScript);
+    for(auto _ : state)
+        benchmark::DoNotOptimize(euluna.safeCallGlobal<int>("onThink", 1));
+}
+BENCHMARK(BM_CallGlobal);
+
+static void BM_CallGlobalField(benchmark::State& state) {
+    EulunaEngine euluna;
+    euluna.safeRunBuffer(handlersScript);
+    for(auto _ : state)
+        benchmark::DoNotOptimize(euluna.safeCallGlobalField<int>("events", "onStep", 1));
+}
+BENCHMARK(BM_CallGlobalField);
+
+static void BM_FunctionRefCall(benchmark::State& state) {
+    EulunaEngine euluna;
+    euluna.safeRunBuffer(handlersScript);
+    EulunaFunctionRef onThink(&euluna, "onThink");
+    for(auto _ : state)
+        benchmark::DoNotOptimize(onThink.call<int>(1));
+}
+BENCHMARK(BM_FunctionRefCall);
+
+static void BM_FunctionRefCallPath(benchmark::State& state) {
+    EulunaEngine euluna;
+    euluna.safeRunBuffer(handlersScript);
+    EulunaFunctionRef onStep(&euluna, "events.onStep", true);
+    for(auto _ : state)
+        benchmark::DoNotOptimize(onStep.call<int>(1));
+}
+BENCHMARK(BM_FunctionRefCallPath);
+
+static void BM_SafeCallEmptyFunction(benchmark::State& state) {
+    EulunaEngine euluna;
+    euluna.safeRunBuffer("function empty() end");
+    euluna.getGlobal("empty");
+    int ref = euluna.ref();
+    for(auto _ : state) {
+        euluna.getRef(ref);
+        euluna.safeCall();
+    }
+    euluna.unref(ref);
+}
+BENCHMARK(BM_SafeCallEmptyFunction);
+
+static void BM_SafeCallPushedHandler(benchmark::State& state) {
+    EulunaEngine euluna;
+    euluna.safeRunBuffer("function empty() end");
+    euluna.getGlobal("empty");
+    int ref = euluna.ref();
+    for(auto _ : state) {
+        euluna.pushErrorHandler();
+        int errorFuncIndex = euluna.stackSize();
+        euluna.getRef(ref);
+        euluna.safeCall(0, 0, errorFuncIndex);
+    }
+    euluna.unref(ref);
+}
+BENCHMARK(BM_SafeCallPushedHandler);
+
+static void BM_StdFunctionCallback(benchmark::State& state) {
+    EulunaEngine euluna;
+    auto callback = euluna.safeRunBuffer<std::function<void()>>("return function() end");
+    for(auto _ : state)
+        callback();
+}
+BENCHMARK(BM_StdFunctionCallback);
+
+typedef std::tuple<int,int,int> ThreeInts;
+
+static void BM_CallMultipleResults(benchmark::State& state) {
+    EulunaEngine euluna;
+    euluna.safeRunBuffer("function three(a) return a, a+1, a+2 end");
+    EulunaFunctionRef three(&euluna, "three");
+    for(auto _ : state)
+        benchmark::DoNotOptimize(three.call<ThreeInts>(1));
+}
+BENCHMARK(BM_CallMultipleResults);
+
+static void BM_CallTableResult(benchmark::State& state) {
+    EulunaEngine euluna;
+    auto three = euluna.safeRunBuffer<std::function<ThreeInts(int)>>("return function(a) return {a, a+1, a+2} end");
+    for(auto _ : state)
+        benchmark::DoNotOptimize(three(1));
+}
+BENCHMARK(BM_CallTableResult);
+
+// independent jobs spread over an increasing number of lua states
+static void BM_EnginePoolScaling(benchmark::State& state) {
+    EulunaEnginePool pool(state.range(0), [](EulunaEngine* euluna) {
+        euluna->runBuffer("function work(n) local s = 0 for i = 1, n do s = s + i % 7 end return s end");
+    });
+    const int numJobs = 256;
+    std::vector<std::future<int>> results(numJobs);
+    for(auto _ : state) {
+        for(int i = 0; i < numJobs; ++i)
+            results[i] = pool.submit([](EulunaEngine* euluna) { return euluna->callGlobal<int>("work", 2000); });
+        for(auto& result : results)
+            benchmark::DoNotOptimize(result.get());
+    }
+    state.SetItemsProcessed(state.iterations() * numJobs);
+}
+BENCHMARK(BM_EnginePoolScaling)->RangeMultiplier(2)->Range(1, std::max(1u, std::thread::hardware_concurrency()))->UseRealTime();
+
+// bootstrap of request scoped states, a prelude with some modules
+static void bootstrapRequestState(EulunaEngine* euluna) {
+    for(int i = 0; i < 50; ++i) {
+        std::string source = euluna_tools::format("module%d = {}\n", i);
+        for(int j = 0; j < 20; ++j)
+            source += euluna_tools::format("function module%d.func%d(a) return a * %d end\n", i, j, j);
+        euluna->safeRunBuffer(source);
+    }
+}
+
+static const char *requestScript = R"(
+    request = { path = '/index', headers = {} }
+    for i=1,20 do request.headers['h' .. i] = module1.func2(i) end
+    module3.cache = request
+)";
+
+static void BM_RequestStateRecreate(benchmark::State& state) {
+    for(auto _ : state) {
+        EulunaEngine euluna;
+        EulunaBinder::registerGlobalBindings(&euluna);
+        bootstrapRequestState(&euluna);
+        euluna.safeRunBuffer(requestScript);
+    }
+}
+BENCHMARK(BM_RequestStateRecreate)->Unit(benchmark::kMicrosecond);
+
+static void BM_RequestStateReset(benchmark::State& state) {
+    EulunaStatePool pool(bootstrapRequestState);
+    pool.prewarm(1);
+    for(auto _ : state) {
+        EulunaStatePool::Lease euluna = pool.acquire();
+        euluna->safeRunBuffer(requestScript);
+    }
+    state.counters["created"] = pool.getCreatedCount();
+}
+BENCHMARK(BM_RequestStateReset)->Unit(benchmark::kMicrosecond);
+
+// a binder with many classes and functions, like the bindings of a game engine
+struct BenchObject {
+    int getValue() const { return m_value; }
+    void setValue(int value) { m_value = value; }
+    int m_value = 0;
+};
+
+static int benchGlobalFunction(int a, int b) { return a + b; }
+
+static EulunaBinder& syntheticBinder() {
+    static EulunaBinder *binder = nullptr;
+    if(!binder) {
+        binder = new EulunaBinder;
+        for(int i = 0; i < 1000; ++i) {
+            binder->managedClass(euluna_tools::format("BenchClass%d", i))
+                .defStatic("create", [] { return 0; })
+                .def("getValue", &BenchObject::getValue)
+                .def("setValue", &BenchObject::setValue);
+        }
+        auto& globals = binder->globals();
+        for(int i = 0; i < 1000; ++i)
+            globals.def(euluna_tools::format("benchFunction%d", i), benchGlobalFunction);
+    }
+    return *binder;
+}
+
+static void BM_StartupEagerBindings(benchmark::State& state) {
+    EulunaBinder& binder = syntheticBinder();
+    int memory = 0;
+    for(auto _ : state) {
+        EulunaEngine euluna;
+        binder.registerBindings(&euluna);
+        memory = euluna.gc(LUA_GCCOUNT, 0);
+    }
+    state.counters["lua_kb"] = memory;
+}
+BENCHMARK(BM_StartupEagerBindings)->Unit(benchmark::kMicrosecond);
+
+static void BM_StartupLazyBindings(benchmark::State& state) {
+    EulunaBinder& binder = syntheticBinder();
+    int memory = 0;
+    for(auto _ : state) {
+        EulunaEngine euluna;
+        binder.registerBindingsLazy(&euluna);
+        // a script that only uses a few bindings
+        euluna.safeRunBuffer("BenchClass1.create() BenchClass2.create() benchFunction1(1, 2)");
+        memory = euluna.gc(LUA_GCCOUNT, 0);
+    }
+    state.counters["lua_kb"] = memory;
+}
+BENCHMARK(BM_StartupLazyBindings)->Unit(benchmark::kMicrosecond);
+
+// reads of undefined globals, with eager bindings (0), lazy bindings still pending (1)
+// and lazy bindings after every name was registered (2)
+static void BM_MissingGlobalReads(benchmark::State& state) {
+    EulunaBinder& binder = syntheticBinder();
+    EulunaEngine euluna;
+    if(state.range(0) == 0)
+        binder.registerBindings(&euluna);
+    else
+        binder.registerBindingsLazy(&euluna);
+    if(state.range(0) == 2) {
+        euluna.safeRunBuffer(R"(
+            for i=0,999 do local _ = _G['BenchClass' .. i] local _ = _G['benchFunction' .. i] end
+            assert(getmetatable(_G) == nil)
+        )");
+    }
+    euluna.safeRunBuffer("function readMissing(n) local c = 0 for i=1,n do if optionalHook then c = c + 1 end end return c end");
+    for(auto _ : state)
+        benchmark::DoNotOptimize(euluna.safeCallGlobal<int>("readMissing", 1000));
+}
+BENCHMARK(BM_MissingGlobalReads)->DenseRange(0, 2)->Unit(benchmark::kMicrosecond);
+
+// a heap with live data and some garbage produced each frame
+static const char *gcHeapScript = R"(
+    live = {}
+    for i=1,100000 do live[i] = { id = i, name = 'entity' .. i } end
+    function frame()
+        local garbage = {}
+        for i=1,2000 do garbage[i] = { i, tostring(i) } end
+    end
+)";
+
+static void BM_GcFullCollectPause(benchmark::State& state) {
+    EulunaEngine euluna;
+    euluna.safeRunBuffer(gcHeapScript);
+    euluna.setGcRunning(false);
+    for(auto _ : state) {
+        state.PauseTiming();
+        euluna.safeCallGlobal("frame");
+        state.ResumeTiming();
+        euluna.collect();
+    }
+}
+BENCHMARK(BM_GcFullCollectPause)->Unit(benchmark::kMicrosecond);
+
+// worst step of gc slices with a time budget, done once per frame
+static void BM_GcBudgetedStepPause(benchmark::State& state) {
+    EulunaEngine euluna;
+    euluna.safeRunBuffer(gcHeapScript);
+    euluna.setGcRunning(false);
+    for(auto _ : state) {
+        state.PauseTiming();
+        euluna.safeCallGlobal("frame");
+        state.ResumeTiming();
+        euluna.gcStep(std::chrono::microseconds(state.range(0)));
+    }
+    const EulunaGcStats& stats = euluna.getGcStats();
+    state.counters["step_p99_us"] = stats.stepDurations.percentile(0.99) / 1000.0;
+    state.counters["heap_mb"] = stats.heapTrend.back().size / (1024.0 * 1024.0);
+}
+BENCHMARK(BM_GcBudgetedStepPause)->Arg(100)->Arg(500)->Unit(benchmark::kMicrosecond);
+
+// small allocations typical of scripts: tables, strings and closures
+static const char *allocationScript = R"(
+    function churn()
+        local t = {}
+        for i=1,1000 do
+            t[i] = { x = i, name = 'n' .. i, f = function() return i end }
+        end
+    end
+)";
+
+static void runAllocationBench(benchmark::State& state, EulunaEngine& euluna) {
+    euluna.safeRunBuffer(allocationScript);
+    for(auto _ : state)
+        euluna.safeCallGlobal("churn");
+    state.SetItemsProcessed(state.iterations() * 1000);
+}
+
+static void BM_AllocDefault(benchmark::State& state) {
+    EulunaEngine euluna;
+    runAllocationBench(state, euluna);
+}
+BENCHMARK(BM_AllocDefault)->Unit(benchmark::kMicrosecond);
+
+static void BM_AllocAccounting(benchmark::State& state) {
+    EulunaEngine euluna{std::unique_ptr<EulunaAllocator>(new EulunaAllocator)};
+    runAllocationBench(state, euluna);
+}
+BENCHMARK(BM_AllocAccounting)->Unit(benchmark::kMicrosecond);
+
+static void BM_AllocPool(benchmark::State& state) {
+    EulunaEngine euluna{std::unique_ptr<EulunaAllocator>(new EulunaPoolAllocator)};
+    runAllocationBench(state, euluna);
+}
+BENCHMARK(BM_AllocPool)->Unit(benchmark::kMicrosecond);
+
+// attributing sampled allocations to script lines, arg is the sample interval in bytes
+static void BM_AllocTracking(benchmark::State& state) {
+    EulunaEngine euluna{std::unique_ptr<EulunaAllocator>(new EulunaTrackingAllocator<>(state.range(0)))};
+    runAllocationBench(state, euluna);
+}
+BENCHMARK(BM_AllocTracking)->Arg(256)->Arg(4096)->Arg(64 * 1024)->Unit(benchmark::kMicrosecond);
+
+// states allocating from several threads at once, where the pools avoid contention on malloc
+static void BM_AllocPoolThreads(benchmark::State& state) {
+    std::unique_ptr<EulunaEngine> euluna;
+    if(state.range(0))
+        euluna.reset(new EulunaEngine{std::unique_ptr<EulunaAllocator>(new EulunaPoolAllocator)});
+    else
+        euluna.reset(new EulunaEngine);
+    runAllocationBench(state, *euluna);
+}
+BENCHMARK(BM_AllocPoolThreads)->Arg(0)->Arg(1)->ThreadRange(1, std::max(1u, std::thread::hardware_concurrency()))->UseRealTime()->Unit(benchmark::kMicrosecond);
+
+// cost of the watchdog hook on a compute bound call, 0 runs without watchdog
+static void BM_WatchdogOverhead(benchmark::State& state) {
+    EulunaEngine euluna;
+    euluna.safeRunBuffer("function work(n) local s = 0 for i=1,n do s = s + i % 7 end return s end");
+    int interval = state.range(0);
+    for(auto _ : state) {
+        if(interval > 0) {
+            EulunaWatchdog watchdog(&euluna, std::chrono::seconds(1), 0, interval);
+            benchmark::DoNotOptimize(euluna.safeCallGlobal<int>("work", 100000));
+        } else
+            benchmark::DoNotOptimize(euluna.safeCallGlobal<int>("work", 100000));
+    }
+}
+BENCHMARK(BM_WatchdogOverhead)->Arg(0)->Arg(100)->Arg(1000)->Arg(10000)->Unit(benchmark::kMicrosecond);
+
+// cost of the sampling profiler on nested calls, arg is the instructions between samples, 0 runs without profiler
+static void BM_ProfilerOverhead(benchmark::State& state) {
+    EulunaEngine euluna;
+    euluna.safeRunBuffer(R"(
+        local function leaf(n) local s = 0 for i=1,n do s = s + i % 7 end return s end
+        local function middle(n) return leaf(n) end
+        function work(n) local s = 0 for i=1,n/1000 do s = s + middle(1000) end return s end
+    )");
+    int interval = state.range(0);
+    std::unique_ptr<EulunaProfiler> profiler;
+    if(interval > 0)
+        profiler.reset(new EulunaProfiler(&euluna, interval));
+    for(auto _ : state)
+        benchmark::DoNotOptimize(euluna.safeCallGlobal<int>("work", 100000));
+    if(profiler)
+        state.counters["samples"] = profiler->getSampleCount();
+}
+BENCHMARK(BM_ProfilerOverhead)->Arg(0)->Arg(1000)->Arg(10000)->Arg(100000)->Unit(benchmark::kMicrosecond);
+
+// latency of reloading one changed script among many watched ones
+static void BM_ReloadOneChangedScript(benchmark::State& state) {
+    std::string dir = makeTempDir();
+    auto scripts = makeScripts(dir, state.range(0));
+    EulunaEngine euluna;
+    EulunaScriptReloader reloader(&euluna);
+    for(const std::string& script : scripts)
+        reloader.safeWatchScript(script);
+    euluna_tools::mapped_file file(scripts[0]);
+    std::string source(file.data(), file.size());
+    file.close();
+    for(auto _ : state) {
+        state.PauseTiming();
+        euluna_tools::write_file_atomic(scripts[0], source.data(), source.size());
+        state.ResumeTiming();
+        if(reloader.safePoll() != 1)
+            state.SkipWithError("script not reloaded");
+    }
+    removeDirFiles(dir);
+    rmdir(dir.c_str());
+}
+BENCHMARK(BM_ReloadOneChangedScript)->Arg(100)->Arg(1000)->Unit(benchmark::kMicrosecond);
+
+// hot loop calling bound math functions, the binder calls them through the FFI
+// when built for LuaJIT, so the loop can be compiled into a single trace
+static double benchLerp(double a, double b, double t) noexcept { return a + (b - a) * t; }
+static double benchClamp(double v, double lo, double hi) noexcept { return v < lo ? lo : (v > hi ? hi : v); }
+
+static const char *boundMathScript = R"(
+    local lerp, clamp = benchmath.lerp, benchmath.clamp
+    local s = 0
+    for i=1,100000 do
+        s = s + clamp(lerp(0, 10, i * 0.00001), 1, 9)
+    end
+    return s
+)";
+
+static void BM_BoundMathLoopCApi(benchmark::State& state) {
+    static EulunaCppFunction lerp = euluna_binder::bind_fun(benchLerp);
+    static EulunaCppFunction clamp = euluna_binder::bind_fun(benchClamp);
+    EulunaEngine euluna;
+    euluna.registerSingletonClass("benchmath");
+    euluna.registerClassFunction("benchmath", "lerp", &lerp);
+    euluna.registerClassFunction("benchmath", "clamp", &clamp);
+    for(auto _ : state)
+        benchmark::DoNotOptimize(euluna.safeRunBuffer<double>(boundMathScript));
+}
+BENCHMARK(BM_BoundMathLoopCApi)->Unit(benchmark::kMicrosecond);
+
+static void BM_BoundMathLoopBinder(benchmark::State& state) {
+    EulunaBinder binder;
+    binder.singleton("benchmath")
+        .def("lerp", benchLerp)
+        .def("clamp", benchClamp);
+    EulunaEngine euluna;
+    binder.registerBindings(&euluna);
+    state.SetLabel(euluna.runBuffer<std::string>("return type(benchmath.lerp)"));
+    for(auto _ : state)
+        benchmark::DoNotOptimize(euluna.safeRunBuffer<double>(boundMathScript));
+}
+BENCHMARK(BM_BoundMathLoopBinder)->Unit(benchmark::kMicrosecond);
+
+// emitting an event to many lua listeners
+static const char *listenersScript = R"(
+    count = 0
+    local function listener(a, b) count = count + a end
+    events = { tick = {} }
+    for i=1,%d do
+        events.tick[i] = listener
+        tick.connect(listener)
+    end
+)";
+
+// emulation with a table of callbacks looked up by name and iterated with pairs
+static void BM_TableEventsEmit(benchmark::State& state) {
+    EulunaEngine euluna;
+    EulunaSignal<int, int> tick(&euluna, "tick");
+    euluna.safeRunBuffer(euluna_tools::format(listenersScript, (int)state.range(0)));
+    for(auto _ : state) {
+        euluna.pushErrorHandler();
+        int errorHandler = euluna.stackSize();
+        euluna.getGlobal("events");
+        euluna.getField("tick");
+        euluna.remove(-2);
+        euluna.pushNil();
+        while(euluna.next(-2)) {
+            euluna.pushInteger(1);
+            euluna.pushInteger(2);
+            if(euluna.pcall(2, 0, errorHandler) != 0)
+                euluna.pop();
+        }
+        euluna.pop(2);
+    }
+}
+BENCHMARK(BM_TableEventsEmit)->Arg(10000)->Unit(benchmark::kMicrosecond);
+
+static void BM_SignalEmit(benchmark::State& state) {
+    EulunaEngine euluna;
+    EulunaSignal<int, int> tick(&euluna, "tick");
+    euluna.safeRunBuffer(euluna_tools::format(listenersScript, (int)state.range(0)));
+    for(auto _ : state)
+        tick.safeEmit(1, 2);
+}
+BENCHMARK(BM_SignalEmit)->Arg(10000)->Unit(benchmark::kMicrosecond);
+
+// lua callbacks called by another thread and drained in batches by the owner thread
+static void BM_CallbackDirect(benchmark::State& state) {
+    EulunaEngine euluna;
+    euluna.safeRunBuffer("count = 0 function onData(a, b) count = count + a + b end");
+    auto onData = euluna.safeRunBuffer<std::function<void(int,int)>>("return onData");
+    for(auto _ : state) {
+        for(int i = 0; i < 1000; ++i)
+            onData(i, 1);
+    }
+    state.SetItemsProcessed(state.iterations() * 1000);
+}
+BENCHMARK(BM_CallbackDirect)->Unit(benchmark::kMicrosecond);
+
+static void BM_CallbackQueuedFromThread(benchmark::State& state) {
+    EulunaEngine euluna;
+    euluna.safeRunBuffer("count = 0 function onData(a, b) count = count + a + b end");
+    auto onData = euluna.safeRunBuffer<std::function<void(int,int)>>("return onData");
+    for(auto _ : state) {
+        std::thread producer([&] {
+            for(int i = 0; i < 1000; ++i)
+                onData(i, 1);
+        });
+        producer.join();
+        euluna.drainCalls();
+    }
+    state.SetItemsProcessed(state.iterations() * 1000);
+}
+BENCHMARK(BM_CallbackQueuedFromThread)->Unit(benchmark::kMicrosecond);
+
+// passing messages between lua states through a channel, arg is the payload size
+static std::string channelPayloadScript(int64_t size) {
+    if(size <= 64)
+        return "payload = { id = 1, name = 'small', pos = { x = 1.5, y = 2.5 } }";
+    return euluna_tools::format("payload = string.rep('x', %d)", (int)size);
+}
+
+static void BM_ChannelThroughput(benchmark::State& state) {
+    auto channel = std::make_shared<EulunaChannel>(128);
+    EulunaEngine producer;
+    EulunaEngine consumer;
+    channel->bind(&producer, "messages");
+    channel->bind(&consumer, "messages");
+    producer.safeRunBuffer(channelPayloadScript(state.range(0)));
+    producer.safeRunBuffer("function produce() for i=1,100 do messages.send(payload) end end");
+    consumer.safeRunBuffer("function consume() for i=1,100 do messages.receive() end end");
+    for(auto _ : state) {
+        producer.safeCallGlobal("produce");
+        consumer.safeCallGlobal("consume");
+    }
+    state.SetItemsProcessed(state.iterations() * 100);
+    state.SetBytesProcessed(state.iterations() * 100 * state.range(0));
+}
+BENCHMARK(BM_ChannelThroughput)->Arg(32)->Arg(1024*1024)->Unit(benchmark::kMicrosecond);
+
+// round trip latency to a state blocked receiving in another thread
+static void BM_ChannelPingPong(benchmark::State& state) {
+    auto ping = std::make_shared<EulunaChannel>(16);
+    auto pong = std::make_shared<EulunaChannel>(16);
+    std::thread echo([ping, pong] {
+        EulunaEngine euluna;
+        ping->bind(&euluna, "ping");
+        pong->bind(&euluna, "pong");
+        euluna.safeRunBuffer("while true do local ok, v = ping.receive() if v == 'stop' then break end pong.send(v) end");
+    });
+    EulunaEngine euluna;
+    ping->bind(&euluna, "ping");
+    pong->bind(&euluna, "pong");
+    euluna.safeRunBuffer(channelPayloadScript(state.range(0)));
+    euluna.safeRunBuffer("function roundTrip() ping.send(payload) pong.receive() end");
+    for(auto _ : state)
+        euluna.safeCallGlobal("roundTrip");
+    euluna.safeRunBuffer("ping.send('stop')");
+    echo.join();
+}
+BENCHMARK(BM_ChannelPingPong)->Arg(32)->Arg(1024*1024)->UseRealTime()->Unit(benchmark::kMicrosecond);
+
+// startup cost of declaring and registering 5000 synthetic bindings, 500 classes of 10 functions
+static int benchBindingFunc(int a, int b) { return a + b; }
+
+static const char *benchBindingNames[] = { "f0", "f1", "f2", "f3", "f4", "f5", "f6", "f7", "f8", "f9" };
+
+static const luaL_Reg benchBindingTable[] = {
+    EULUNA_STATIC_FUNC_NAMED("f0", benchBindingFunc)
+    EULUNA_STATIC_FUNC_NAMED("f1", benchBindingFunc)
+    EULUNA_STATIC_FUNC_NAMED("f2", benchBindingFunc)
+    EULUNA_STATIC_FUNC_NAMED("f3", benchBindingFunc)
+    EULUNA_STATIC_FUNC_NAMED("f4", benchBindingFunc)
+    EULUNA_STATIC_FUNC_NAMED("f5", benchBindingFunc)
+    EULUNA_STATIC_FUNC_NAMED("f6", benchBindingFunc)
+    EULUNA_STATIC_FUNC_NAMED("f7", benchBindingFunc)
+    EULUNA_STATIC_FUNC_NAMED("f8", benchBindingFunc)
+    EULUNA_STATIC_FUNC_NAMED("f9", benchBindingFunc)
+    { nullptr, nullptr }
+};
+
+static std::vector<std::string> benchBindingClasses() {
+    std::vector<std::string> classes;
+    for(int i=0;i<500;++i)
+        classes.push_back(euluna_tools::format("bindclass%d", i));
+    return classes;
+}
+
+static void BM_StartupDynamicBindings(benchmark::State& state) {
+    std::vector<std::string> classes = benchBindingClasses();
+    for(auto _ : state) {
+        EulunaBinder binder;
+        for(const std::string& className : classes) {
+            auto& singleton = binder.singleton(className);
+            for(const char *name : benchBindingNames)
+                singleton.def(name, benchBindingFunc);
+        }
+        EulunaEngine euluna;
+        binder.registerBindings(&euluna);
+    }
+    state.SetItemsProcessed(state.iterations() * 5000);
+}
+BENCHMARK(BM_StartupDynamicBindings)->Unit(benchmark::kMicrosecond);
+
+static void BM_StartupStaticBindings(benchmark::State& state) {
+    std::vector<std::string> classes = benchBindingClasses();
+    for(auto _ : state) {
+        EulunaBinder binder;
+        for(const std::string& className : classes)
+            binder.singleton(className).defTable(benchBindingTable);
+        EulunaEngine euluna;
+        binder.registerBindings(&euluna);
+    }
+    state.SetItemsProcessed(state.iterations() * 5000);
+}
+BENCHMARK(BM_StartupStaticBindings)->Unit(benchmark::kMicrosecond);
+
+// lua calling bound C++ functions with 0 to 8 arguments, 1000 calls per iteration
+static int benchArgs0() { return 0; }
+static int benchArgs1(int a) { return a; }
+static int benchArgs2(int a, int b) { return a + b; }
+static int benchArgs3(int a, int b, int c) { return a + b + c; }
+static int benchArgs4(int a, int b, int c, int d) { return a + b + c + d; }
+static int benchArgs5(int a, int b, int c, int d, int e) { return a + b + c + d + e; }
+static int benchArgs6(int a, int b, int c, int d, int e, int f) { return a + b + c + d + e + f; }
+static int benchArgs7(int a, int b, int c, int d, int e, int f, int g) { return a + b + c + d + e + f + g; }
+static int benchArgs8(int a, int b, int c, int d, int e, int f, int g, int h) { return a + b + c + d + e + f + g + h; }
+
+static EulunaBinder& hotPathBinder() {
+    static EulunaBinder *binder = nullptr;
+    if(!binder) {
+        binder = new EulunaBinder;
+        binder->globals()
+            .def("benchArgs0", benchArgs0).def("benchArgs1", benchArgs1).def("benchArgs2", benchArgs2)
+            .def("benchArgs3", benchArgs3).def("benchArgs4", benchArgs4).def("benchArgs5", benchArgs5)
+            .def("benchArgs6", benchArgs6).def("benchArgs7", benchArgs7).def("benchArgs8", benchArgs8);
+        binder->managedClass("BenchObject")
+            .def("getValue", &BenchObject::getValue)
+            .def("setValue", &BenchObject::setValue);
+    }
+    return *binder;
+}
+
+static void BM_CallCppFunction(benchmark::State& state) {
+    EulunaEngine euluna;
+    hotPathBinder().registerBindings(&euluna);
+    std::string args;
+    for(int i = 0; i < state.range(0); ++i)
+        args += i == 0 ? "i" : ", i";
+    euluna.safeRunBuffer(euluna_tools::format("function bench() local f = benchArgs%d for i=1,1000 do f(%s) end end", (int)state.range(0), args));
+    EulunaFunctionRef bench(&euluna, "bench");
+    for(auto _ : state)
+        bench.call();
+    state.SetItemsProcessed(state.iterations() * 1000);
+}
+BENCHMARK(BM_CallCppFunction)->DenseRange(0, 8)->Unit(benchmark::kMicrosecond);
+
+// same calls with binding stats enabled timing one of every arg calls, 0 runs without them
+static void BM_CallCppFunctionStats(benchmark::State& state) {
+    EulunaEngine euluna;
+    if(state.range(0))
+        euluna.enableBindingStats()->setSampleInterval(state.range(0));
+    hotPathBinder().registerBindings(&euluna);
+    euluna.safeRunBuffer("function bench() local f = benchArgs2 for i=1,1000 do f(i, i) end end");
+    EulunaFunctionRef bench(&euluna, "bench");
+    for(auto _ : state)
+        bench.call();
+    state.SetItemsProcessed(state.iterations() * 1000);
+}
+BENCHMARK(BM_CallCppFunctionStats)->Arg(0)->Arg(1)->Arg(16)->Unit(benchmark::kMicrosecond);
+
+// member calls resolved through the managed class __index
+static void BM_CallMemberFunction(benchmark::State& state) {
+    EulunaEngine euluna;
+    hotPathBinder().registerBindings(&euluna);
+    BenchObject obj;
+    euluna.pushObject(&obj);
+    euluna.setGlobal("obj");
+    euluna.safeRunBuffer("function bench() local o = obj for i=1,1000 do o:setValue(o:getValue() + 1) end end");
+    EulunaFunctionRef bench(&euluna, "bench");
+    for(auto _ : state)
+        bench.call();
+    state.SetItemsProcessed(state.iterations() * 2000);
+    euluna.releaseObject(&obj);
+}
+BENCHMARK(BM_CallMemberFunction)->Unit(benchmark::kMicrosecond);
+
+// pushing an object that already has a userdata in the weak table
+static void BM_PushObjectHit(benchmark::State& state) {
+    EulunaEngine euluna;
+    hotPathBinder().registerBindings(&euluna);
+    BenchObject obj;
+    euluna.pushObject(&obj);
+    euluna.setGlobal("obj");
+    for(auto _ : state) {
+        euluna.pushObject(&obj);
+        euluna.pop();
+    }
+    euluna.releaseObject(&obj);
+}
+BENCHMARK(BM_PushObjectHit);
+
+// pushing objects that need a new userdata, 1000 per iteration released out of the timing
+static void BM_PushObjectMiss(benchmark::State& state) {
+    EulunaEngine euluna;
+    hotPathBinder().registerBindings(&euluna);
+    std::vector<BenchObject> objs(1000);
+    for(auto _ : state) {
+        for(BenchObject& obj : objs) {
+            euluna.pushObject(&obj);
+            euluna.pop();
+        }
+        state.PauseTiming();
+        for(BenchObject& obj : objs)
+            euluna.releaseObject(&obj);
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * objs.size());
+}
+BENCHMARK(BM_PushObjectMiss)->Unit(benchmark::kMicrosecond);
+
+static void BM_ReleaseObject(benchmark::State& state) {
+    EulunaEngine euluna;
+    hotPathBinder().registerBindings(&euluna);
+    std::vector<BenchObject> objs(1000);
+    for(auto _ : state) {
+        state.PauseTiming();
+        for(BenchObject& obj : objs) {
+            euluna.pushObject(&obj);
+            euluna.pop();
+        }
+        state.ResumeTiming();
+        for(BenchObject& obj : objs)
+            euluna.releaseObject(&obj);
+    }
+    state.SetItemsProcessed(state.iterations() * objs.size());
+}
+BENCHMARK(BM_ReleaseObject)->Unit(benchmark::kMicrosecond);
+
+// container casters, arg is the number of elements
+static void BM_PushVector(benchmark::State& state) {
+    EulunaEngine euluna;
+    std::vector<int> vector(state.range(0), 1);
+    for(auto _ : state) {
+        euluna_caster::push(&euluna, vector);
+        euluna.pop();
+    }
+    state.SetItemsProcessed(state.iterations() * vector.size());
+}
+BENCHMARK(BM_PushVector)->RangeMultiplier(8)->Range(8, 4096);
+
+static void BM_PullVector(benchmark::State& state) {
+    EulunaEngine euluna;
+    euluna_caster::push(&euluna, std::vector<int>(state.range(0), 1));
+    for(auto _ : state) {
+        std::vector<int> vector;
+        euluna_caster::pull(&euluna, -1, vector);
+        benchmark::DoNotOptimize(vector.data());
+    }
+    euluna.pop();
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_PullVector)->RangeMultiplier(8)->Range(8, 4096);
+
+static std::map<std::string, int> benchMap(int size) {
+    std::map<std::string, int> map;
+    for(int i = 0; i < size; ++i)
+        map[euluna_tools::format("key%d", i)] = i;
+    return map;
+}
+
+static void BM_PushMap(benchmark::State& state) {
+    EulunaEngine euluna;
+    std::map<std::string, int> map = benchMap(state.range(0));
+    for(auto _ : state) {
+        euluna_caster::push(&euluna, map);
+        euluna.pop();
+    }
+    state.SetItemsProcessed(state.iterations() * map.size());
+}
+BENCHMARK(BM_PushMap)->RangeMultiplier(8)->Range(8, 4096);
+
+static void BM_PullMap(benchmark::State& state) {
+    EulunaEngine euluna;
+    euluna_caster::push(&euluna, benchMap(state.range(0)));
+    for(auto _ : state) {
+        std::map<std::string, int> map;
+        euluna_caster::pull(&euluna, -1, map);
+        benchmark::DoNotOptimize(map.size());
+    }
+    euluna.pop();
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_PullMap)->RangeMultiplier(8)->Range(8, 4096);
+
+// compiling and running a small chunk
+static void BM_RunBuffer(benchmark::State& state) {
+    EulunaEngine euluna;
+    for(auto _ : state)
+        benchmark::DoNotOptimize(euluna.safeRunBuffer<int>("local a = 1 return a + 1"));
+}
+BENCHMARK(BM_RunBuffer);
+
+// std::function callbacks pulled from lua with arguments and a result
+static void BM_StdFunctionCallbackArgs(benchmark::State& state) {
+    EulunaEngine euluna;
+    auto callback = euluna.safeRunBuffer<std::function<int(int, int, const std::string&)>>("return function(a, b, s) return a + b + #s end");
+    for(auto _ : state)
+        benchmark::DoNotOptimize(callback(1, 2, "three"));
+}
+BENCHMARK(BM_StdFunctionCallbackArgs);
+
+// cost of recording one trace event
+static void BM_TraceScope(benchmark::State& state) {
+    for(auto _ : state) {
+        EulunaTraceScope scope("benchScope", "bench");
+    }
+}
+BENCHMARK(BM_TraceScope);
+
+// parallel kernel over a million elements called from lua, scaling with the number of threads
+static void BM_ParallelKernel(benchmark::State& state) {
+    EulunaBinder binder;
+    EulunaParallel parallel(state.range(0));
+    EulunaEngine euluna;
+    parallel.registerKernel("distance", [](const EulunaKernelArgs& args) {
+        for(size_t i = args.begin; i < args.end; ++i)
+            args.output[i] = std::sqrt(args.inputs[0][i] * args.inputs[0][i] + args.inputs[1][i] * args.inputs[1][i]);
+    });
+    parallel.addBindings(binder);
+    binder.registerBindings(&euluna);
+    euluna.runBuffer(R"(
+        xs = EulunaNumericBuffer.create(1000000, 3)
+        ys = EulunaNumericBuffer.create(1000000, 4)
+        out = EulunaNumericBuffer.create(1000000)
+        function runKernel() parallel.run('distance', out, xs, ys) end
+    )");
+    for(auto _ : state)
+        euluna.callGlobal("runKernel");
+    state.SetItemsProcessed(state.iterations() * 1000000);
+}
+BENCHMARK(BM_ParallelKernel)->Apply([](benchmark::internal::Benchmark* b) {
+    for(int threads = 1; threads <= (int)std::max(std::thread::hardware_concurrency(), 4u); threads *= 2)
+        b->Arg(threads);
+})->UseRealTime();
+
+// the same computation as a lua loop over tables
+static void BM_ParallelKernelLuaLoop(benchmark::State& state) {
+    EulunaEngine euluna;
+    euluna.runBuffer(R"(
+        xs, ys, out = {}, {}, {}
+        for i=1,1000000 do xs[i] = 3 ys[i] = 4 end
+        local sqrt = math.sqrt
+        function runLoop() for i=1,1000000 do out[i] = sqrt(xs[i] * xs[i] + ys[i] * ys[i]) end end
+    )");
+    for(auto _ : state)
+        euluna.callGlobal("runLoop");
+    state.SetItemsProcessed(state.iterations() * 1000000);
+}
+BENCHMARK(BM_ParallelKernelLuaLoop);
+
+// pushing a capturing lambda as a lua function and collecting it
+static void BM_PushCppFunctionLambda(benchmark::State& state) {
+    EulunaEngine euluna;
+    int a = 1, b = 2;
+    std::string c = "three";
+    for(auto _ : state) {
+        euluna.pushCppFunction([&a, &b, &c](EulunaInterface* lua) { lua->pushInteger(a + b + c.size()); return 1; }, "lambda");
+        euluna.pop();
+    }
+    euluna.collect();
+}
+BENCHMARK(BM_PushCppFunctionLambda);
+
+// pushing a std::function callback to lua
+static void BM_PushStdFunctionCallback(benchmark::State& state) {
+    EulunaEngine euluna;
+    std::function<int(int, int)> callback = [](int a, int b) { return a + b; };
+    for(auto _ : state) {
+        euluna.polymorphicPush(callback);
+        euluna.pop();
+    }
+    euluna.collect();
+}
+BENCHMARK(BM_PushStdFunctionCallback);
+
+BENCHMARK_MAIN();
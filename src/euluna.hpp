@@ -27,9 +27,21 @@
 #include "eulunatools.hpp"
 #include "eulunaexception.hpp"
 #include "eulunainterface.hpp"
+#include "eulunaenum.hpp"
 #include "eulunacaster.hpp"
+#include "eulunaasync.hpp"
+#include "eulunaallocator.hpp"
 #include "eulunaengine.hpp"
+#include "eulunafunctionref.hpp"
 #include "eulunabinder.hpp"
+#include "eulunathreadpool.hpp"
+#include "eulunaenginepool.hpp"
+#include "eulunastatepool.hpp"
+#include "eulunareloader.hpp"
+#include "eulunasignal.hpp"
+#include "eulunachannel.hpp"
+#include "eulunaprofiler.hpp"
+#include "eulunaparallel.hpp"
 
 #endif // EULUNA_HPP
 
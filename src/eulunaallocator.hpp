@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2016 Euluna <https://github.com/edubart/euluna>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef EULUNAALLOCATOR_HPP
+#define EULUNAALLOCATOR_HPP
+
+#include "eulunaprereqs.hpp"
+
+// Memory allocator of a lua state, it keeps the memory accounting and the memory limit,
+// each lua state must have its own allocator
+class EulunaAllocator {
+public:
+    EulunaAllocator() { }
+    virtual ~EulunaAllocator() { }
+
+    EulunaAllocator(const EulunaAllocator&) = delete;
+    EulunaAllocator& operator=(const EulunaAllocator&) = delete;
+
+    // lua_Alloc function, the allocator is the user data
+    static void* luaAlloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+        EulunaAllocator *allocator = static_cast<EulunaAllocator*>(ud);
+        // when ptr is null lua 5.2+ passes the object type in osize
+        if(!ptr)
+            osize = 0;
+        if(nsize == 0) {
+            if(ptr) {
+                allocator->deallocate(ptr, osize);
+                allocator->account(-(int64_t)osize);
+            }
+            return nullptr;
+        }
+        // failing shrinks is not allowed, only growths are limited
+        if(nsize > osize && allocator->m_protectedDepth > 0) {
+            size_t limit = allocator->m_memoryLimit.load(std::memory_order_relaxed);
+            if(limit > 0 && allocator->getLiveBytes() + (nsize - osize) > limit)
+                return nullptr;
+        }
+        void *ret = ptr ? allocator->reallocate(ptr, osize, nsize) : allocator->allocate(nsize);
+        if(!ret)
+            return nullptr;
+        allocator->account((int64_t)nsize - (int64_t)osize);
+        return ret;
+    }
+
+    // maximum bytes the lua state can use, 0 disables the limit, allocations above it fail with memory errors,
+    // the limit is only enforced inside protected calls because memory errors outside them abort the application
+    void setMemoryLimit(size_t limit) { m_memoryLimit.store(limit, std::memory_order_relaxed); }
+    size_t getMemoryLimit() const { return m_memoryLimit.load(std::memory_order_relaxed); }
+
+    // called with the lua state using the allocator once it is created, and with null before it is closed
+    virtual void attach(lua_State *L) { }
+
+    // these can be read from any thread
+    size_t getLiveBytes() const { return m_liveBytes.load(std::memory_order_relaxed); }
+    size_t getPeakBytes() const { return m_peakBytes.load(std::memory_order_relaxed); }
+    void resetPeakBytes() { m_peakBytes.store(getLiveBytes(), std::memory_order_relaxed); }
+
+    // marks a protected call of a lua state, does nothing for states not using an EulunaAllocator
+    class ProtectedScope {
+    public:
+        explicit ProtectedScope(lua_State *L) {
+            void *ud;
+            m_allocator = lua_getallocf(L, &ud) == &EulunaAllocator::luaAlloc ? static_cast<EulunaAllocator*>(ud) : nullptr;
+            if(m_allocator)
+                m_allocator->m_protectedDepth++;
+        }
+        ~ProtectedScope() {
+            if(m_allocator)
+                m_allocator->m_protectedDepth--;
+        }
+        ProtectedScope(const ProtectedScope&) = delete;
+        ProtectedScope& operator=(const ProtectedScope&) = delete;
+    private:
+        EulunaAllocator *m_allocator;
+    };
+
+protected:
+    virtual void* allocate(size_t size) { return std::malloc(size); }
+    virtual void* reallocate(void *ptr, size_t oldSize, size_t newSize) { return std::realloc(ptr, newSize); }
+    virtual void deallocate(void *ptr, size_t size) { std::free(ptr); }
+
+private:
+    void account(int64_t delta) {
+        // only the thread running the lua state writes the counters, so no atomic read-modify-write is needed
+        size_t live = getLiveBytes() + delta;
+        m_liveBytes.store(live, std::memory_order_relaxed);
+        if(live > getPeakBytes())
+            m_peakBytes.store(live, std::memory_order_relaxed);
+    }
+
+    std::atomic<size_t> m_liveBytes{0};
+    std::atomic<size_t> m_peakBytes{0};
+    std::atomic<size_t> m_memoryLimit{0};
+    int m_protectedDepth = 0;
+};
+
+// Allocator that serves lua small blocks from size class free lists carved from big chunks,
+// freed blocks are reused by the same state and the chunks are only released when the state is closed
+class EulunaPoolAllocator : public EulunaAllocator {
+public:
+    enum {
+        GRANULARITY = 16,
+        MAX_POOLED_SIZE = 512,
+        NUM_SIZE_CLASSES = MAX_POOLED_SIZE / GRANULARITY,
+        CHUNK_SIZE = 64 * 1024
+    };
+
+    EulunaPoolAllocator() {
+        std::memset(m_freeLists, 0, sizeof(m_freeLists));
+    }
+    ~EulunaPoolAllocator() {
+        for(char *chunk : m_chunks)
+            std::free(chunk);
+    }
+
+    // bytes reserved from the system for pooled blocks
+    size_t getReservedBytes() const { return m_chunks.size() * CHUNK_SIZE; }
+
+protected:
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    static int sizeClass(size_t size) { return (int)((size + GRANULARITY - 1) / GRANULARITY) - 1; }
+    static size_t classSize(int sizeClass) { return (size_t)(sizeClass + 1) * GRANULARITY; }
+
+    virtual void* allocate(size_t size) {
+        if(size > MAX_POOLED_SIZE)
+            return std::malloc(size);
+        int index = sizeClass(size);
+        FreeBlock *block = m_freeLists[index];
+        if(block) {
+            m_freeLists[index] = block->next;
+            return block;
+        }
+        return carve(classSize(index));
+    }
+
+    virtual void* reallocate(void *ptr, size_t oldSize, size_t newSize) {
+        if(oldSize > MAX_POOLED_SIZE && newSize > MAX_POOLED_SIZE)
+            return std::realloc(ptr, newSize);
+        // the block already fits
+        if(oldSize <= MAX_POOLED_SIZE && newSize <= MAX_POOLED_SIZE && sizeClass(oldSize) == sizeClass(newSize))
+            return ptr;
+        void *ret = allocate(newSize);
+        if(!ret)
+            return nullptr;
+        std::memcpy(ret, ptr, std::min(oldSize, newSize));
+        deallocate(ptr, oldSize);
+        return ret;
+    }
+
+    virtual void deallocate(void *ptr, size_t size) {
+        if(size > MAX_POOLED_SIZE) {
+            std::free(ptr);
+            return;
+        }
+        int index = sizeClass(size);
+        FreeBlock *block = static_cast<FreeBlock*>(ptr);
+        block->next = m_freeLists[index];
+        m_freeLists[index] = block;
+    }
+
+private:
+    void* carve(size_t size) {
+        if(m_chunkUsed + size > CHUNK_SIZE || m_chunks.empty()) {
+            char *chunk = static_cast<char*>(std::malloc(CHUNK_SIZE));
+            if(!chunk)
+                return nullptr;
+            m_chunks.push_back(chunk);
+            m_chunkUsed = 0;
+        }
+        void *ret = m_chunks.back() + m_chunkUsed;
+        m_chunkUsed += size;
+        return ret;
+    }
+
+    FreeBlock *m_freeLists[NUM_SIZE_CLASSES];
+    std::vector<char*> m_chunks;
+    size_t m_chunkUsed = 0;
+};
+
+// Allocator that attributes sampled allocations to the lua source line running and to the C++ binding
+// active when they were made, about one allocation every sampleInterval bytes is sampled and
+// stands for sampleInterval bytes, so live bytes and allocation rates per site are estimates.
+// Allocations made by coroutines are attributed to the line resuming them in the main thread.
+// Must only be used by the thread running the lua state
+template<class Base = EulunaAllocator>
+class EulunaTrackingAllocator : public Base {
+public:
+    struct Site {
+        std::string location;
+        std::string binding;
+        int64_t liveBytes = 0;
+        uint64_t allocatedBytes = 0;
+        uint64_t samples = 0;
+    };
+
+    struct Snapshot {
+        std::chrono::steady_clock::time_point time;
+        std::vector<Site> sites;
+    };
+
+    struct SiteDiff {
+        std::string location;
+        std::string binding;
+        int64_t liveBytesDelta;
+        double allocatedBytesPerSecond;
+    };
+
+    // the call site is only looked up at sampled allocations, about one every sampleInterval bytes,
+    // the other allocations just decrement a counter
+    explicit EulunaTrackingAllocator(size_t sampleInterval = 64 * 1024) :
+        m_sampleInterval(std::max<size_t>(sampleInterval, 1)), m_untilSample(m_sampleInterval) { }
+
+    virtual void attach(lua_State *L) { this->L = L; }
+
+    Snapshot snapshot() const {
+        Snapshot snapshot;
+        snapshot.time = std::chrono::steady_clock::now();
+        snapshot.sites = m_sites;
+        return snapshot;
+    }
+
+    // sites sorted by the growth of their live bytes between two snapshots
+    static std::vector<SiteDiff> diff(const Snapshot& before, const Snapshot& after) {
+        std::map<std::pair<std::string, std::string>, const Site*> beforeSites;
+        for(const Site& site : before.sites)
+            beforeSites[std::make_pair(site.location, site.binding)] = &site;
+        double seconds = std::chrono::duration<double>(after.time - before.time).count();
+        std::vector<SiteDiff> diffs;
+        for(const Site& site : after.sites) {
+            auto it = beforeSites.find(std::make_pair(site.location, site.binding));
+            const Site *old = it != beforeSites.end() ? it->second : nullptr;
+            int64_t liveDelta = site.liveBytes - (old ? old->liveBytes : 0);
+            uint64_t allocated = site.allocatedBytes - (old ? old->allocatedBytes : 0);
+            if(liveDelta == 0 && allocated == 0)
+                continue;
+            diffs.push_back(SiteDiff{site.location, site.binding, liveDelta, seconds > 0 ? allocated / seconds : 0.0});
+        }
+        std::sort(diffs.begin(), diffs.end(), [](const SiteDiff& a, const SiteDiff& b) { return a.liveBytesDelta > b.liveBytesDelta; });
+        return diffs;
+    }
+
+protected:
+    virtual void* allocate(size_t size) {
+        if(m_inBase)
+            return Base::allocate(size);
+        int site = sample(size);
+        void *ret = baseCall([&] { return Base::allocate(size); });
+        if(ret && site >= 0)
+            track(ret, site, size);
+        return ret;
+    }
+
+    virtual void* reallocate(void *ptr, size_t oldSize, size_t newSize) {
+        if(m_inBase)
+            return Base::reallocate(ptr, oldSize, newSize);
+        size_t growth = newSize > oldSize ? newSize - oldSize : 0;
+        auto it = m_blocks.find(ptr);
+        // sites are looked up before the memory moves, the lua stack may be the block being moved
+        int site = it == m_blocks.end() && growth > 0 ? sample(growth) : -1;
+        void *ret = baseCall([&] { return Base::reallocate(ptr, oldSize, newSize); });
+        if(!ret)
+            return nullptr;
+        if(it != m_blocks.end()) {
+            // growths of sampled blocks are attributed to the site that allocated them
+            Block block = it->second;
+            m_blocks.erase(it);
+            block.bytes += growth;
+            m_sites[block.site].liveBytes += growth;
+            m_sites[block.site].allocatedBytes += growth;
+            m_blocks[ret] = block;
+        } else if(site >= 0)
+            track(ret, site, growth);
+        return ret;
+    }
+
+    virtual void deallocate(void *ptr, size_t size) {
+        if(!m_inBase && !m_blocks.empty()) {
+            auto it = m_blocks.find(ptr);
+            if(it != m_blocks.end()) {
+                m_sites[it->second.site].liveBytes -= it->second.bytes;
+                m_blocks.erase(it);
+            }
+        }
+        Base::deallocate(ptr, size);
+    }
+
+private:
+    struct Block {
+        int site;
+        size_t bytes;
+    };
+
+    // base allocators may implement reallocations with their own allocate and deallocate,
+    // those calls must not be tracked again
+    template<typename F>
+    void* baseCall(const F& f) {
+        m_inBase = true;
+        void *ret = f();
+        m_inBase = false;
+        return ret;
+    }
+
+    // returns the site of the allocation when it is sampled, or -1
+    int sample(size_t size) {
+        m_untilSample -= (int64_t)size;
+        if(m_untilSample > 0)
+            return -1;
+        while(m_untilSample <= 0)
+            m_untilSample += m_sampleInterval;
+        // allocations made while walking the frames are not sampled again
+        m_inBase = true;
+        int site = findSite();
+        m_inBase = false;
+        return site;
+    }
+
+    void track(void *ptr, int site, size_t size) {
+        size_t bytes = std::max(size, m_sampleInterval);
+        m_blocks[ptr] = Block{site, bytes};
+        m_sites[site].liveBytes += bytes;
+        m_sites[site].allocatedBytes += bytes;
+        m_sites[site].samples++;
+    }
+
+    // the debug info used here only reads the call frames, nothing is pushed in the middle of an allocation,
+    // names are only resolved for the innermost C frame
+    int findSite() {
+        std::string location = "[C++]";
+        std::string binding;
+        lua_Debug ar;
+        for(int level = 0; L && lua_getstack(L, level, &ar); ++level) {
+            lua_getinfo(L, "Sl", &ar);
+            if(ar.what[0] == 'C') {
+                if(binding.empty()) {
+                    lua_getinfo(L, "n", &ar);
+                    binding = ar.name ? ar.name : "?";
+                }
+            } else {
+                location = std::string(ar.short_src) + ":" + std::to_string(ar.currentline);
+                break;
+            }
+        }
+        std::string key = location + '\0' + binding;
+        auto it = m_siteIndexes.find(key);
+        if(it != m_siteIndexes.end())
+            return it->second;
+        Site site;
+        site.location = location;
+        site.binding = binding;
+        m_sites.push_back(site);
+        m_siteIndexes[key] = m_sites.size() - 1;
+        return m_sites.size() - 1;
+    }
+
+    lua_State *L = nullptr;
+    size_t m_sampleInterval;
+    int64_t m_untilSample;
+    std::vector<Site> m_sites;
+    std::unordered_map<std::string, int> m_siteIndexes;
+    std::unordered_map<void*, Block> m_blocks;
+    bool m_inBase = false;
+};
+
+#endif // EULUNAALLOCATOR_HPP
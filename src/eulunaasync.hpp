@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2016 Euluna <https://github.com/edubart/euluna>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef EULUNAASYNC_HPP
+#define EULUNAASYNC_HPP
+
+#include "eulunainterface.hpp"
+
+// Result that a coroutine waits for, poll tells whether it's ready
+// and resume pushes the values that the awaiting call returns
+class EulunaAwaitable {
+public:
+    EulunaAwaitable() { }
+    EulunaAwaitable(std::function<bool()> poll, std::function<int(EulunaInterface*)> resume) :
+        m_poll(std::move(poll)), m_resume(std::move(resume)) { }
+
+    bool isValid() const { return !!m_resume; }
+    bool poll() { return !m_poll || m_poll(); }
+    int resume(EulunaInterface *lua) { return m_resume ? m_resume(lua) : 0; }
+
+private:
+    std::function<bool()> m_poll;
+    std::function<int(EulunaInterface*)> m_resume;
+};
+
+// Runs lua functions as coroutines that can wait for async results,
+// finished coroutines are kept in a bounded pool to be reused
+class EulunaScheduler {
+public:
+    explicit EulunaScheduler(EulunaInterface *lua, size_t poolSize = 32) : m_lua(lua), m_poolSize(poolSize) {
+        m_lua->pushLightUserdata(this);
+        lua_rawsetp(m_lua->luaState(), LUA_REGISTRYINDEX, schedulerKey());
+    }
+
+    ~EulunaScheduler() {
+        for(Coroutine& co : m_idle)
+            m_lua->unref(co.ref);
+        for(Coroutine& co : m_waiting)
+            m_lua->unref(co.ref);
+        m_lua->pushNil();
+        lua_rawsetp(m_lua->luaState(), LUA_REGISTRYINDEX, schedulerKey());
+    }
+
+    EulunaScheduler(const EulunaScheduler&) = delete;
+    EulunaScheduler& operator=(const EulunaScheduler&) = delete;
+
+    // returns the scheduler of a lua state, if any
+    static EulunaScheduler* get(EulunaInterface *lua) {
+        lua_rawgetp(lua->luaState(), LUA_REGISTRYINDEX, schedulerKey());
+        EulunaScheduler *scheduler = static_cast<EulunaScheduler*>(lua->toUserdata());
+        lua->pop();
+        return scheduler;
+    }
+
+    // whether the running function was called from an async call, so it can await
+    static bool canAwait(EulunaInterface *lua) {
+        EulunaScheduler *scheduler = get(lua);
+        return scheduler && scheduler->m_running && scheduler->m_running->thread == lua->luaState();
+    }
+
+    // makes the running coroutine wait for the awaitable, the returned value must be returned by the bound function
+    static int await(EulunaInterface *lua, EulunaAwaitable awaitable) {
+        if(!canAwait(lua))
+            throw EulunaEngineError("Attempt to await an async result outside of an async call");
+        get(lua)->m_running->awaiting = std::move(awaitable);
+        return EULUNA_YIELD;
+    }
+
+    // runs the function with its arguments at the top of the stack as a coroutine,
+    // returns true if the coroutine is still running
+    bool spawn(int numArgs = 0) {
+        assert(m_lua->isFunction(-numArgs-1));
+        Coroutine co;
+        if(!m_idle.empty()) {
+            co = std::move(m_idle.back());
+            m_idle.pop_back();
+        } else {
+            co.thread = m_lua->newThread();
+            co.ref = m_lua->ref();
+            m_created++;
+        }
+        // move the function and its arguments to the coroutine
+        m_lua->xmove(co.thread, numArgs + 1);
+        return resume(co, numArgs);
+    }
+
+    // resumes the coroutines whose results are ready, returns the number of coroutines still waiting
+    size_t poll() {
+        std::string error;
+        // coroutines spawned or suspended while resuming are left for the next poll
+        std::vector<Coroutine> waiting;
+        waiting.swap(m_waiting);
+        for(size_t i = 0; i < waiting.size(); ++i) {
+            Coroutine& co = waiting[i];
+            if(!co.awaiting.poll()) {
+                m_waiting.push_back(std::move(co));
+                continue;
+            }
+            EulunaInterface lua(co.thread);
+            int numArgs;
+            try {
+                numArgs = co.awaiting.resume(&lua);
+            } catch(std::exception& e) {
+                lua.clearStack();
+                lua.pushNil();
+                lua.pushString(e.what());
+                numArgs = 2;
+            }
+            co.awaiting = EulunaAwaitable();
+            try {
+                resume(co, numArgs);
+            } catch(std::exception& e) {
+                if(error.empty())
+                    error = e.what();
+            }
+        }
+        if(!error.empty())
+            throw EulunaRuntimeError(error);
+        return m_waiting.size();
+    }
+
+    size_t getWaitingCount() const { return m_waiting.size(); }
+    size_t getIdleCount() const { return m_idle.size(); }
+    size_t getCreatedCount() const { return m_created; }
+    void setPoolSize(size_t poolSize) {
+        m_poolSize = poolSize;
+        while(m_idle.size() > m_poolSize) {
+            m_lua->unref(m_idle.back().ref);
+            m_idle.pop_back();
+        }
+    }
+
+private:
+    struct Coroutine {
+        lua_State *thread = nullptr;
+        int ref = LUA_NOREF;
+        EulunaAwaitable awaiting;
+    };
+
+    static void* schedulerKey() {
+        static char key;
+        return &key;
+    }
+
+    bool resume(Coroutine& co, int numArgs) {
+        Coroutine *running = m_running;
+        m_running = &co;
+        int status = m_lua->resume(co.thread, numArgs);
+        m_running = running;
+        EulunaInterface lua(co.thread);
+        if(status == LUA_YIELD) {
+            // yields with no awaitable just wait for the next poll
+            lua.clearStack();
+            m_waiting.push_back(std::move(co));
+            return true;
+        } else if(status == LUA_OK) {
+            lua.clearStack();
+            if(m_idle.size() < m_poolSize)
+                m_idle.push_back(std::move(co));
+            else
+                m_lua->unref(co.ref);
+            return false;
+        }
+        // dead coroutines can't be reused
+        std::string error = lua.popString();
+        luaL_traceback(m_lua->luaState(), co.thread, error.c_str(), 0);
+        error = m_lua->popString();
+        m_lua->unref(co.ref);
+        if(EulunaWatchdog::isTripped(m_lua->luaState()))
+            throw EulunaBudgetExceededError(error);
+        throw EulunaRuntimeError(error);
+    }
+
+    EulunaInterface *m_lua;
+    size_t m_poolSize;
+    size_t m_created = 0;
+    Coroutine *m_running = nullptr;
+    std::vector<Coroutine> m_idle;
+    std::vector<Coroutine> m_waiting;
+};
+
+namespace euluna_caster {
+
+// awaitable
+inline int push(EulunaInterface *lua, EulunaAwaitable& awaitable) {
+    return EulunaScheduler::await(lua, std::move(awaitable));
+}
+
+// std::future, the awaiting call returns the future value or nil plus the error message
+template<typename T>
+int push_future_result(EulunaInterface *lua, std::future<T>& future) {
+    T value = future.get();
+    return push(lua, value);
+}
+inline int push_future_result(EulunaInterface *lua, std::future<void>& future) {
+    future.get();
+    return 0;
+}
+
+template<typename T>
+int push(EulunaInterface *lua, std::future<T>& future) {
+    if(!future.valid())
+        throw EulunaEngineError("Attempt to await an invalid future");
+    // checked before taking the future, so a failed await leaves it with the binding that returned it
+    if(!EulunaScheduler::canAwait(lua))
+        throw EulunaEngineError("Attempt to await an async result outside of an async call");
+    std::shared_ptr<std::future<T>> shared(new std::future<T>(std::move(future)));
+    return EulunaScheduler::await(lua, EulunaAwaitable([shared] {
+        // deferred futures are run when getting their value
+        return shared->wait_for(std::chrono::seconds(0)) != std::future_status::timeout;
+    }, [shared](EulunaInterface *lua) -> int {
+        try {
+            return push_future_result(lua, *shared);
+        } catch(std::exception& e) {
+            lua->pushNil();
+            lua->pushString(e.what());
+            return 2;
+        }
+    }));
+}
+
+}
+
+#endif // EULUNAASYNC_HPP
@@ -25,6 +25,7 @@
 
 #include "eulunaengine.hpp"
 #include "eulunabinderdetail.hpp"
+#include "eulunaffi.hpp"
 
 class EulunaBinder
 {
@@ -32,6 +33,59 @@ class EulunaBinder
     public:
         virtual ~Binder() {}
         virtual void registerBindings(EulunaEngine *euluna) = 0;
+        // names that this binder sets in the globals table
+        virtual void getGlobalNames(std::vector<std::string>& names) = 0;
+        // registers only what is needed to define the given global name
+        virtual void registerGlobalName(EulunaEngine *euluna, const std::string& name) { registerBindings(euluna); }
+
+    protected:
+        // registers the functions in the class table, looking up the table once
+        void registerClassFunctions(EulunaEngine *euluna, const std::string& className, const std::map<std::string,EulunaCppFunctionPtr>& functions) {
+            if(!functions.empty()) {
+                euluna->getGlobal(className);
+                assert(euluna->isTable());
+                for(auto& it : functions) {
+                    if(registerFfiFunction(euluna, className, it.first))
+                        continue;
+                    euluna->pushCppFunction(it.second.get(), className + ":" + it.first);
+                    euluna->setField(it.first);
+                }
+                euluna->pop();
+            }
+            for(const luaL_Reg* table : m_tables)
+                euluna->registerClassFunctions(className, table);
+        }
+
+        // static tables of lua C functions ended by a null entry, see EULUNA_BEGIN_STATIC_*
+        std::vector<const luaL_Reg*> m_tables;
+
+        struct FfiFunction {
+            std::string signature;
+            void *function;
+        };
+        std::map<std::string,FfiFunction> m_ffiFunctions;
+
+        // remembers plain C++ functions with arithmetic signatures, they can be called through the LuaJIT FFI
+        template<typename F>
+        void defFfi(const std::string& functionName, F function) {
+            defFfi(functionName, function, euluna_ffi::signature<F>());
+        }
+        template<typename F>
+        void defFfi(const std::string& functionName, F function, std::true_type) {
+            m_ffiFunctions[functionName] = FfiFunction{euluna_ffi::signature<F>::str(), reinterpret_cast<void*>(function)};
+        }
+        template<typename F>
+        void defFfi(const std::string&, const F&, std::false_type) { }
+
+        // returns false when the function must be registered through the lua C API
+        bool registerFfiFunction(EulunaEngine *euluna, const std::string& className, const std::string& functionName) {
+#ifdef EULUNA_LUAJIT_FFI
+            auto it = m_ffiFunctions.find(functionName);
+            if(it != m_ffiFunctions.end())
+                return euluna->registerFfiFunction(className, functionName, it->second.signature, it->second.function);
+#endif
+            return false;
+        }
     };
 
     class BinderGlobals : public Binder {
@@ -42,12 +96,43 @@ class EulunaBinder
         BinderGlobals& def(const std::string& functionName, F function) {
             if(m_functions.find(functionName) != m_functions.end())
                 throw EulunaEngineError(euluna_tools::format("Global function '%s' is already defined", functionName));
+            defFfi(functionName, function);
             m_functions[functionName] = EulunaCppFunctionPtr(new EulunaCppFunction(euluna_binder::bind_fun(std::forward<F>(function))));
             return *this;
         };
+        // adds a static table of lua C functions ended by a null entry
+        BinderGlobals& defTable(const luaL_Reg* functions) {
+            m_tables.push_back(functions);
+            return *this;
+        }
         virtual void registerBindings(EulunaEngine *euluna) {
+            for(auto& it : m_functions) {
+                if(!registerFfiFunction(euluna, "", it.first))
+                    euluna->registerGlobalFunction(it.first, it.second.get());
+            }
+            for(const luaL_Reg* table : m_tables)
+                euluna->registerGlobalFunctions(table);
+        }
+        virtual void getGlobalNames(std::vector<std::string>& names) {
             for(auto& it : m_functions)
-                euluna->registerGlobalFunction(it.first, it.second.get());
+                names.push_back(it.first);
+            for(const luaL_Reg* table : m_tables) {
+                for(const luaL_Reg* reg = table; reg->name; ++reg)
+                    names.push_back(reg->name);
+            }
+        }
+        virtual void registerGlobalName(EulunaEngine *euluna, const std::string& name) {
+            auto it = m_functions.find(name);
+            if(it != m_functions.end() && !registerFfiFunction(euluna, "", it->first))
+                euluna->registerGlobalFunction(it->first, it->second.get());
+            for(const luaL_Reg* table : m_tables) {
+                for(const luaL_Reg* reg = table; reg->name; ++reg) {
+                    if(name == reg->name) {
+                        euluna->pushCFunction(reg->func);
+                        euluna->setGlobal(name);
+                    }
+                }
+            }
         }
     };
 
@@ -60,14 +145,46 @@ class EulunaBinder
         BinderSingleton& def(const std::string& functionName, F function) {
             if(m_functions.find(functionName) != m_functions.end())
                 throw EulunaEngineError(euluna_tools::format("Function '%s' for singleton '%s' is already defined", functionName, m_name));
+            defFfi(functionName, function);
             m_functions[functionName] = EulunaCppFunctionPtr(new EulunaCppFunction(euluna_binder::bind_fun(std::forward<F>(function))));
             return *this;
         };
+        // adds a static table of lua C functions ended by a null entry
+        BinderSingleton& defTable(const luaL_Reg* functions) {
+            m_tables.push_back(functions);
+            return *this;
+        }
         virtual void registerBindings(EulunaEngine *euluna) {
             euluna->registerSingletonClass(m_name);
-            for(auto& it : m_functions)
-                euluna->registerClassFunction(m_name, it.first, it.second.get());
+            registerClassFunctions(euluna, m_name, m_functions);
         }
+        virtual void getGlobalNames(std::vector<std::string>& names) { names.push_back(m_name); }
+    };
+
+    template<typename E>
+    class BinderEnum : public Binder {
+        std::string m_name;
+        std::vector<std::pair<std::string,E>> m_values;
+    public:
+        explicit BinderEnum(const std::string& name) : m_name(name) { }
+        BinderEnum& value(const std::string& valueName, E value) {
+            for(auto& it : m_values) {
+                if(it.first == valueName)
+                    throw EulunaEngineError(euluna_tools::format("Enumerator '%s' for enum '%s' is already defined", valueName, m_name));
+            }
+            m_values.emplace_back(valueName, value);
+            EulunaEnum<E>::add(valueName, value);
+            return *this;
+        }
+        virtual void registerBindings(EulunaEngine *euluna) {
+            euluna->createTable(0, m_values.size());
+            for(auto& it : m_values) {
+                euluna->pushInteger((typename EulunaEnum<E>::underlying_type)it.second);
+                euluna->setField(it.first);
+            }
+            euluna->setGlobal(m_name);
+        }
+        virtual void getGlobalNames(std::vector<std::string>& names) { names.push_back(m_name); }
     };
 
     class BinderSingletonClass : public Binder {
@@ -83,6 +200,7 @@ class EulunaBinder
         BinderSingletonClass& defStatic(const std::string& functionName, F&& function) {
             if(m_functions.find(functionName) != m_functions.end())
                 throw EulunaEngineError(euluna_tools::format("Static function '%s' for singleton '%s' is already defined", functionName, m_name));
+            defFfi(functionName, typename std::decay<F>::type(function));
             m_functions[functionName] = EulunaCppFunctionPtr(new EulunaCppFunction(euluna_binder::bind_fun(std::forward<F>(function))));
             return *this;
         };
@@ -94,11 +212,16 @@ class EulunaBinder
             m_functions[functionName] = EulunaCppFunctionPtr(new EulunaCppFunction(euluna_binder::bind_singleton_mem_fun(std::forward<decltype(function)>(function), static_cast<C*>(m_instance))));
             return *this;
         }
+        // adds a static table of lua C functions ended by a null entry
+        BinderSingletonClass& defTable(const luaL_Reg* functions) {
+            m_tables.push_back(functions);
+            return *this;
+        }
         virtual void registerBindings(EulunaEngine *euluna) {
             euluna->registerSingletonClass(m_name);
-            for(auto& it : m_functions)
-                euluna->registerClassFunction(m_name, it.first, it.second.get());
+            registerClassFunctions(euluna, m_name, m_functions);
         }
+        virtual void getGlobalNames(std::vector<std::string>& names) { names.push_back(m_name); }
     };
 
     class BinderManagedClass : public Binder {
@@ -113,6 +236,7 @@ class EulunaBinder
         BinderManagedClass& defStatic(const std::string& functionName, F&& function) {
             if(m_functions.find(functionName) != m_functions.end())
                 throw EulunaEngineError(euluna_tools::format("Static function '%s' for managed class '%s' is already defined", functionName, m_name));
+            defFfi(functionName, typename std::decay<F>::type(function));
             m_functions[functionName] = EulunaCppFunctionPtr(new EulunaCppFunction(euluna_binder::bind_fun(std::forward<F>(function))));
             return *this;
         };
@@ -139,11 +263,16 @@ class EulunaBinder
             };
             return *this;
         };
+        // adds a static table of lua C functions ended by a null entry
+        BinderManagedClass& defTable(const luaL_Reg* functions) {
+            m_tables.push_back(functions);
+            return *this;
+        }
         virtual void registerBindings(EulunaEngine *euluna) {
             euluna->registerManagedClass(m_name, m_base, m_useHandler, m_releaseHandler);
-            for(auto& it : m_functions)
-                euluna->registerClassFunction(m_name, it.first, it.second.get());
+            registerClassFunctions(euluna, m_name, m_functions);
         }
+        virtual void getGlobalNames(std::vector<std::string>& names) { names.push_back(m_name); }
     };
 
 public:
@@ -156,12 +285,41 @@ public:
         instance().registerBindings(euluna);
     }
 
+    static void registerGlobalBindingsLazy(EulunaEngine* euluna) {
+        instance().registerBindingsLazy(euluna);
+    }
+
     // Do the bindings
     void registerBindings(EulunaEngine* euluna) {
+        EULUNA_TRACE_SCOPE("registerBindings", "binder");
         for(auto& binder : m_binders)
             binder->registerBindings(euluna);
     }
 
+    // Only installs an __index hook in the globals table, classes, singletons and global functions
+    // are created the first time they are accessed, binders added after this are only seen by states registered later.
+    // The hook is removed once every name was registered, so reading undefined globals stops calling it
+    void registerBindingsLazy(EulunaEngine* euluna) {
+        std::shared_ptr<const LazyIndex> index = buildLazyIndex();
+        euluna->pushGlobalTable();
+        if(euluna->getMetaField("__index") != 0) {
+            euluna->pop(2);
+            throw EulunaEngineError("Unable to register lazy bindings because the globals table already has an __index metamethod");
+        }
+        auto state = std::make_shared<LazyState>();
+        if(!lua_getmetatable(euluna->luaState(), -1)) {
+            euluna->newTable();
+            euluna->pushValue();
+            euluna->setMetatable(-3);
+            state->createdMetatable = true;
+        }
+        euluna->pushCppFunction([index, state](EulunaInterface* lua) {
+            return lazyIndex(lua, *index, *state);
+        }, "_G:__index");
+        euluna->setField("__index");
+        euluna->pop(2);
+    }
+
     // Binders
     EulunaBinder::BinderGlobals& globals() {
         auto ret = new BinderGlobals();
@@ -180,6 +338,13 @@ public:
         return *ret;
     }
 
+    template<typename E>
+    EulunaBinder::BinderEnum<E>& enumeration(const std::string& name) {
+        auto ret = new BinderEnum<E>(name);
+        m_binders.push_back(std::unique_ptr<Binder>(static_cast<Binder*>(ret)));
+        return *ret;
+    }
+
     EulunaBinder::BinderManagedClass& managedClass(const std::string& name, const std::string& base = std::string()) {
         auto ret = new BinderManagedClass(name, base);
         m_binders.push_back(std::unique_ptr<Binder>(static_cast<Binder*>(ret)));
@@ -187,7 +352,85 @@ public:
     }
 
 private:
+    typedef std::unordered_map<std::string, std::vector<Binder*>> LazyIndex;
+
+    // lazy registration of a lua state
+    struct LazyState {
+        // names being registered, they must not be registered again when accessed by their binders
+        std::unordered_set<std::string> registering;
+        // names registered at least once, the hook is removed when they are all of the index
+        std::unordered_set<std::string> registered;
+        bool createdMetatable = false;
+    };
+
+    // indexes are never modified once built, states hooked with an older index keep reading it
+    // while a newer one is built for the binders added since then
+    std::shared_ptr<const LazyIndex> buildLazyIndex() {
+        std::lock_guard<std::mutex> lock(m_lazyMutex);
+        if(m_lazyIndex && m_lazyIndexedBinders == m_binders.size())
+            return m_lazyIndex;
+        std::shared_ptr<LazyIndex> index = std::make_shared<LazyIndex>();
+        std::vector<std::string> names;
+        for(auto& binder : m_binders) {
+            names.clear();
+            binder->getGlobalNames(names);
+            for(const std::string& name : names)
+                (*index)[name].push_back(binder.get());
+        }
+        m_lazyIndex = index;
+        m_lazyIndexedBinders = m_binders.size();
+        return m_lazyIndex;
+    }
+
+    static int lazyIndex(EulunaInterface* lua, const LazyIndex& index, LazyState& state) {
+        // stack: globals, key
+        if(lua->type() == LUA_TSTRING) {
+            std::string name = lua->toString();
+            auto it = index.find(name);
+            if(it != index.end() && state.registering.insert(name).second) {
+                struct RegisteringGuard {
+                    std::unordered_set<std::string>& registering;
+                    const std::string& name;
+                    ~RegisteringGuard() { registering.erase(name); }
+                } guard{state.registering, name};
+                EulunaEngine euluna(lua->luaState());
+                for(Binder *binder : it->second)
+                    binder->registerGlobalName(&euluna, name);
+                lua->rawGet(-2);
+                lua->remove(-2);
+                if(state.registered.insert(name).second && state.registered.size() == index.size())
+                    uninstallLazyIndex(lua, state);
+                return 1;
+            }
+        }
+        lua->pop(2);
+        lua->pushNil();
+        return 1;
+    }
+
+    // globals set to nil afterwards stay nil, resets to a checkpoint taken before restore the hook
+    static void uninstallLazyIndex(EulunaInterface* lua, const LazyState& state) {
+        lua->pushGlobalTable();
+        if(lua_getmetatable(lua->luaState(), -1)) {
+            lua->pushNil();
+            lua->setField("__index");
+            // the metatable created for the hook is removed too
+            lua->pushNil();
+            if(lua->next(-2))
+                lua->pop(2);
+            else if(state.createdMetatable) {
+                lua->pushNil();
+                lua->setMetatable(-3);
+            }
+            lua->pop();
+        }
+        lua->pop();
+    }
+
     std::vector<std::unique_ptr<Binder>> m_binders;
+    std::shared_ptr<const LazyIndex> m_lazyIndex;
+    size_t m_lazyIndexedBinders = 0;
+    std::mutex m_lazyMutex;
 };
 
 class EulunaAutoBinder {
@@ -229,7 +472,35 @@ public:
 #define EULUNA_CLASS_REFERENCE_HANDLERS(use,release) .useHandler(use).releaseHandler(release)
 #define EULUNA_CLASS_GENERIC_REFERENCE_HANDLERS(klass) .releaseHandler<klass>([](EulunaInterface* lua, klass* obj) { lua->releaseObject(obj); delete obj; })
 
+// bind enums, their enumerators are set in a global table
+#define EULUNA_BEGIN_ENUM(klass) EulunaAutoBinder __euluna_binding_##klass([] { EulunaBinder::instance().enumeration<klass>(#klass)
+#define EULUNA_BEGIN_ENUM_NAMED(name,klass) EulunaAutoBinder __euluna_binding_##klass([] { EulunaBinder::instance().enumeration<klass>(name)
+#define EULUNA_ENUM_VALUE(klass,enumerator) .value(#enumerator, klass::enumerator)
+#define EULUNA_ENUM_VALUE_NAMED(name,enumerator) .value(name, enumerator)
+
 // bind ending
 #define EULUNA_END() ;});
 
+// static binding tables, the functions compile into a luaL_Reg array that is set with one luaL_setfuncs per class table,
+// no std::function is allocated and nothing is done per function at static init
+#define EULUNA_STATIC_FUNC(func) { #func, &euluna_binder::static_fun<decltype(&func), &func>::call },
+#define EULUNA_STATIC_FUNC_NAMED(name,func) { name, &euluna_binder::static_fun<decltype(&func), &func>::call },
+#define EULUNA_STATIC_CLASS_STATIC(klass,func) { #func, &euluna_binder::static_fun<decltype(&klass::func), &klass::func>::call },
+#define EULUNA_STATIC_CLASS_STATIC_NAMED(name,klass,func) { name, &euluna_binder::static_fun<decltype(&klass::func), &klass::func>::call },
+#define EULUNA_STATIC_CLASS_MEMBER(klass,func) { #func, &euluna_binder::static_mem_fun<decltype(&klass::func), &klass::func>::call },
+#define EULUNA_STATIC_CLASS_MEMBER_NAMED(name,klass,func) { name, &euluna_binder::static_mem_fun<decltype(&klass::func), &klass::func>::call },
+
+#define EULUNA_BEGIN_STATIC_GLOBAL_FUNCTIONS(name) EulunaAutoBinder __euluna_bindings_##name([] { auto& __euluna_binder = EulunaBinder::instance().globals(); static const luaL_Reg __euluna_functions[] = {
+#define EULUNA_BEGIN_STATIC_SINGLETON(klass) EulunaAutoBinder __euluna_binding_##klass([] { auto& __euluna_binder = EulunaBinder::instance().singleton(#klass); static const luaL_Reg __euluna_functions[] = {
+#define EULUNA_BEGIN_STATIC_SINGLETON_NAMED(name,klass) EulunaAutoBinder __euluna_binding_##klass([] { auto& __euluna_binder = EulunaBinder::instance().singleton(name); static const luaL_Reg __euluna_functions[] = {
+#define EULUNA_BEGIN_STATIC_MANAGED_CLASS(klass) EulunaAutoBinder __euluna_binding_##klass([] { auto& __euluna_binder = EulunaBinder::instance().managedClass(#klass); static const luaL_Reg __euluna_functions[] = {
+#define EULUNA_BEGIN_STATIC_MANAGED_CLASS_NAMED(name,klass) EulunaAutoBinder __euluna_binding_##klass([] { auto& __euluna_binder = EulunaBinder::instance().managedClass(name); static const luaL_Reg __euluna_functions[] = {
+#define EULUNA_BEGIN_STATIC_MANAGED_DERIVED_CLASS(klass,base) EulunaAutoBinder __euluna_binding_##klass([] { auto& __euluna_binder = EulunaBinder::instance().managedClass(#klass,base); static const luaL_Reg __euluna_functions[] = {
+#define EULUNA_BEGIN_STATIC_MANAGED_DERIVED_CLASS_NAMED(name,klass,base) EulunaAutoBinder __euluna_binding_##klass([] { auto& __euluna_binder = EulunaBinder::instance().managedClass(name,base); static const luaL_Reg __euluna_functions[] = {
+
+// static bindings ending
+#define EULUNA_END_STATIC() { nullptr, nullptr } }; __euluna_binder.defTable(__euluna_functions); });
+#define EULUNA_END_STATIC_WITH_HANDLERS(use,release) { nullptr, nullptr } }; __euluna_binder.defTable(__euluna_functions).useHandler(use).releaseHandler(release); });
+#define EULUNA_END_STATIC_WITH_GENERIC_HANDLERS(klass) { nullptr, nullptr } }; __euluna_binder.defTable(__euluna_functions).releaseHandler<klass>([](EulunaInterface* lua, klass* obj) { lua->releaseObject(obj); delete obj; }); });
+
 #endif // EULUNABINDER_HPP
@@ -35,14 +35,32 @@
 namespace  euluna_binder {
 
 
+/// Message of the argument error raised when an argument can't be pulled
+template<typename T>
+typename std::enable_if<!euluna_caster::is_checked_enum<T>::value, std::string>::type
+bad_argument_message(EulunaInterface* lua, int index) {
+    return euluna_tools::format("%s expected, got %s", euluna_tools::demangle_type<T>(), lua->toTypeName(index));
+}
+template<typename T>
+typename std::enable_if<euluna_caster::is_checked_enum<T>::value, std::string>::type
+bad_argument_message(EulunaInterface* lua, int index) {
+    int type = lua->type(index);
+    if(type == LUA_TSTRING || type == LUA_TNUMBER)
+        return euluna_tools::format("invalid %s '%s'", euluna_tools::demangle_type<T>(), lua->toString(index));
+    return euluna_tools::format("%s expected, got %s", euluna_tools::demangle_type<T>(), lua->toTypeName(index));
+}
+
 /// Pack arguments from lua stack into a tuple recursively
 template<int N>
 struct pack_values_into_tuple {
     template<typename Tuple>
     static void call(Tuple& tuple, EulunaInterface* lua) {
         typedef typename std::tuple_element<N-1, Tuple>::type ValueType;
-        if(!euluna_caster::pull(lua, N, std::get<N-1>(tuple)))
-            lua->argError(N, euluna_tools::format("%s expected, got %s", euluna_tools::demangle_type<ValueType>(), lua->toTypeName(N)));
+        if(!euluna_caster::pull(lua, N, std::get<N-1>(tuple))) {
+            // the message is moved to lua first, raising the error jumps over the C++ destructors
+            lua->pushString(bad_argument_message<ValueType>(lua, N));
+            lua->argError(N, lua->toCString(-1));
+        }
         pack_values_into_tuple<N-1>::call(tuple, lua);
     }
 };
@@ -84,25 +102,110 @@ struct expand_fun_arguments<0,Ret> {
     }
 };
 
-/// Bind different types of functions generating a lambda
+/// Pull the arguments from lua stack, call the C++ function and push its results
+template<typename Ret, typename Tuple, typename F>
+int call_with_lua_arguments(const F& f, EulunaInterface* lua) {
+    enum { N = std::tuple_size<Tuple>::value };
+    lua->ensureStackSize(N);
+    Tuple tuple;
+    pack_values_into_tuple<N>::call(tuple, lua);
+    lua->pop(N);
+    return expand_fun_arguments<N,Ret>::call(tuple, f, lua);
+}
+
+/// Callable pulling the arguments of f from lua and pushing its results
+template<typename Ret, typename Tuple, typename F>
+struct bound_fun {
+    F f;
+    int operator()(EulunaInterface* lua) const {
+        return call_with_lua_arguments<Ret, Tuple>(f, lua);
+    }
+};
+
+/// Bind different types of functions generating a callable
 template<typename Ret, typename F, typename Tuple>
 EulunaCppFunction bind_fun_specializer(const F& f) {
-    enum { N = std::tuple_size<Tuple>::value };
-    return [=](EulunaInterface* lua) -> int {
-        lua->ensureStackSize(N);
-        Tuple tuple;
-        pack_values_into_tuple<N>::call(tuple, lua);
-        lua->pop(N);
-        return expand_fun_arguments<N,Ret>::call(tuple, f, lua);
-    };
+    return bound_fun<Ret, Tuple, typename std::decay<F>::type>{f};
 }
 
+/// Lua C function calling a bound function, C++ exceptions are turned into lua errors
+inline int call_static_fun(lua_State* L, int (*f)(EulunaInterface*)) {
+    EulunaInterface lua(L);
+    int numRets;
+    try {
+        numRets = f(&lua);
+        assert(numRets == lua.stackSize() || numRets == EULUNA_YIELD);
+    } catch(std::exception& e) {
+        numRets = 0;
+        lua.clearStack();
+        // static functions have no name upvalue, the name is taken from the call site
+        lua_Debug ar;
+        const char* funcName = lua_getstack(L, 0, &ar) && lua_getinfo(L, "n", &ar) && ar.name ? ar.name : "?";
+        lua.traceback(euluna_tools::format("C++ exception %s: in call of '%s': %s", euluna_tools::demangle_type(e), funcName, e.what()));
+        lua.error();
+    }
+    // the function is waiting for an async result
+    if(numRets == EULUNA_YIELD)
+        return lua.yield(0);
+    return numRets;
+}
+
+/// Lua C functions for C++ functions known at compile time, used in static binding tables,
+/// they need no std::function, no allocation and no upvalues, e.g. static_fun<decltype(&f), &f>::call
+template<typename F, F f>
+struct static_fun;
+
+template<typename Ret, typename... Args, Ret (*f)(Args...)>
+struct static_fun<Ret (*)(Args...), f> {
+    static int call(lua_State* L) { return call_static_fun(L, &invoke); }
+    static int invoke(EulunaInterface* lua) {
+        typedef std::tuple<typename euluna_traits::remove_const_ref<Args>::type...> Tuple;
+        return call_with_lua_arguments<typename euluna_traits::remove_const_ref<Ret>::type, Tuple>(f, lua);
+    }
+};
+
+/// Lua C functions for member functions of managed classes known at compile time
+template<typename F, F f>
+struct static_mem_fun;
+
+template<typename Ret, class C, typename... Args, Ret (C::*f)(Args...)>
+struct static_mem_fun<Ret (C::*)(Args...), f> {
+    static int call(lua_State* L) { return call_static_fun(L, &invoke); }
+    static Ret invokeMember(C* obj, const typename euluna_traits::remove_const_ref<Args>::type&... args) {
+        if(!obj) throw EulunaEngineError("Null object while calling a bound C++ function");
+        return (obj->*f)(args...);
+    }
+    static int invoke(EulunaInterface* lua) {
+        typedef std::tuple<C*, typename euluna_traits::remove_const_ref<Args>::type...> Tuple;
+        return call_with_lua_arguments<typename euluna_traits::remove_const_ref<Ret>::type, Tuple>(&invokeMember, lua);
+    }
+};
+
+template<typename Ret, class C, typename... Args, Ret (C::*f)(Args...) const>
+struct static_mem_fun<Ret (C::*)(Args...) const, f> {
+    static int call(lua_State* L) { return call_static_fun(L, &invoke); }
+    static Ret invokeMember(C* obj, const typename euluna_traits::remove_const_ref<Args>::type&... args) {
+        if(!obj) throw EulunaEngineError("Null object while calling a bound C++ function");
+        return (obj->*f)(args...);
+    }
+    static int invoke(EulunaInterface* lua) {
+        typedef std::tuple<C*, typename euluna_traits::remove_const_ref<Args>::type...> Tuple;
+        return call_with_lua_arguments<typename euluna_traits::remove_const_ref<Ret>::type, Tuple>(&invokeMember, lua);
+    }
+};
+
 /// Bind a customized function
 inline
 EulunaCppFunction bind_fun(std::function<int(EulunaInterface*)>&& f) {
     return f;
 }
 
+/// Bind a customized C++ function
+inline
+EulunaCppFunction bind_fun(int (*f)(EulunaInterface*)) {
+    return f;
+}
+
 /// Bind a std::function
 template<typename Ret, typename... Args>
 EulunaCppFunction bind_fun(const std::function<Ret(Args...)>& f) {
@@ -115,7 +218,10 @@ EulunaCppFunction bind_fun(const std::function<Ret(Args...)>& f) {
 /// Bind C++ functions
 template<typename Ret, typename... Args>
 EulunaCppFunction bind_fun(Ret (*f)(Args...)) {
-    return bind_fun(std::function<Ret(Args...)>(f));
+    typedef typename std::tuple<typename euluna_traits::remove_const_ref<Args>::type...> Tuple;
+    return bind_fun_specializer<typename euluna_traits::remove_const_ref<Ret>::type,
+                                decltype(f),
+                                Tuple>(f);
 }
 
 /// Specialization for lambdas
@@ -295,8 +401,10 @@ namespace euluna_caster {
 template<typename Ret, typename... Args>
 int push(EulunaInterface *lua, const std::function<Ret(Args...)>& func) {
     if(func) {
-        EulunaCppFunction f = euluna_binder::bind_fun(func);
-        lua->pushCppFunction(f, "std::function callback");
+        typedef typename std::tuple<typename euluna_traits::remove_const_ref<Args>::type...> Tuple;
+        // pushed as an inline callable, without wrapping it in another std::function
+        lua->pushCppFunction(euluna_binder::bound_fun<typename euluna_traits::remove_const_ref<Ret>::type, Tuple, std::function<Ret(Args...)>>{func},
+                             "std::function callback");
     } else
         lua->pushNil();
     return 1;
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2016 Euluna <https://github.com/edubart/euluna>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef EULUNABINDINGSTATS_HPP
+#define EULUNABINDINGSTATS_HPP
+
+#include "eulunaprereqs.hpp"
+#include "eulunatools.hpp"
+
+// Calls and latencies of the bound C++ functions of a lua state, functions pushed after the stats
+// are enabled get a trampoline that measures them, must only be used by the thread running the state
+class EulunaBindingStats {
+public:
+    struct Binding {
+        uint64_t calls = 0;
+        // durations in cpu cycles of the sampled calls that returned, calls raising lua errors are only counted
+        euluna_tools::log_histogram cycles;
+        uint32_t sampleInterval = 1;
+        uint32_t untilSample = 1;
+    };
+
+    struct Snapshot {
+        std::string name;
+        uint64_t calls;
+        double totalNs;
+        double meanNs;
+        double p50Ns;
+        double p99Ns;
+        double maxNs;
+    };
+
+    EulunaBindingStats(const EulunaBindingStats&) = delete;
+    EulunaBindingStats& operator=(const EulunaBindingStats&) = delete;
+
+    // enables the stats of the lua state, they live until the state is closed
+    static EulunaBindingStats *enable(lua_State *L) {
+        if(EulunaBindingStats *stats = get(L))
+            return stats;
+        EulunaBindingStats *stats = new(lua_newuserdata(L, sizeof(EulunaBindingStats))) EulunaBindingStats;
+        lua_newtable(L);
+        lua_pushcfunction(L, [](lua_State *L) -> int {
+            static_cast<EulunaBindingStats*>(lua_touserdata(L, 1))->~EulunaBindingStats();
+            enabledStates().fetch_sub(1, std::memory_order_relaxed);
+            return 0;
+        });
+        lua_setfield(L, -2, "__gc");
+        lua_setmetatable(L, -2);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, statsKey());
+        enabledStates().fetch_add(1, std::memory_order_relaxed);
+
+        // euluna.stats() returns the snapshot as a table keyed by binding name
+        lua_getglobal(L, "euluna");
+        if(!lua_istable(L, -1)) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_setglobal(L, "euluna");
+        }
+        lua_pushcfunction(L, &luaStats);
+        lua_setfield(L, -2, "stats");
+        lua_pop(L, 1);
+        return stats;
+    }
+
+    // stats of the lua state, null when they are not enabled
+    static EulunaBindingStats *get(lua_State *L) {
+        // pushing functions asks for the stats, so the registry is not looked up while no state has them
+        if(enabledStates().load(std::memory_order_relaxed) == 0)
+            return nullptr;
+        lua_rawgetp(L, LUA_REGISTRYINDEX, statsKey());
+        EulunaBindingStats *stats = static_cast<EulunaBindingStats*>(lua_touserdata(L, -1));
+        lua_pop(L, 1);
+        return stats;
+    }
+
+    // counters of a binding, bindings pushed with the same name share them
+    Binding *getBinding(const std::string& name) {
+        std::unique_ptr<Binding>& binding = m_bindings[name];
+        if(!binding) {
+            binding.reset(new Binding);
+            binding->sampleInterval = binding->untilSample = m_sampleInterval;
+        }
+        return binding.get();
+    }
+
+    // times only one of every interval calls, reading the clock costs more than a call on some machines,
+    // the calls are still all counted and the total time is extrapolated from the sampled ones
+    void setSampleInterval(uint32_t interval) {
+        m_sampleInterval = std::max<uint32_t>(interval, 1);
+        for(auto& it : m_bindings)
+            it.second->sampleInterval = it.second->untilSample = m_sampleInterval;
+    }
+    uint32_t getSampleInterval() const { return m_sampleInterval; }
+
+    std::vector<Snapshot> snapshot() const {
+        double cyclesPerNs = euluna_tools::cpu_cycles_per_ns();
+        std::vector<Snapshot> snapshots;
+        snapshots.reserve(m_bindings.size());
+        for(auto& it : m_bindings) {
+            const euluna_tools::log_histogram& cycles = it.second->cycles;
+            snapshots.push_back(Snapshot{it.first, it.second->calls, (double)cycles.sum() * it.second->sampleInterval / cyclesPerNs, cycles.mean() / cyclesPerNs,
+                                         cycles.percentile(0.5) / cyclesPerNs, cycles.percentile(0.99) / cyclesPerNs, cycles.max() / cyclesPerNs});
+        }
+        return snapshots;
+    }
+
+    void reset() {
+        for(auto& it : m_bindings) {
+            *it.second = Binding();
+            it.second->sampleInterval = it.second->untilSample = m_sampleInterval;
+        }
+    }
+
+    // Prometheus text format with a calls counter and a histogram of the sampled durations per binding
+    std::string toPrometheus() const {
+        double cyclesPerSecond = euluna_tools::cpu_cycles_per_ns() * 1e9;
+        std::string out;
+        out += "# HELP euluna_binding_calls_total Calls of bound C++ functions.\n";
+        out += "# TYPE euluna_binding_calls_total counter\n";
+        for(auto& it : m_bindings)
+            out += euluna_tools::format("euluna_binding_calls_total{binding=\"%s\"} %" PRIu64 "\n", escapeLabel(it.first), it.second->calls);
+        out += "# HELP euluna_binding_duration_seconds Duration of the calls of bound C++ functions.\n";
+        out += "# TYPE euluna_binding_duration_seconds histogram\n";
+        for(auto& it : m_bindings) {
+            const euluna_tools::log_histogram& cycles = it.second->cycles;
+            std::string label = escapeLabel(it.first);
+            int lastBucket = euluna_tools::log_histogram::bucket_of(cycles.max());
+            uint64_t accumulated = 0;
+            for(int i = 0; i < lastBucket && cycles.count() > 0; ++i) {
+                accumulated += cycles.bucket_count(i);
+                out += euluna_tools::format("euluna_binding_duration_seconds_bucket{binding=\"%s\",le=\"%.9g\"} %" PRIu64 "\n",
+                                            label, (euluna_tools::log_histogram::bucket_upper_bound(i) + 1) / cyclesPerSecond, accumulated);
+            }
+            out += euluna_tools::format("euluna_binding_duration_seconds_bucket{binding=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", label, cycles.count());
+            out += euluna_tools::format("euluna_binding_duration_seconds_sum{binding=\"%s\"} %.9g\n", label, cycles.sum() / cyclesPerSecond);
+            out += euluna_tools::format("euluna_binding_duration_seconds_count{binding=\"%s\"} %" PRIu64 "\n", label, cycles.count());
+        }
+        return out;
+    }
+
+    // writes the Prometheus text to a file replaced atomically, for the node exporter textfile collector
+    bool writePrometheus(const std::string& fileName) const {
+        std::string text = toPrometheus();
+        return euluna_tools::write_file_atomic(fileName, text.data(), text.size());
+    }
+
+private:
+    EulunaBindingStats() { }
+
+    static void* statsKey() {
+        static char key;
+        return &key;
+    }
+
+    // number of open lua states with the stats enabled
+    static std::atomic<int>& enabledStates() {
+        static std::atomic<int> count{0};
+        return count;
+    }
+
+    static std::string escapeLabel(const std::string& value) {
+        std::string escaped;
+        for(char c : value) {
+            if(c == '\\' || c == '"')
+                escaped += '\\';
+            if(c == '\n')
+                escaped += "\\n";
+            else
+                escaped += c;
+        }
+        return escaped;
+    }
+
+    static int luaStats(lua_State *L) {
+        EulunaBindingStats *stats = get(L);
+        if(!stats)
+            return luaL_error(L, "binding stats are not enabled");
+        std::vector<Snapshot> snapshots = stats->snapshot();
+        lua_createtable(L, 0, snapshots.size());
+        for(const Snapshot& snapshot : snapshots) {
+            lua_createtable(L, 0, 6);
+            lua_pushnumber(L, snapshot.calls);
+            lua_setfield(L, -2, "calls");
+            lua_pushnumber(L, snapshot.totalNs);
+            lua_setfield(L, -2, "total_ns");
+            lua_pushnumber(L, snapshot.meanNs);
+            lua_setfield(L, -2, "mean_ns");
+            lua_pushnumber(L, snapshot.p50Ns);
+            lua_setfield(L, -2, "p50_ns");
+            lua_pushnumber(L, snapshot.p99Ns);
+            lua_setfield(L, -2, "p99_ns");
+            lua_pushnumber(L, snapshot.maxNs);
+            lua_setfield(L, -2, "max_ns");
+            lua_setfield(L, -2, snapshot.name.c_str());
+        }
+        return 1;
+    }
+
+    std::map<std::string, std::unique_ptr<Binding>> m_bindings;
+    uint32_t m_sampleInterval = 1;
+};
+
+#endif // EULUNABINDINGSTATS_HPP
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2016 Euluna <https://github.com/edubart/euluna>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef EULUNACALLQUEUE_HPP
+#define EULUNACALLQUEUE_HPP
+
+#include "eulunaprereqs.hpp"
+#include "eulunatools.hpp"
+#include "eulunaexception.hpp"
+
+// Queue of calls into a lua state made from threads other than the one owning the state,
+// other threads post calls without locking and the owner thread runs them in batches when draining
+class EulunaCallQueue : public std::enable_shared_from_this<EulunaCallQueue> {
+public:
+    EulunaCallQueue(EulunaInterface *lua, lua_State *L) : m_lua(lua), L(L), m_owner(std::this_thread::get_id()) {
+        lua_pushlightuserdata(L, this);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, callQueueKey());
+    }
+
+    ~EulunaCallQueue() { dropTasks(); }
+
+    EulunaCallQueue(const EulunaCallQueue&) = delete;
+    EulunaCallQueue& operator=(const EulunaCallQueue&) = delete;
+
+    // queue of the lua state, null when the state has none
+    static std::shared_ptr<EulunaCallQueue> get(lua_State *L) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, callQueueKey());
+        EulunaCallQueue *queue = static_cast<EulunaCallQueue*>(lua_touserdata(L, -1));
+        lua_pop(L, 1);
+        return queue ? queue->shared_from_this() : nullptr;
+    }
+
+    // the owner is the thread that created the queue, states moved to other threads must change it
+    void setOwnerThread(std::thread::id id = std::this_thread::get_id()) { m_owner.store(id); }
+    bool isOwnerThread() const { return m_owner.load() == std::this_thread::get_id(); }
+
+    // can be called from any thread, tasks posted after the state is closed are dropped,
+    // which breaks the promises they hold so their futures don't wait forever
+    void post(std::function<void()> task) {
+        if(m_closed.load())
+            return;
+        m_pending.fetch_add(1, std::memory_order_relaxed);
+        m_tasks.push(std::move(task));
+        // close may have drained the queue before the push, the task would then keep its holder,
+        // and so this queue, alive forever
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(m_closed.load())
+            dropTasks();
+    }
+
+    // runs up to maxCalls queued calls in the owner thread, returns how many were run,
+    // calls posted while draining are left for the next drain
+    size_t drain(size_t maxCalls = std::numeric_limits<size_t>::max()) {
+        assert(isOwnerThread());
+        if(m_closed.load())
+            return 0;
+        size_t count = std::min(maxCalls, m_pending.load(std::memory_order_relaxed));
+        size_t ran = 0;
+        std::function<void()> task;
+        while(ran < count && m_tasks.pop(task)) {
+            m_pending.fetch_sub(1, std::memory_order_relaxed);
+            ran++;
+            try {
+                task();
+            } catch(std::exception& e) {
+                m_lastError = e.what();
+            }
+            task = nullptr;
+        }
+        return ran;
+    }
+
+    // called by the owner before closing the lua state, queued calls are dropped
+    void close() {
+        m_closed.store(true);
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, callQueueKey());
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        dropTasks();
+    }
+
+    bool isClosed() const { return m_closed.load(); }
+    size_t getPendingCount() const { return m_pending.load(std::memory_order_relaxed); }
+    EulunaInterface *getLua() const { return m_lua; }
+    // error of the last queued call without a future that failed
+    std::string getLastError() { return m_lastError; }
+    bool hasError() { return !m_lastError.empty(); }
+
+private:
+    static void* callQueueKey() {
+        static char key;
+        return &key;
+    }
+
+    // once closed the owner no longer drains, the mutex keeps the queue with a single consumer
+    void dropTasks() {
+        std::lock_guard<std::mutex> lock(m_dropMutex);
+        std::function<void()> task;
+        while(m_tasks.pop(task)) {
+            m_pending.fetch_sub(1, std::memory_order_relaxed);
+            task = nullptr;
+        }
+    }
+
+    EulunaInterface *m_lua;
+    lua_State *L;
+    std::atomic<std::thread::id> m_owner;
+    std::atomic<bool> m_closed{false};
+    std::atomic<size_t> m_pending{0};
+    euluna_tools::mpsc_queue<std::function<void()>> m_tasks;
+    std::mutex m_dropMutex;
+    std::string m_lastError;
+};
+
+#endif // EULUNACALLQUEUE_HPP
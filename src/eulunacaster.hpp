@@ -24,6 +24,7 @@
 #define EULUNACASTER_HPP
 
 #include "eulunainterface.hpp"
+#include "eulunaenum.hpp"
 
 namespace euluna_caster {
 
@@ -133,7 +134,7 @@ typename std::enable_if<std::is_enum<T>::value, int>::type
 push(EulunaInterface *lua, T e) { return push(lua, (int)e); }
 
 template<class T>
-typename std::enable_if<std::is_enum<T>::value, bool>::type pull(EulunaInterface *lua, int index, T& myenum) {
+typename std::enable_if<std::is_enum<T>::value && !is_checked_enum<T>::value, bool>::type pull(EulunaInterface *lua, int index, T& myenum) {
     int i;
     if(pull(lua, index, i)) {
         myenum = (T)i;
@@ -142,26 +143,127 @@ typename std::enable_if<std::is_enum<T>::value, bool>::type pull(EulunaInterface
     return false;
 }
 
+// checked enum, accepts the enumerator values or names
+template<class T>
+typename std::enable_if<is_checked_enum<T>::value, bool>::type pull(EulunaInterface *lua, int index, T& myenum) {
+    int type = lua->type(index);
+    if(type == LUA_TSTRING) {
+        size_t len;
+        const char *name = lua_tolstring(lua->luaState(), index, &len);
+        return EulunaEnum<T>::fromName(name, len, myenum);
+    } else if(type == LUA_TNUMBER) {
+        typedef typename EulunaEnum<T>::underlying_type underlying_type;
+        lua_Number d = lua->toNumber(index);
+        // converting numbers that are not integers in range is undefined, NaN fails every comparison
+        lua_Number limit = std::ldexp(1.0, std::numeric_limits<underlying_type>::digits);
+        if(!(d >= (std::numeric_limits<underlying_type>::is_signed ? -limit : 0) && d < limit && d == std::floor(d)))
+            return false;
+        underlying_type value = (underlying_type)d;
+        if(!EulunaEnum<T>::isValid(value))
+            return false;
+        myenum = (T)value;
+        return true;
+    }
+    return false;
+}
+
 // std::function
 template<typename Ret, typename... Args>
 int push(EulunaInterface *lua, const std::function<Ret(Args...)>& func);
 
+// async results, they yield the running coroutine until ready
+inline int push(EulunaInterface *lua, EulunaAwaitable& awaitable);
+template<typename T>
+int push(EulunaInterface *lua, std::future<T>& future);
+
+// Reference to a lua function held by std::function callbacks, callbacks can be called and destroyed from any thread,
+// when the state has a call queue the calls and the unref from other threads are queued to its owner thread
 class LuaFunctionHolder {
 public:
     LuaFunctionHolder() = delete;
     LuaFunctionHolder(const LuaFunctionHolder&) = delete;
     LuaFunctionHolder& operator=(const LuaFunctionHolder&) = delete;
 
-    LuaFunctionHolder(EulunaInterface *lua, int ref) : m_lua(lua), m_ref(ref) { }
-    ~LuaFunctionHolder() { m_lua->unref(m_ref); }
+    LuaFunctionHolder(EulunaInterface *lua, int ref) : m_lua(lua), m_ref(ref), m_callQueue(EulunaCallQueue::get(lua->luaState())) {
+        // the interface that pulled the function may be temporary, the queue knows the interface of the state
+        if(m_callQueue)
+            m_lua = m_callQueue->getLua();
+    }
+    ~LuaFunctionHolder() {
+        if(!m_callQueue)
+            m_lua->unref(m_ref);
+        else if(m_callQueue->isClosed())
+            return;
+        else if(m_callQueue->isOwnerThread())
+            m_lua->unref(m_ref);
+        else {
+            EulunaInterface *lua = m_lua;
+            int ref = m_ref;
+            m_callQueue->post([lua, ref] { lua->unref(ref); });
+        }
+    }
     void pushFunc() const { m_lua->getRef(m_ref); }
     EulunaInterface *getLua() { return m_lua; }
+
+    // whether calls must go through the call queue
+    bool isQueued() const { return m_callQueue && !m_callQueue->isOwnerThread(); }
+
+    template<typename Ret, typename... Args>
+    Ret call(const Args&... args) {
+        if(m_callQueue && m_callQueue->isClosed())
+            throw EulunaRuntimeError("Attempt to call a lua function of a closed lua state from C++");
+        m_lua->pushErrorHandler();
+        int errorFuncIndex = m_lua->stackSize();
+        pushFunc();
+        if(!m_lua->isFunction()) {
+            m_lua->pop(2);
+            throw EulunaRuntimeError("Attempt to call an expired lua function from C++");
+        }
+        return m_lua->polymorphicHandledCall<Ret>(errorFuncIndex, args...);
+    }
+
+    // queues the call to the owner thread, the arguments are copied
+    template<typename Ret, typename... Args>
+    static std::future<Ret> queueCall(const std::shared_ptr<LuaFunctionHolder>& holder, const Args&... args) {
+        auto promise = std::make_shared<std::promise<Ret>>();
+        std::future<Ret> future = promise->get_future();
+        holder->m_callQueue->post([holder, promise, args...] {
+            try {
+                setPromise<Ret>(*promise, [&] { return holder->call<Ret>(args...); });
+            } catch(...) {
+                promise->set_exception(std::current_exception());
+            }
+        });
+        return future;
+    }
+
+    // calls now when in the owner thread, otherwise queues the call
+    template<typename Ret, typename... Args>
+    static std::future<Ret> asyncCall(const std::shared_ptr<LuaFunctionHolder>& holder, const Args&... args) {
+        if(holder->isQueued())
+            return queueCall<Ret>(holder, args...);
+        std::promise<Ret> promise;
+        try {
+            setPromise<Ret>(promise, [&] { return holder->call<Ret>(args...); });
+        } catch(...) {
+            promise.set_exception(std::current_exception());
+        }
+        return promise.get_future();
+    }
+
 private:
+    template<typename Ret, typename F>
+    static typename std::enable_if<!std::is_void<Ret>::value>::type setPromise(std::promise<Ret>& promise, const F& f) { promise.set_value(f()); }
+    template<typename Ret, typename F>
+    static typename std::enable_if<std::is_void<Ret>::value>::type setPromise(std::promise<Ret>& promise, const F& f) { f(); promise.set_value(); }
+
     EulunaInterface *m_lua;
     int m_ref;
+    std::shared_ptr<EulunaCallQueue> m_callQueue;
 };
 
-// note that std::function callbacks can throw exceptions
+// note that std::function callbacks can throw exceptions,
+// calls from threads other than the owner of the lua state are queued, void calls return without waiting
 template<typename... Args>
 bool pull(EulunaInterface *lua, int index, std::function<void(Args...)>& func) {
     if(lua->isFunction(index)) {
@@ -169,13 +271,10 @@ bool pull(EulunaInterface *lua, int index, std::function<void(Args...)>& func) {
         int ref = lua->ref();
         std::shared_ptr<LuaFunctionHolder> holder(new LuaFunctionHolder(lua, ref));
         func = [holder](Args... args) {
-            EulunaInterface *lua = holder->getLua();
-            holder->pushFunc();
-            if(lua->isFunction()) {
-                int numArgs = lua->polymorphicPush(args...);
-                lua->safeCall(numArgs, 0);
-            } else
-                throw EulunaRuntimeError("Attempt to call an expired lua function from C++");
+            if(holder->isQueued())
+                LuaFunctionHolder::queueCall<void>(holder, args...);
+            else
+                holder->call<void>(args...);
         };
         return true;
     } else if(lua->isNil(index)) {
@@ -184,23 +283,20 @@ bool pull(EulunaInterface *lua, int index, std::function<void(Args...)>& func) {
     }
     return false;
 }
+// calls with results from other threads fail, waiting for the owner thread to drain its call queue deadlocks
+// when the owner waits for the calling thread, callbacks called from other threads must return std::future
 template<typename Ret, typename... Args>
-typename std::enable_if<!std::is_void<Ret>::value, bool>::type
+typename std::enable_if<!std::is_void<Ret>::value && !euluna_traits::is_future<Ret>::value, bool>::type
 pull(EulunaInterface *lua, int index, std::function<Ret(Args...)>& func) {
     if(lua->isFunction(index)) {
         lua->pushValue(index);
         int ref = lua->ref();
         std::shared_ptr<LuaFunctionHolder> holder(new LuaFunctionHolder(lua, ref));
         func = [holder](Args... args) -> Ret {
-            EulunaInterface *lua = holder->getLua();
-            holder->pushFunc();
-            if(lua->isFunction()) {
-                int numArgs = lua->polymorphicPush(args...);
-                lua->safeCall(numArgs, 1);
-                return lua->polymorphicPop<Ret>();
-            } else
-                throw EulunaRuntimeError("Attempt to call an expired lua function from C++");
-            return Ret();
+            if(holder->isQueued())
+                throw EulunaRuntimeError("Attempt to call a lua function with results from a thread not owning its lua state, "
+                                         "the callback must return a std::future");
+            return holder->call<Ret>(args...);
         };
         return true;
     } else if(lua->isNil(index)) {
@@ -209,6 +305,23 @@ pull(EulunaInterface *lua, int index, std::function<Ret(Args...)>& func) {
     }
     return false;
 }
+// callbacks returning futures never wait, the future is ready when the owner thread made the call
+template<typename Ret, typename... Args>
+bool pull(EulunaInterface *lua, int index, std::function<std::future<Ret>(Args...)>& func) {
+    if(lua->isFunction(index)) {
+        lua->pushValue(index);
+        int ref = lua->ref();
+        std::shared_ptr<LuaFunctionHolder> holder(new LuaFunctionHolder(lua, ref));
+        func = [holder](Args... args) -> std::future<Ret> {
+            return LuaFunctionHolder::asyncCall<Ret>(holder, args...);
+        };
+        return true;
+    } else if(lua->isNil(index)) {
+        func = std::function<std::future<Ret>(Args...)>();
+        return true;
+    }
+    return false;
+}
 
 // lambda
 template<typename Lambda>
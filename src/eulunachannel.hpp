@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2016 Euluna <https://github.com/edubart/euluna>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef EULUNACHANNEL_HPP
+#define EULUNACHANNEL_HPP
+
+#include "eulunaengine.hpp"
+
+// Bounded queue of lua values shared by lua states, usually running in different threads.
+// Values are copied into a compact serialized form, only nil, booleans, numbers, strings
+// and tables of them can be sent. Lua sees the channel as a global table:
+//   local ok = jobs.send({ id = 1, data = payload }, timeout)
+//   local ok, job = jobs.receive(timeout)
+// The timeouts are in seconds, nil waits forever and 0 doesn't wait, when waiting is needed
+// async calls yield until the next poll while other calls block the thread.
+class EulunaChannel : public std::enable_shared_from_this<EulunaChannel> {
+public:
+    explicit EulunaChannel(size_t capacity) : m_queue(capacity) { }
+
+    EulunaChannel(const EulunaChannel&) = delete;
+    EulunaChannel& operator=(const EulunaChannel&) = delete;
+
+    // sets the channel as a global table in the engine, the channel is kept alive by the table functions
+    void bind(EulunaEngine *euluna, const std::string& name) {
+        std::shared_ptr<EulunaChannel> self = shared_from_this();
+        euluna->newTable();
+        euluna->pushCppFunction([self](EulunaInterface *lua) { return self->luaSend(lua); }, name + ".send");
+        euluna->setField("send");
+        euluna->pushCppFunction([self](EulunaInterface *lua) { return self->luaReceive(lua); }, name + ".receive");
+        euluna->setField("receive");
+        euluna->pushCppFunction([self](EulunaInterface *lua) {
+            lua->clearStack();
+            lua->pushInteger(self->size());
+            return 1;
+        }, name + ".size");
+        euluna->setField("size");
+        euluna->setGlobal(name);
+    }
+
+    // sends a serialized message, the message is moved only when sent, returns false when full
+    bool trySend(std::string& message) {
+        if(!m_queue.try_push(message))
+            return false;
+        notifyWaiting(m_waitingReceivers);
+        return true;
+    }
+    bool tryReceive(std::string& message) {
+        if(!m_queue.try_pop(message))
+            return false;
+        notifyWaiting(m_waitingSenders);
+        return true;
+    }
+
+    // block until the message is sent or received, returns false on timeout
+    bool send(std::string& message, std::chrono::microseconds timeout = std::chrono::microseconds::max()) {
+        if(!wait(m_waitingSenders, timeout, [&] { return m_queue.try_push(message); }))
+            return false;
+        notifyWaiting(m_waitingReceivers);
+        return true;
+    }
+    bool receive(std::string& message, std::chrono::microseconds timeout = std::chrono::microseconds::max()) {
+        if(!wait(m_waitingReceivers, timeout, [&] { return m_queue.try_pop(message); }))
+            return false;
+        notifyWaiting(m_waitingSenders);
+        return true;
+    }
+
+    size_t size() const { return m_queue.size(); }
+    size_t capacity() const { return m_queue.capacity(); }
+
+    // appends the value at the index to the message
+    static void serialize(EulunaInterface *lua, int index, std::string& message, int depth = 0) {
+        if(index < 0)
+            index = lua->stackSize() + index + 1;
+        switch(lua->type(index)) {
+            case LUA_TNIL:
+                message += 'n';
+                break;
+            case LUA_TBOOLEAN:
+                message += lua->toBoolean(index) ? 't' : 'f';
+                break;
+            case LUA_TNUMBER: {
+#if LUA_VERSION_NUM >= 503
+                if(lua_isinteger(lua->luaState(), index)) {
+                    lua_Integer v = lua_tointeger(lua->luaState(), index);
+                    message += 'i';
+                    message.append(reinterpret_cast<const char*>(&v), sizeof(v));
+                    break;
+                }
+#endif
+                lua_Number v = lua_tonumber(lua->luaState(), index);
+                message += 'd';
+                message.append(reinterpret_cast<const char*>(&v), sizeof(v));
+                break;
+            }
+            case LUA_TSTRING: {
+                size_t len;
+                const char *str = lua_tolstring(lua->luaState(), index, &len);
+                // 64 bits lengths, strings over 4GB would not fit 32 bits
+                uint64_t len64 = len;
+                message += 's';
+                message.append(reinterpret_cast<const char*>(&len64), sizeof(len64));
+                message.append(str, len);
+                break;
+            }
+            case LUA_TTABLE: {
+                if(depth >= MAX_DEPTH)
+                    throw EulunaEngineError("Unable to send a table nested too deeply or with cycles through a channel");
+                if(!lua_checkstack(lua->luaState(), 2))
+                    throw EulunaMemoryError("stack overflow while sending a table through a channel");
+                message += 'T';
+                lua->pushNil();
+                while(lua->next(index)) {
+                    serialize(lua, -2, message, depth + 1);
+                    serialize(lua, -1, message, depth + 1);
+                    lua->pop();
+                }
+                message += 'e';
+                break;
+            }
+            default:
+                throw EulunaEngineError(euluna_tools::format("Unable to send a %s through a channel", lua->toTypeName(index)));
+        }
+    }
+
+    // pushes the value at the position of the message and advances the position
+    static void deserialize(EulunaInterface *lua, const std::string& message, size_t& pos) {
+        if(pos >= message.size())
+            throw EulunaEngineError("Truncated channel message");
+        lua_State *L = lua->luaState();
+        const char *data = message.data();
+        char tag = data[pos++];
+        switch(tag) {
+            case 'n': lua->pushNil(); break;
+            case 't': lua->pushBoolean(true); break;
+            case 'f': lua->pushBoolean(false); break;
+#if LUA_VERSION_NUM >= 503
+            case 'i': {
+                lua_Integer v;
+                read(message, pos, &v, sizeof(v));
+                lua_pushinteger(L, v);
+                break;
+            }
+#endif
+            case 'd': {
+                lua_Number v;
+                read(message, pos, &v, sizeof(v));
+                lua_pushnumber(L, v);
+                break;
+            }
+            case 's': {
+                uint64_t len;
+                read(message, pos, &len, sizeof(len));
+                if(message.size() - pos < len)
+                    throw EulunaEngineError("Truncated channel message");
+                lua_pushlstring(L, data + pos, len);
+                pos += len;
+                break;
+            }
+            case 'T': {
+                if(!lua_checkstack(L, 3))
+                    throw EulunaMemoryError("stack overflow while receiving a table from a channel");
+                lua->newTable();
+                while(pos < message.size() && data[pos] != 'e') {
+                    deserialize(lua, message, pos);
+                    deserialize(lua, message, pos);
+                    lua_rawset(L, -3);
+                }
+                if(pos >= message.size())
+                    throw EulunaEngineError("Truncated channel message");
+                pos++;
+                break;
+            }
+            default:
+                throw EulunaEngineError("Invalid channel message");
+        }
+    }
+
+private:
+    enum { MAX_DEPTH = 64 };
+
+    static void read(const std::string& message, size_t& pos, void *out, size_t size) {
+        if(message.size() - pos < size)
+            throw EulunaEngineError("Truncated channel message");
+        memcpy(out, message.data() + pos, size);
+        pos += size;
+    }
+
+    static std::chrono::microseconds toTimeout(EulunaInterface *lua, int index) {
+        if(lua->type(index) <= LUA_TNIL)
+            return std::chrono::microseconds::max();
+        return std::chrono::microseconds((int64_t)(std::max(lua->toNumber(index), 0.0) * 1000000));
+    }
+
+    void notifyWaiting(std::atomic<int>& waiting) {
+        // pairs with the fence done by waiting threads before retrying
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(waiting.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_condition.notify_all();
+        }
+    }
+
+    // the operation is retried under the lock every time the other side notifies
+    template<typename F>
+    bool wait(std::atomic<int>& waiting, std::chrono::microseconds timeout, const F& tryOperation) {
+        if(tryOperation())
+            return true;
+        if(timeout.count() <= 0)
+            return false;
+        auto deadline = deadlineOf(timeout);
+        std::unique_lock<std::mutex> lock(m_mutex);
+        waiting.fetch_add(1);
+        // pairs with the fence done by notifyWaiting after changing the queue
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool ret = true;
+        while(!tryOperation()) {
+            if(deadline == std::chrono::steady_clock::time_point::max())
+                m_condition.wait(lock);
+            else if(m_condition.wait_until(lock, deadline) == std::cv_status::timeout) {
+                ret = tryOperation();
+                break;
+            }
+        }
+        waiting.fetch_sub(1);
+        return ret;
+    }
+
+    int luaSend(EulunaInterface *lua) {
+        std::chrono::microseconds timeout = toTimeout(lua, 2);
+        std::shared_ptr<std::string> message = std::make_shared<std::string>();
+        serialize(lua, 1, *message);
+        lua->clearStack();
+        if(trySend(*message) || (!EulunaScheduler::canAwait(lua) && send(*message, timeout))) {
+            lua->pushBoolean(true);
+            return 1;
+        }
+        if(timeout.count() <= 0 || !EulunaScheduler::canAwait(lua)) {
+            lua->pushBoolean(false);
+            return 1;
+        }
+        // async calls wait for space until the scheduler polls
+        std::shared_ptr<EulunaChannel> self = shared_from_this();
+        auto deadline = deadlineOf(timeout);
+        std::shared_ptr<bool> sent = std::make_shared<bool>(false);
+        return EulunaScheduler::await(lua, EulunaAwaitable([self, message, sent, deadline] {
+            *sent = self->trySend(*message);
+            return *sent || std::chrono::steady_clock::now() >= deadline;
+        }, [sent](EulunaInterface *lua) {
+            lua->pushBoolean(*sent);
+            return 1;
+        }));
+    }
+
+    int luaReceive(EulunaInterface *lua) {
+        std::chrono::microseconds timeout = toTimeout(lua, 1);
+        lua->clearStack();
+        std::shared_ptr<std::string> message = std::make_shared<std::string>();
+        if(tryReceive(*message) || (!EulunaScheduler::canAwait(lua) && receive(*message, timeout)))
+            return pushReceived(lua, *message);
+        if(timeout.count() <= 0 || !EulunaScheduler::canAwait(lua))
+            return pushTimeout(lua);
+        // async calls wait for a message until the scheduler polls
+        std::shared_ptr<EulunaChannel> self = shared_from_this();
+        auto deadline = deadlineOf(timeout);
+        std::shared_ptr<bool> received = std::make_shared<bool>(false);
+        return EulunaScheduler::await(lua, EulunaAwaitable([self, message, received, deadline] {
+            *received = self->tryReceive(*message);
+            return *received || std::chrono::steady_clock::now() >= deadline;
+        }, [message, received](EulunaInterface *lua) {
+            return *received ? pushReceived(lua, *message) : pushTimeout(lua);
+        }));
+    }
+
+    static int pushReceived(EulunaInterface *lua, const std::string& message) {
+        lua->pushBoolean(true);
+        size_t pos = 0;
+        deserialize(lua, message, pos);
+        return 2;
+    }
+    static int pushTimeout(EulunaInterface *lua) {
+        lua->pushBoolean(false);
+        lua->pushCString("timeout");
+        return 2;
+    }
+
+    static std::chrono::steady_clock::time_point deadlineOf(std::chrono::microseconds timeout) {
+        if(timeout == std::chrono::microseconds::max())
+            return std::chrono::steady_clock::time_point::max();
+        return std::chrono::steady_clock::now() + timeout;
+    }
+
+    euluna_tools::mpmc_queue<std::string> m_queue;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::atomic<int> m_waitingSenders{0};
+    std::atomic<int> m_waitingReceivers{0};
+};
+
+#endif // EULUNACHANNEL_HPP
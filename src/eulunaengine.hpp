@@ -24,12 +24,81 @@
 #define EULUNAENGINE_HPP
 
 #include "eulunainterface.hpp"
+#include "eulunaasync.hpp"
+#include "eulunaallocator.hpp"
+
+// Statistics of the garbage collector steps run by the engine
+struct EulunaGcStats {
+    struct HeapSample {
+        int64_t time; // milliseconds since the engine creation
+        size_t size; // bytes in use
+    };
+
+    EulunaGcStats() : heapTrend(256) { }
+
+    euluna_tools::log_histogram stepDurations; // nanoseconds
+    euluna_tools::ring_buffer<HeapSample> heapTrend;
+    uint64_t cycles = 0;
+
+    std::string toJson() const {
+        std::string json = euluna_tools::format("{\"steps\":%" PRIu64 ",\"cycles\":%" PRIu64 ",\"step_ns\":{\"mean\":%" PRIu64 ",\"p50\":%" PRIu64 ",\"p99\":%" PRIu64 ",\"max\":%" PRIu64 ",\"buckets\":[",
+            stepDurations.count(), cycles, (uint64_t)stepDurations.mean(),
+            stepDurations.percentile(0.5), stepDurations.percentile(0.99), stepDurations.max());
+        bool first = true;
+        for(int i = 0; i < euluna_tools::log_histogram::NUM_BUCKETS; ++i) {
+            if(stepDurations.bucket_count(i) == 0)
+                continue;
+            json += euluna_tools::format("%s[%" PRIu64 ",%" PRIu64 "]", first ? "" : ",", euluna_tools::log_histogram::bucket_upper_bound(i), stepDurations.bucket_count(i));
+            first = false;
+        }
+        json += "]},\"heap\":[";
+        for(size_t i = 0; i < heapTrend.size(); ++i)
+            json += euluna_tools::format("%s[%" PRId64 ",%zu]", i == 0 ? "" : ",", heapTrend[i].time, heapTrend[i].size);
+        json += "]}";
+        return json;
+    }
+};
 
 // Euluna engine
 class EulunaEngine : public EulunaInterface {
 public:
-    EulunaEngine() : EulunaInterface() { }
+    EulunaEngine() : EulunaInterface(), m_callQueue(std::make_shared<EulunaCallQueue>(this, L)) { initState(); }
     explicit EulunaEngine(lua_State *L) : EulunaInterface(L)  { }
+    // creates a new lua state that allocates its memory through the given allocator
+    explicit EulunaEngine(std::unique_ptr<EulunaAllocator> allocator) :
+        EulunaInterface(&EulunaAllocator::luaAlloc, allocator.get()), m_allocator(std::move(allocator)),
+        m_callQueue(std::make_shared<EulunaCallQueue>(this, L)) {
+        m_allocator->attach(L);
+        initState();
+    }
+
+    ~EulunaEngine() {
+        // lua callbacks still held by other threads must not touch the state anymore
+        if(m_callQueue)
+            m_callQueue->close();
+        // the state is closed while the scheduler and the allocator are still alive
+        m_scheduler.reset();
+        if(m_allocator)
+            m_allocator->attach(nullptr);
+        closeState();
+    }
+
+    // calls from other threads to lua callbacks pulled by this engine, null for engines not owning their state
+    EulunaCallQueue *getCallQueue() { return m_callQueue.get(); }
+
+    // runs up to maxCalls calls queued by other threads, must be called by the thread owning the engine
+    size_t drainCalls(size_t maxCalls = std::numeric_limits<size_t>::max()) {
+        return m_callQueue ? m_callQueue->drain(maxCalls) : 0;
+    }
+
+    // allocator of the lua state, null when the state uses the default allocator
+    EulunaAllocator *getAllocator() { return m_allocator.get(); }
+
+    // measures the calls of the bound C++ functions registered from now on, building with
+    // EULUNA_BINDING_STATS enables it for every new state
+    EulunaBindingStats *enableBindingStats() { return EulunaBindingStats::enable(L); }
+    // null when the binding stats are not enabled
+    EulunaBindingStats *getBindingStats() { return EulunaBindingStats::get(L); }
 
     static EulunaEngine& instance() {
         static EulunaEngine instance;
@@ -161,30 +230,137 @@ public:
         setGlobal(functionName);
     }
 
+    // sets a table of lua C functions ended by a null entry in the class table at once
+    void registerClassFunctions(const std::string& className, const luaL_Reg* functions) {
+        getGlobal(className);
+        assert(isTable());
+        luaL_setfuncs(L, functions, 0);
+        pop();
+    }
+
+    void registerGlobalFunctions(const luaL_Reg* functions) {
+        pushGlobalTable();
+        luaL_setfuncs(L, functions, 0);
+        pop();
+    }
+
+#ifdef EULUNA_LUAJIT_FFI
+    // sets a C function as a cdata called through the LuaJIT FFI in the given class table,
+    // or in the globals table when the class name is empty, returns false when ffi is not available
+    bool registerFfiFunction(const std::string& className, const std::string& functionName, const std::string& signature, void* function) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, ffiCastKey());
+        if(isNil()) {
+            pop();
+            if(loadBuffer("return require('ffi').cast", "=ffi") != 0 || pcall(0, 1) != 0) {
+                pop();
+                return false;
+            }
+            pushValue();
+            lua_rawsetp(L, LUA_REGISTRYINDEX, ffiCastKey());
+        }
+        pushString(signature);
+        pushLightUserdata(function);
+        if(pcall(2, 1) != 0) {
+            pop();
+            return false;
+        }
+        if(className.empty())
+            setGlobal(functionName);
+        else {
+            getGlobal(className);
+            assert(isTable());
+            insert(-2);
+            setField(functionName);
+            pop();
+        }
+        return true;
+    }
+#endif
+
+    // enables the bytecode cache for scripts loaded from files, an empty dir disables it,
+    // lua doesn't verify bytecode so the dir must be private to the user, otherwise the cache stays disabled
+    bool setScriptCacheDir(const std::string& dir) {
+        m_scriptCacheDir.clear();
+        if(dir.empty())
+            return true;
+        mkdir(dir.c_str(), 0700);
+        struct stat st;
+        if(stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)))
+            return false;
+        m_scriptCacheDir = dir;
+        return true;
+    }
+    std::string getScriptCacheDir() const { return m_scriptCacheDir; }
+
+    // returns the cache file that holds the bytecode of a script, each script has a single entry
+    // that is replaced when its source changes
+    std::string getScriptCacheFile(const std::string& chunkName) {
+        // key by the lua version and architecture, as bytecode is not portable across them
+        static const uint64_t versionHash = euluna_tools::fnv1a_hash(euluna_tools::format("%s:%d:%d:%d",
+                                            LUA_RELEASE, (int)sizeof(void*), (int)sizeof(lua_Number), (int)sizeof(size_t)));
+        uint64_t hash = euluna_tools::fnv1a_hash(chunkName, versionHash);
+        return euluna_tools::format("%s/%016" PRIx64 ".luac", m_scriptCacheDir, hash);
+    }
+
     // functions that can throw exceptions
     template<typename R = void>
     R safeRunBuffer(const std::string& buffer, const std::string& source = "") {
+        m_scriptGeneration++;
         return polymorphicSafeDoBuffer<R>(buffer, source);
     }
 
+    // loads a script file and pushes its chunk, using the bytecode cache when enabled
+    void safeLoadScript(const std::string& fileName) {
+        m_scriptGeneration++;
+        if(m_scriptCacheDir.empty()) {
+            safeLoadFile(fileName);
+            return;
+        }
+
+        euluna_tools::mapped_file file(fileName);
+        if(!file.isOpen())
+            throw EulunaFileError(euluna_tools::format("cannot open '%s'", fileName));
+        std::string chunkName = "@" + fileName;
+        std::string cacheFileName = getScriptCacheFile(chunkName);
+        uint64_t sourceHash = euluna_tools::fnv1a_hash(file.data(), file.size());
+
+        // try to load the cached bytecode, when stale or corrupt it's just ignored
+        if(loadCachedBytecode(cacheFileName, file.size(), sourceHash))
+            return;
+
+        // compile from source and save its bytecode for the next loads, replacing the stale entry
+        safeLoadChunk(file.data(), file.size(), chunkName);
+        saveCachedBytecode(cacheFileName, file.size(), sourceHash);
+    }
+
+    template<typename R = void>
+    R safeRunScript(const std::string& fileName) {
+        safeLoadScript(fileName);
+        return polymorphicSafeCall<R>();
+    }
+
     template<typename R = void, typename... T>
     R safeCallGlobal(const std::string& name, const T&... args) {
+        pushErrorHandler();
+        int errorFuncIndex = stackSize();
         getGlobal(name);
         if(isNil()) { // silent return
-            pop();
+            pop(2);
             return R();
         }
-        return polymorphicSafeCall<R>(args...);
+        return polymorphicHandledMultiCall<R>(errorFuncIndex, args...);
     }
 
     template<typename R = void, typename... T>
     R safeCallGlobalField(const std::string& global, const std::string& field, const T&... args) {
+        pushErrorHandler();
+        int errorFuncIndex = stackSize();
         getGlobalField(global, field);
         if(isNil()) { // silent return
-            pop();
+            pop(2);
             return R();
         }
-        return polymorphicSafeCall<R>(args...);
+        return polymorphicHandledMultiCall<R>(errorFuncIndex, args...);
     }
 
     // functions that instead if throwing exception will set last error string
@@ -199,6 +375,59 @@ public:
         }
     }
 
+    // async functions run as coroutines that can wait for async results returned by bound functions,
+    // they return whether the coroutine is still waiting, the waiting ones are resumed by pollAsync
+    bool safeRunBufferAsync(const std::string& buffer, const std::string& source = "") {
+        m_scriptGeneration++;
+        safeLoadBuffer(buffer, source);
+        return getScheduler().spawn(0);
+    }
+
+    template<typename... T>
+    bool safeCallGlobalAsync(const std::string& name, const T&... args) {
+        getGlobal(name);
+        if(isNil()) { // silent return
+            pop();
+            return false;
+        }
+        int numArgs = polymorphicPush(args...);
+        return getScheduler().spawn(numArgs);
+    }
+
+    size_t safePollAsync() {
+        if(!m_scheduler)
+            return 0;
+        return m_scheduler->poll();
+    }
+
+    EulunaScheduler& getScheduler() {
+        if(!m_scheduler)
+            m_scheduler.reset(new EulunaScheduler(this));
+        return *m_scheduler;
+    }
+
+    bool loadScript(const std::string& fileName) {
+        m_lastError.clear();
+        try {
+            safeLoadScript(fileName);
+            return true;
+        } catch(std::exception& e) {
+            m_lastError = e.what();
+            return false;
+        }
+    }
+
+    template<typename R = void>
+    R runScript(const std::string& fileName) {
+        m_lastError.clear();
+        try {
+            return safeRunScript<R>(fileName);
+        } catch(std::exception& e) {
+            m_lastError = e.what();
+            return R();
+        }
+    }
+
     template<typename R = void, typename... T>
     R callGlobal(const std::string& name, const T&... args) {
         m_lastError.clear();
@@ -210,6 +439,37 @@ public:
         }
     }
 
+    bool runBufferAsync(const std::string& buffer, const std::string& source = "") {
+        m_lastError.clear();
+        try {
+            return safeRunBufferAsync(buffer, source);
+        } catch(std::exception& e) {
+            m_lastError = e.what();
+            return false;
+        }
+    }
+
+    template<typename... T>
+    bool callGlobalAsync(const std::string& name, const T&... args) {
+        m_lastError.clear();
+        try {
+            return safeCallGlobalAsync(name, args...);
+        } catch(std::exception& e) {
+            m_lastError = e.what();
+            return false;
+        }
+    }
+
+    size_t pollAsync() {
+        m_lastError.clear();
+        try {
+            return safePollAsync();
+        } catch(std::exception& e) {
+            m_lastError = e.what();
+            return m_scheduler ? m_scheduler->getWaitingCount() : 0;
+        }
+    }
+
     template<typename R = void, typename... T>
     R callGlobalField(const std::string& name, const T&... args) {
         m_lastError.clear();
@@ -221,11 +481,401 @@ public:
         }
     }
 
+    // generation of the loaded code, incremented whenever the engine loads new code,
+    // function refs resolve their path again when it changes
+    uint64_t getScriptGeneration() const { return m_scriptGeneration; }
+    // makes every function ref resolve its path again on its next use
+    void invalidateFunctionRefs() { m_scriptGeneration++; }
+
+    // runs incremental gc steps until the time budget is spent, returns true when a gc cycle finished
+    bool gcStep(std::chrono::microseconds budget) {
+        auto deadline = std::chrono::steady_clock::now() + budget;
+        bool finished;
+        do {
+            finished = timedGcStep(0);
+        } while(!finished && std::chrono::steady_clock::now() < deadline);
+        recordHeapSize();
+        return finished;
+    }
+
+    // runs one incremental gc step doing the work needed for the given amount of allocated kilobytes
+    bool gcStepBytes(int kilobytes) {
+        bool finished = timedGcStep(kilobytes);
+        recordHeapSize();
+        return finished;
+    }
+
+    // stops or restarts the automatic gc, when stopped the gc only runs from gcStep or collect
+    void setGcRunning(bool running) { gc(running ? LUA_GCRESTART : LUA_GCSTOP, 0); }
+
+    // gc pause and step multiplier in percent, they return the previous values
+    int setGcPause(int pause) { return gc(LUA_GCSETPAUSE, pause); }
+    int setGcStepMul(int stepMul) { return gc(LUA_GCSETSTEPMUL, stepMul); }
+
+    // switches between generational and incremental gc, returns false when the lua version has no generational gc
+    bool setGcGenerational(bool generational) {
+#if LUA_VERSION_NUM >= 504
+        lua_gc(L, generational ? LUA_GCGEN : LUA_GCINC, 0, 0);
+        return true;
+#else
+        return !generational;
+#endif
+    }
+
+    // bytes allocated by the lua state
+    size_t gcMemoryUsage() { return (size_t)gc(LUA_GCCOUNT, 0) * 1024 + gc(LUA_GCCOUNTB, 0); }
+
+    const EulunaGcStats& getGcStats() const { return m_gcStats; }
+    void resetGcStats() { m_gcStats = EulunaGcStats(); }
+
+    // saves every table, metatable, function upvalue and function environment reachable from the globals
+    // and the registry so the state can be reset to this point, any async call still waiting is dropped
+    void checkpoint() {
+        m_scheduler.reset();
+        int top = stackSize();
+        // create lazy tables now so they are kept by resets
+        pushErrorHandler();
+        getWeakTable();
+        pop(2);
+
+        CheckpointTables tables;
+        newTable();
+        tables.snapshot = stackSize();
+        pushValue(tables.snapshot);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, checkpointKey());
+        // metatables are indexed by their table, environments are a list of function and environment pairs
+        newTable();
+        tables.metatables = stackSize();
+        pushValue(tables.metatables);
+        lua_rawsetp(L, tables.snapshot, metatablesKey());
+        newTable();
+        tables.environments = stackSize();
+        pushValue(tables.environments);
+        lua_rawsetp(L, tables.snapshot, environmentsKey());
+        newTable();
+        tables.functions = stackSize();
+
+        // values still to be saved, a list is used instead of recursion so deep structures can't overflow the c stack
+        newTable();
+        tables.pending = stackSize();
+        pushValue(LUA_REGISTRYINDEX);
+        rawSeti(++tables.numPending, tables.pending);
+        pushGlobalTable();
+        rawSeti(++tables.numPending, tables.pending);
+        while(tables.numPending > 0) {
+            rawGeti(tables.numPending, tables.pending);
+            pushNil();
+            rawSeti(tables.numPending--, tables.pending);
+            checkpointValue(tables);
+            pop();
+        }
+        setTop(top);
+    }
+
+    bool hasCheckpoint() {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, checkpointKey());
+        bool ret = !isNil();
+        pop();
+        return ret;
+    }
+
+    // restores the tables and upvalues saved by checkpoint, fields added after it are removed and the stack is cleared,
+    // objects created since then must not be referenced from c++ anymore (function refs, lua function holders)
+    void resetToCheckpoint(int gcStepSize = 0) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, checkpointKey());
+        if(isNil()) {
+            pop();
+            throw EulunaEngineError("Attempt to reset a lua state without a checkpoint");
+        }
+        int snapshot = stackSize();
+        m_scheduler.reset();
+        lua_rawgetp(L, snapshot, metatablesKey());
+        int metatables = stackSize();
+        pushNil();
+        while(next(snapshot)) {
+            if(isTable(-2)) {
+                restoreTable(stackSize() - 1, stackSize());
+                restoreMetatable(stackSize() - 1, metatables);
+            } else if(isFunction(-2))
+                restoreUpvalues(stackSize() - 1, stackSize());
+            pop();
+        }
+        lua_rawgetp(L, snapshot, environmentsKey());
+        restoreEnvironments(stackSize());
+        clearStack();
+        m_lastError.clear();
+        m_scriptGeneration++;
+        gc(LUA_GCSTEP, gcStepSize);
+    }
+
     std::string getLastError() { return m_lastError; }
     bool hasError() { return !m_lastError.empty(); }
 
 private:
+    // setup of the states created by the engine
+    void initState() {
+#ifdef EULUNA_BINDING_STATS
+        enableBindingStats();
+#endif
+    }
+
+    bool timedGcStep(int kilobytes) {
+        EULUNA_TRACE_SCOPE("step", "gc");
+        auto start = std::chrono::steady_clock::now();
+        bool finished = gc(LUA_GCSTEP, kilobytes) != 0;
+        m_gcStats.stepDurations.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        if(finished)
+            m_gcStats.cycles++;
+        return finished;
+    }
+
+    void recordHeapSize() {
+        EulunaGcStats::HeapSample sample;
+        sample.time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_creationTime).count();
+        sample.size = gcMemoryUsage();
+        m_gcStats.heapTrend.push(sample);
+    }
+
+    // stack indexes of the tables used while saving a checkpoint
+    struct CheckpointTables {
+        int snapshot;
+        int metatables;
+        int environments;
+        // functions already visited, most have no upvalues and are not in the snapshot
+        int functions;
+        int pending;
+        int numEnvironments = 0;
+        int numPending = 0;
+    };
+
+    static void* checkpointKey() {
+        static char key;
+        return &key;
+    }
+    static void* metatablesKey() {
+        static char key;
+        return &key;
+    }
+    static void* environmentsKey() {
+        static char key;
+        return &key;
+    }
+
+#ifdef EULUNA_LUAJIT_FFI
+    static void* ffiCastKey() {
+        static char key;
+        return &key;
+    }
+#endif
+
+    // saves a copy of the table or the upvalues of the function on the top into the snapshot table,
+    // indexed by the value itself, along its metatable or environment,
+    // the tables and functions it references are appended to the pending list
+    void checkpointValue(CheckpointTables& tables) {
+        int value = stackSize();
+        if(!isTable(value) && !isFunction(value))
+            return;
+        pushValue(value);
+        rawGet(isFunction(value) ? tables.functions : tables.snapshot);
+        bool saved = !isNil() || lua_rawequal(L, value, tables.snapshot);
+        pop();
+        // the snapshot is itself in the registry and must not be restored while traversing it,
+        // weak tables are caches, keeping a copy of them would hold their values forever
+        if(saved)
+            return;
+        if(isTable(value) && getMetaField("__mode", value) != 0) {
+            pop();
+            return;
+        }
+
+        auto addPending = [&](int index) {
+            if(isTable(index) || isFunction(index)) {
+                pushValue(index);
+                rawSeti(++tables.numPending, tables.pending);
+            }
+        };
+
+        newTable();
+        int copy = stackSize();
+        if(isTable(value)) {
+            pushNil();
+            while(next(value)) {
+                addPending(-2);
+                addPending(-1);
+                pushValue(-2);
+                insert(-2);
+                rawSet(copy);
+            }
+            if(lua_getmetatable(L, value)) {
+                addPending(-1);
+                pushValue(value);
+                insert(-2);
+                rawSet(tables.metatables);
+            }
+        } else {
+            pushValue(value);
+            pushBoolean(true);
+            rawSet(tables.functions);
+#if LUA_VERSION_NUM < 502
+            // lua 5.1 functions have an environment table instead of an _ENV upvalue, lua can't change the one of c functions
+            if(!lua_iscfunction(L, value)) {
+                pushValue(value);
+                rawSeti(++tables.numEnvironments, tables.environments);
+                lua_getfenv(L, value);
+                addPending(-1);
+                rawSeti(++tables.numEnvironments, tables.environments);
+            }
+#endif
+
+            // upvalues are stored by their index and their count at index 0, nil upvalues are restored too
+            int numUpvalues = 0;
+            while(lua_getupvalue(L, value, numUpvalues + 1)) {
+                addPending(-1);
+                rawSeti(++numUpvalues, copy);
+            }
+            // functions without upvalues have nothing to restore
+            if(numUpvalues == 0) {
+                pop();
+                return;
+            }
+            pushInteger(numUpvalues);
+            rawSeti(0, copy);
+        }
+        pushValue(value);
+        pushValue(copy);
+        rawSet(tables.snapshot);
+        pop();
+    }
+
+    void restoreTable(int table, int copy) {
+        // remove fields added after the checkpoint, clearing fields while traversing is allowed
+        pushNil();
+        while(next(table)) {
+            pop();
+            pushValue();
+            rawGet(copy);
+            bool added = isNil();
+            pop();
+            if(added) {
+                pushValue();
+                pushNil();
+                rawSet(table);
+            }
+        }
+        // restore the original values, this also restores the free list of registry refs
+        pushNil();
+        while(next(copy)) {
+            pushValue(-2);
+            insert(-2);
+            rawSet(table);
+        }
+    }
+
+    // tables without a metatable at the checkpoint have no entry
+    void restoreMetatable(int table, int metatables) {
+        pushValue(table);
+        rawGet(metatables);
+        if(!lua_getmetatable(L, table))
+            pushNil();
+        bool changed = !lua_rawequal(L, -1, -2);
+        pop();
+        if(changed)
+            lua_setmetatable(L, table);
+        else
+            pop();
+    }
+
+    void restoreEnvironments(int environments) {
+#if LUA_VERSION_NUM < 502
+        int numEnvironments = (int)lua_objlen(L, environments);
+        for(int i = 1; i < numEnvironments; i += 2) {
+            rawGeti(i, environments);
+            rawGeti(i + 1, environments);
+            lua_getfenv(L, -2);
+            bool changed = !lua_rawequal(L, -1, -2);
+            pop();
+            if(changed)
+                lua_setfenv(L, -2);
+            else
+                pop();
+            pop();
+        }
+#endif
+    }
+
+    void restoreUpvalues(int function, int copy) {
+        rawGeti(0, copy);
+        int numUpvalues = toInteger();
+        pop();
+        for(int i = 1; i <= numUpvalues; ++i) {
+            rawGeti(i, copy);
+            if(!lua_setupvalue(L, function, i))
+                pop();
+        }
+    }
+
+    // header of bytecode cache files
+    struct ScriptCacheHeader {
+        char magic[8];
+        uint32_t luaVersion;
+        uint32_t formatVersion;
+        uint64_t sourceSize;
+        uint64_t sourceHash;
+        uint64_t bytecodeSize;
+        uint64_t bytecodeHash;
+    };
+    enum { ScriptCacheFormatVersion = 2 };
+
+    // the source hash is checked before the bytecode is given to lua, entries of other sources are never loaded
+    bool loadCachedBytecode(const std::string& cacheFileName, size_t sourceSize, uint64_t sourceHash) {
+        euluna_tools::mapped_file cache(cacheFileName);
+        if(!cache.isOpen() || cache.size() < sizeof(ScriptCacheHeader))
+            return false;
+        ScriptCacheHeader header;
+        std::memcpy(&header, cache.data(), sizeof(header));
+        const char *bytecode = cache.data() + sizeof(header);
+        if(std::memcmp(header.magic, "EULUNAC", 8) != 0 ||
+           header.luaVersion != LUA_VERSION_NUM ||
+           header.formatVersion != ScriptCacheFormatVersion ||
+           header.sourceSize != sourceSize ||
+           header.sourceHash != sourceHash ||
+           header.bytecodeSize != cache.size() - sizeof(header) ||
+           header.bytecodeHash != euluna_tools::fnv1a_hash(bytecode, header.bytecodeSize))
+            return false;
+        // the chunk name is embedded in the bytecode
+        if(loadChunk(bytecode, header.bytecodeSize, std::string()) != LUA_OK) {
+            pop();
+            return false;
+        }
+        return true;
+    }
+
+    void saveCachedBytecode(const std::string& cacheFileName, size_t sourceSize, uint64_t sourceHash) {
+        std::string bytecode;
+        if(!dump(bytecode))
+            return;
+        ScriptCacheHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, "EULUNAC", 8);
+        header.luaVersion = LUA_VERSION_NUM;
+        header.formatVersion = ScriptCacheFormatVersion;
+        header.sourceSize = sourceSize;
+        header.sourceHash = sourceHash;
+        header.bytecodeSize = bytecode.size();
+        header.bytecodeHash = euluna_tools::fnv1a_hash(bytecode);
+        bytecode.insert(0, reinterpret_cast<const char*>(&header), sizeof(header));
+        // failing to write the cache is not an error, the script will just be compiled again
+        euluna_tools::write_file_atomic(cacheFileName, bytecode.data(), bytecode.size());
+    }
+
     std::string m_lastError;
+    std::string m_scriptCacheDir;
+    uint64_t m_scriptGeneration = 0;
+    std::unique_ptr<EulunaScheduler> m_scheduler;
+    std::unique_ptr<EulunaAllocator> m_allocator;
+    std::shared_ptr<EulunaCallQueue> m_callQueue;
+    EulunaGcStats m_gcStats;
+    std::chrono::steady_clock::time_point m_creationTime = std::chrono::steady_clock::now();
 };
 
 #endif // EULUNAENGINE_HPP
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2016 Euluna <https://github.com/edubart/euluna>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef EULUNAENGINEPOOL_HPP
+#define EULUNAENGINEPOOL_HPP
+
+#include "eulunaengine.hpp"
+#include "eulunabinder.hpp"
+#include "eulunathreadpool.hpp"
+
+// Runs jobs on a set of lua states, one per worker thread
+class EulunaEnginePool {
+public:
+    typedef std::function<void(EulunaEngine*)> Bootstrap;
+
+    // every worker creates its own engine, registers the binder bindings and runs the bootstrap on it
+    explicit EulunaEnginePool(size_t numWorkers, Bootstrap bootstrap = nullptr, EulunaBinder *binder = &EulunaBinder::instance()) :
+        m_engines(numWorkers > 0 ? numWorkers : 1),
+        m_bootstrap(std::move(bootstrap)),
+        m_binder(binder) {
+        m_pool.reset(new EulunaThreadPool(m_engines.size(),
+            [this](size_t index) { startWorker(index); },
+            [this](size_t index) { m_engines[index].reset(); }));
+        std::unique_lock<std::mutex> lock(m_startMutex);
+        m_startCondition.wait(lock, [this] { return m_numStarted == m_engines.size(); });
+        if(m_startError) {
+            lock.unlock();
+            m_pool.reset();
+            std::rethrow_exception(m_startError);
+        }
+    }
+
+    ~EulunaEnginePool() { m_pool.reset(); }
+
+    EulunaEnginePool(const EulunaEnginePool&) = delete;
+    EulunaEnginePool& operator=(const EulunaEnginePool&) = delete;
+
+    // runs the job on any idle engine
+    template<typename F>
+    std::future<typename std::result_of<F(EulunaEngine*)>::type> submit(F&& job) {
+        typedef typename std::result_of<F(EulunaEngine*)>::type R;
+        auto task = std::make_shared<std::packaged_task<R(EulunaEngine*)>>(std::forward<F>(job));
+        std::future<R> future = task->get_future();
+        m_pool->post([this, task] { (*task)(currentEngine()); });
+        return future;
+    }
+
+    // runs the job always on the same engine for the same key, useful for jobs that keep state in lua
+    template<typename F>
+    std::future<typename std::result_of<F(EulunaEngine*)>::type> submit(size_t affinityKey, F&& job) {
+        typedef typename std::result_of<F(EulunaEngine*)>::type R;
+        auto task = std::make_shared<std::packaged_task<R(EulunaEngine*)>>(std::forward<F>(job));
+        std::future<R> future = task->get_future();
+        m_pool->post(affinityKey % m_engines.size(), [this, task] { (*task)(currentEngine()); });
+        return future;
+    }
+
+    // runs the job once on every engine and waits for all of them
+    void broadcast(const std::function<void(EulunaEngine*)>& job) {
+        std::vector<std::future<void>> futures;
+        futures.reserve(m_engines.size());
+        for(size_t i = 0; i < m_engines.size(); ++i)
+            futures.push_back(submit(i, job));
+        for(auto& future : futures)
+            future.get();
+    }
+
+    size_t size() const { return m_engines.size(); }
+
+    // engine of the calling worker thread, null when not called from a job of this pool
+    EulunaEngine *currentEngine() {
+        int index = m_pool->currentWorker();
+        if(index < 0)
+            return nullptr;
+        return m_engines[index].get();
+    }
+
+private:
+    void startWorker(size_t index) {
+        std::exception_ptr error;
+        try {
+            std::unique_ptr<EulunaEngine> engine(new EulunaEngine);
+            if(m_binder)
+                m_binder->registerBindings(engine.get());
+            if(m_bootstrap)
+                m_bootstrap(engine.get());
+            m_engines[index] = std::move(engine);
+        } catch(...) {
+            error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(m_startMutex);
+        if(error && !m_startError)
+            m_startError = error;
+        m_numStarted++;
+        m_startCondition.notify_all();
+    }
+
+    std::vector<std::unique_ptr<EulunaEngine>> m_engines;
+    Bootstrap m_bootstrap;
+    EulunaBinder *m_binder;
+    std::mutex m_startMutex;
+    std::condition_variable m_startCondition;
+    size_t m_numStarted = 0;
+    std::exception_ptr m_startError;
+    std::unique_ptr<EulunaThreadPool> m_pool;
+};
+
+#endif // EULUNAENGINEPOOL_HPP
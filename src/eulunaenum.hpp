@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2016 Euluna <https://github.com/edubart/euluna>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef EULUNAENUM_HPP
+#define EULUNAENUM_HPP
+
+#include "eulunatools.hpp"
+#include "eulunaexception.hpp"
+
+// Names and values of a bound enum, filled at static init by EULUNA_BEGIN_ENUM,
+// names are converted with a perfect hash built by the first lookup,
+// so the lookups must only start after all enumerators are added
+template<typename E>
+class EulunaEnum {
+    static_assert(std::is_enum<E>::value, "EulunaEnum needs an enum type");
+public:
+    typedef typename std::underlying_type<E>::type underlying_type;
+
+    struct Entry {
+        std::string name;
+        E value;
+    };
+
+    // the same enumerator can be added by more than one binder, names with another value are rejected
+    static void add(const std::string& name, E value) {
+        EulunaEnum& e = instance();
+        std::lock_guard<std::mutex> lock(e.m_mutex);
+        for(const Entry& entry : e.m_entries) {
+            if(entry.name != name)
+                continue;
+            if(entry.value != value)
+                throw EulunaEngineError(euluna_tools::format("Enumerator '%s' is already defined with another value", name));
+            return;
+        }
+        e.m_entries.push_back(Entry{name, value});
+        auto it = std::lower_bound(e.m_values.begin(), e.m_values.end(), (underlying_type)value);
+        if(it == e.m_values.end() || *it != (underlying_type)value)
+            e.m_values.insert(it, (underlying_type)value);
+        e.m_hashed = false;
+    }
+
+    static bool fromName(const char *name, size_t len, E& value) {
+        EulunaEnum& e = instance();
+        if(!e.m_hashed) {
+            std::lock_guard<std::mutex> lock(e.m_mutex);
+            if(!e.m_hashed) {
+                e.buildHash();
+                e.m_hashed = true;
+            }
+        }
+        if(e.m_entries.empty())
+            return false;
+        int i = e.m_slots[e.slot(name, len, e.m_seed)];
+        if(i < 0 || e.m_entries[i].name.length() != len || memcmp(e.m_entries[i].name.data(), name, len) != 0)
+            return false;
+        value = e.m_entries[i].value;
+        return true;
+    }
+    static bool fromName(const std::string& name, E& value) { return fromName(name.data(), name.length(), value); }
+
+    static bool isValid(underlying_type value) {
+        const EulunaEnum& e = instance();
+        return std::binary_search(e.m_values.begin(), e.m_values.end(), value);
+    }
+
+    // returns nullptr for values without a name
+    static const char *toName(E value) {
+        for(const Entry& entry : instance().m_entries) {
+            if(entry.value == value)
+                return entry.name.c_str();
+        }
+        return nullptr;
+    }
+
+    static const std::vector<Entry>& entries() { return instance().m_entries; }
+
+private:
+    EulunaEnum() { }
+
+    static EulunaEnum& instance() {
+        static EulunaEnum instance;
+        return instance;
+    }
+
+    size_t slot(const char *name, size_t len, uint64_t seed) const {
+        return euluna_tools::fnv1a_hash(name, len, 14695981039346656037ULL ^ (seed * 0x9E3779B97F4A7C15ULL)) & (m_slots.size() - 1);
+    }
+
+    // searches a seed that maps every name to its own slot, growing the table when too many seeds collide
+    void buildHash() {
+        size_t size = 4;
+        while(size < m_entries.size() * 2)
+            size *= 2;
+        for(;; size *= 2) {
+            m_slots.assign(size, -1);
+            for(uint64_t seed = 0; seed < 64; ++seed) {
+                bool collided = false;
+                for(size_t i = 0; i < m_entries.size() && !collided; ++i) {
+                    int& s = m_slots[slot(m_entries[i].name.data(), m_entries[i].name.length(), seed)];
+                    if(s >= 0)
+                        collided = true;
+                    else
+                        s = i;
+                }
+                if(!collided) {
+                    m_seed = seed;
+                    return;
+                }
+                std::fill(m_slots.begin(), m_slots.end(), -1);
+            }
+        }
+    }
+
+    std::vector<Entry> m_entries;
+    std::vector<underlying_type> m_values;
+    std::vector<int> m_slots;
+    uint64_t m_seed = 0;
+    std::atomic<bool> m_hashed{false};
+    std::mutex m_mutex;
+};
+
+namespace euluna_caster {
+
+// enums that are pulled from lua checking their values and accepting their names, see EULUNA_CHECKED_ENUM
+template<typename E> struct is_checked_enum : std::false_type { };
+
+}
+
+// opts an enum bound with EULUNA_BEGIN_ENUM into the checked caster, must be used in the global namespace
+#define EULUNA_CHECKED_ENUM(klass) namespace euluna_caster { template<> struct is_checked_enum<klass> : std::true_type { }; }
+
+#endif // EULUNAENUM_HPP
@@ -67,6 +67,18 @@ public:
         : EulunaException("Lua error handler error", message) { }
 };
 
+class EulunaFileError : public EulunaException {
+public:
+    explicit EulunaFileError(const std::string& message = std::string())
+        : EulunaException("Lua file error", message) { }
+};
+
+class EulunaBudgetExceededError : public EulunaException {
+public:
+    explicit EulunaBudgetExceededError(const std::string& message = std::string())
+        : EulunaException("Lua execution budget exceeded", message) { }
+};
+
 class EulunaEngineError : public EulunaException {
 public:
     explicit EulunaEngineError(const std::string& message = std::string())
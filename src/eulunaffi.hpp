@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2016 Euluna <https://github.com/edubart/euluna>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef EULUNAFFI_HPP
+#define EULUNAFFI_HPP
+
+#include "eulunatools.hpp"
+#include "eulunaenum.hpp"
+
+/// Type traits used to call bound C++ functions through the LuaJIT FFI.
+/// Only functions whose parameters and result are plain arithmetic types can be
+/// called directly from JIT compiled traces, anything else goes through the lua C API.
+/// LuaJIT calls the functions directly, so their exceptions could not become lua errors,
+/// only functions declared noexcept qualify, which needs C++17 where noexcept is part of the function type.
+namespace euluna_ffi {
+
+/// C type name of an argument or a result, the value is false for unsupported types
+template<typename T, typename Enable = void>
+struct ctype : std::false_type { };
+
+template<>
+struct ctype<void> : std::true_type {
+    static std::string name() { return "void"; }
+};
+
+template<>
+struct ctype<bool> : std::true_type {
+    static std::string name() { return "bool"; }
+};
+
+template<>
+struct ctype<float> : std::true_type {
+    static std::string name() { return "float"; }
+};
+
+template<>
+struct ctype<double> : std::true_type {
+    static std::string name() { return "double"; }
+};
+
+// 64 bit integers are left out because LuaJIT returns them boxed as cdata instead of numbers
+template<typename T>
+struct ctype<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value && sizeof(T) <= 4>::type> : std::true_type {
+    static std::string name() { return euluna_tools::format("%sint%d_t", std::is_signed<T>::value ? "" : "u", (int)sizeof(T) * 8); }
+};
+
+template<typename T>
+struct ctype<T, typename std::enable_if<std::is_enum<T>::value>::type> : ctype<typename std::underlying_type<T>::type> { };
+
+/// Whether all arguments can be passed through the FFI with the same result as through the lua C API,
+/// bools are left out because the FFI converts the number 0 to false, checked enums need their validation
+template<typename... Args>
+struct all_args_supported;
+
+template<>
+struct all_args_supported<> : std::true_type { };
+
+template<typename Arg, typename... Args>
+struct all_args_supported<Arg, Args...> :
+    std::integral_constant<bool, !std::is_void<Arg>::value && !std::is_same<Arg, bool>::value && !euluna_caster::is_checked_enum<Arg>::value &&
+                                 ctype<Arg>::value && all_args_supported<Args...>::value> { };
+
+/// Join the C type names of the arguments
+template<typename... Args>
+struct join_args;
+
+template<>
+struct join_args<> {
+    static std::string call() { return ""; }
+};
+
+template<typename Arg>
+struct join_args<Arg> {
+    static std::string call() { return ctype<Arg>::name(); }
+};
+
+template<typename Arg, typename Arg2, typename... Args>
+struct join_args<Arg, Arg2, Args...> {
+    static std::string call() { return ctype<Arg>::name() + ", " + join_args<Arg2, Args...>::call(); }
+};
+
+/// Signature of a function pointer as declared to ffi.cast, e.g. "double(*)(double, int32_t)"
+template<typename F>
+struct signature : std::false_type { };
+
+#ifdef __cpp_noexcept_function_type
+template<typename Ret, typename... Args>
+struct signature<Ret(*)(Args...) noexcept> : std::integral_constant<bool, ctype<Ret>::value && all_args_supported<Args...>::value> {
+    static std::string str() { return ctype<Ret>::name() + "(*)(" + join_args<Args...>::call() + ")"; }
+};
+#endif
+
+}
+
+#endif // EULUNAFFI_HPP
@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2016 Euluna <https://github.com/edubart/euluna>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef EULUNAFUNCTIONREF_HPP
+#define EULUNAFUNCTIONREF_HPP
+
+#include "eulunaengine.hpp"
+
+// Handle to a lua function resolved once from a global or a dotted path like "a.b.c",
+// calling it does no name lookups. Refs are resolved again when the engine loads new code,
+// reloads scripts or resets to a checkpoint (a new script generation).
+// When auto resolving, the table holding the function is kept too and each use compares its field
+// with the cached function, so handlers reassigned by scripts, from C++ or from lua, are picked up.
+class EulunaFunctionRef {
+public:
+    EulunaFunctionRef() { }
+    EulunaFunctionRef(EulunaEngine *euluna, const std::string& path, bool autoResolve = false) :
+        m_euluna(euluna), m_path(path), m_autoResolve(autoResolve) {
+        assert(euluna);
+        size_t pos = 0, next;
+        do {
+            next = m_path.find('.', pos);
+            m_names.push_back(m_path.substr(pos, next == std::string::npos ? next : next - pos));
+            pos = next + 1;
+        } while(next != std::string::npos);
+        resolve();
+    }
+    ~EulunaFunctionRef() {
+        release();
+        releaseKey();
+    }
+
+    EulunaFunctionRef(const EulunaFunctionRef&) = delete;
+    EulunaFunctionRef& operator=(const EulunaFunctionRef&) = delete;
+
+    EulunaFunctionRef(EulunaFunctionRef&& other) { *this = std::move(other); }
+    EulunaFunctionRef& operator=(EulunaFunctionRef&& other) {
+        if(this != &other) {
+            release();
+            releaseKey();
+            m_euluna = other.m_euluna;
+            m_path = std::move(other.m_path);
+            m_names = std::move(other.m_names);
+            m_autoResolve = other.m_autoResolve;
+            m_ref = other.m_ref;
+            m_tableRef = other.m_tableRef;
+            m_keyRef = other.m_keyRef;
+            m_function = other.m_function;
+            m_generation = other.m_generation;
+            other.m_euluna = nullptr;
+            other.m_ref = LUA_NOREF;
+            other.m_tableRef = LUA_NOREF;
+            other.m_keyRef = LUA_NOREF;
+        }
+        return *this;
+    }
+
+    // resolves the path, returns true when it points to a function
+    bool resolve() {
+        assert(m_euluna);
+        release();
+        m_generation = m_euluna->getScriptGeneration();
+        // table holding the function
+        m_euluna->pushGlobalTable();
+        for(size_t i = 0; i + 1 < m_names.size() && !m_euluna->isNil(); ++i) {
+            if(!m_euluna->isTable() && !m_euluna->isUserdata()) {
+                m_euluna->pop();
+                m_euluna->pushNil();
+                break;
+            }
+            m_euluna->getField(m_names[i]);
+            m_euluna->remove(-2);
+        }
+        if(!m_euluna->isTable() && !m_euluna->isUserdata()) {
+            m_euluna->pop();
+            return false;
+        }
+        m_euluna->getField(m_names.back());
+        if(m_euluna->isFunction()) {
+            m_function = lua_topointer(m_euluna->luaState(), -1);
+            m_ref = m_euluna->ref();
+        } else
+            m_euluna->pop();
+        if(m_autoResolve) {
+            m_tableRef = m_euluna->ref();
+            // the key is kept as a lua string so checking the field doesn't hash it again
+            if(m_keyRef == LUA_NOREF) {
+                m_euluna->pushString(m_names.back());
+                m_keyRef = m_euluna->ref();
+            }
+        } else
+            m_euluna->pop();
+        return m_ref != LUA_NOREF;
+    }
+
+    // pushes the function, or nil when not resolved
+    void push() {
+        update();
+        if(m_ref != LUA_NOREF)
+            m_euluna->getRef(m_ref);
+        else
+            m_euluna->pushNil();
+    }
+
+    // calls the function, returns silently when the function is not defined,
+    // when R is a tuple each of its elements receives one of the function results
+    template<typename R = void, typename... T>
+    R call(const T&... args) {
+        update();
+        if(m_ref == LUA_NOREF)
+            return R();
+        m_euluna->pushErrorHandler();
+        int errorFuncIndex = m_euluna->stackSize();
+        m_euluna->getRef(m_ref);
+        return m_euluna->polymorphicHandledMultiCall<R>(errorFuncIndex, args...);
+    }
+
+    bool isValid() {
+        update();
+        return m_ref != LUA_NOREF;
+    }
+    const std::string& getPath() const { return m_path; }
+    bool isAutoResolve() const { return m_autoResolve; }
+    void setAutoResolve(bool autoResolve) {
+        m_autoResolve = autoResolve;
+        if(m_euluna)
+            resolve();
+    }
+
+private:
+    // resolves the path again when new code was loaded, and when auto resolving compares the field
+    // of the holding table with the cached function, the full path is only walked again when
+    // the holding table is missing
+    void update() {
+        if(!m_euluna)
+            return;
+        if(m_generation != m_euluna->getScriptGeneration() || (m_autoResolve && m_tableRef == LUA_NOREF)) {
+            resolve();
+            return;
+        }
+        if(!m_autoResolve)
+            return;
+        m_euluna->getRef(m_tableRef);
+        m_euluna->getRef(m_keyRef);
+        lua_gettable(m_euluna->luaState(), -2);
+        // the ref keeps the cached function alive, so its address identifies it
+        if(m_ref != LUA_NOREF && lua_topointer(m_euluna->luaState(), -1) == m_function) {
+            m_euluna->pop(2);
+            return;
+        }
+        if(m_ref != LUA_NOREF) {
+            m_euluna->unref(m_ref);
+            m_ref = LUA_NOREF;
+        }
+        if(m_euluna->isFunction()) {
+            m_function = lua_topointer(m_euluna->luaState(), -1);
+            m_ref = m_euluna->ref();
+        } else
+            m_euluna->pop();
+        m_euluna->pop();
+    }
+
+    void release() {
+        if(m_euluna && m_ref != LUA_NOREF)
+            m_euluna->unref(m_ref);
+        if(m_euluna && m_tableRef != LUA_NOREF)
+            m_euluna->unref(m_tableRef);
+        m_ref = LUA_NOREF;
+        m_tableRef = LUA_NOREF;
+    }
+
+    void releaseKey() {
+        if(m_euluna && m_keyRef != LUA_NOREF)
+            m_euluna->unref(m_keyRef);
+        m_keyRef = LUA_NOREF;
+    }
+
+    EulunaEngine *m_euluna = nullptr;
+    std::string m_path;
+    std::vector<std::string> m_names;
+    bool m_autoResolve = false;
+    int m_ref = LUA_NOREF;
+    int m_tableRef = LUA_NOREF;
+    int m_keyRef = LUA_NOREF;
+    const void *m_function = nullptr;
+    uint64_t m_generation = 0;
+};
+
+#endif // EULUNAFUNCTIONREF_HPP
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2016 Euluna <https://github.com/edubart/euluna>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef EULUNAHOOK_HPP
+#define EULUNAHOOK_HPP
+
+#include "eulunaprereqs.hpp"
+#include "eulunatools.hpp"
+#include "eulunaexception.hpp"
+
+// Shares the count debug hook of a lua state between the features using it, like the watchdog
+// and the profiler, every client is called with the instructions run since its previous call
+// once they reach its interval, the hook runs at the smallest interval of the clients
+class EulunaHookDispatcher {
+public:
+    typedef void (*Callback)(void *client, lua_State *L, uint64_t instructions);
+
+    // fails if the state has a debug hook that was not set by the dispatcher
+    static void add(lua_State *L, void *client, Callback callback, int interval) {
+        lua_Hook current = lua_gethook(L);
+        if(current && current != &EulunaHookDispatcher::hook)
+            throw EulunaEngineError("Unable to install the debug hook because the lua state already has another one");
+        EulunaHookDispatcher *dispatcher = get(L);
+        if(!dispatcher) {
+            dispatcher = new EulunaHookDispatcher(L);
+            lua_pushlightuserdata(L, dispatcher);
+            lua_rawsetp(L, LUA_REGISTRYINDEX, dispatcherKey());
+        }
+        dispatcher->m_clients.push_back(Client{client, callback, std::max(interval, 1), 0});
+        dispatcher->update(L);
+    }
+
+    // L is the thread running, it takes the new interval along the main thread
+    static void setInterval(lua_State *L, void *client, int interval) {
+        EulunaHookDispatcher *dispatcher = get(L);
+        if(!dispatcher)
+            return;
+        for(Client& c : dispatcher->m_clients) {
+            if(c.client == client)
+                c.interval = std::max(interval, 1);
+        }
+        dispatcher->update(L);
+    }
+
+    static void remove(lua_State *L, void *client) {
+        EulunaHookDispatcher *dispatcher = get(L);
+        if(!dispatcher)
+            return;
+        auto& clients = dispatcher->m_clients;
+        clients.erase(std::remove_if(clients.begin(), clients.end(), [client](const Client& c) { return c.client == client; }), clients.end());
+        if(!clients.empty()) {
+            dispatcher->update(L);
+            return;
+        }
+        lua_sethook(dispatcher->L, nullptr, 0, 0);
+        if(L != dispatcher->L)
+            lua_sethook(L, nullptr, 0, 0);
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, dispatcherKey());
+        delete dispatcher;
+    }
+
+private:
+    struct Client {
+        void *client;
+        Callback callback;
+        int interval;
+        uint64_t pending;
+    };
+
+    explicit EulunaHookDispatcher(lua_State *L) : L(L) {
+#ifdef LUAJIT_VERSION
+        // compiled traces don't run count hooks, so the JIT is off while the hook is shared
+        m_jitWasOn = isJitOn(L);
+        luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_OFF);
+        luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_FLUSH);
+#endif
+    }
+    ~EulunaHookDispatcher() {
+#ifdef LUAJIT_VERSION
+        if(m_jitWasOn)
+            luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_ON);
+#endif
+    }
+
+#ifdef LUAJIT_VERSION
+    // there is no C API to read the engine mode, the jit library tells it when it was opened
+    static bool isJitOn(lua_State *L) {
+        bool on = true;
+        lua_getglobal(L, "jit");
+        if(lua_istable(L, -1)) {
+            lua_getfield(L, -1, "status");
+            if(lua_isfunction(L, -1) && lua_pcall(L, 0, 1, 0) == 0)
+                on = lua_toboolean(L, -1);
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+        return on;
+    }
+#endif
+
+    static void* dispatcherKey() {
+        static char key;
+        return &key;
+    }
+
+    static EulunaHookDispatcher* get(lua_State *L) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, dispatcherKey());
+        EulunaHookDispatcher *dispatcher = static_cast<EulunaHookDispatcher*>(lua_touserdata(L, -1));
+        lua_pop(L, 1);
+        return dispatcher;
+    }
+
+    void update(lua_State *thread) {
+        int interval = std::numeric_limits<int>::max();
+        for(const Client& c : m_clients)
+            interval = std::min(interval, c.interval);
+        lua_sethook(L, &EulunaHookDispatcher::hook, LUA_MASKCOUNT, interval);
+        if(thread != L)
+            lua_sethook(thread, &EulunaHookDispatcher::hook, LUA_MASKCOUNT, interval);
+    }
+
+    static void hook(lua_State *L, lua_Debug *ar) {
+        EulunaHookDispatcher *dispatcher = get(L);
+        if(!dispatcher)
+            return;
+        int count = lua_gethookcount(L);
+        auto& clients = dispatcher->m_clients;
+        for(Client& c : clients)
+            c.pending += count;
+        // callbacks may raise lua errors, the clients not reached yet keep their instructions for the next hook
+        for(size_t i = 0; i < clients.size(); ++i) {
+            Client& c = clients[i];
+            if(c.pending < (uint64_t)c.interval)
+                continue;
+            uint64_t instructions = c.pending;
+            c.pending = 0;
+            c.callback(c.client, L, instructions);
+        }
+    }
+
+    lua_State *L;
+    std::vector<Client> m_clients;
+#ifdef LUAJIT_VERSION
+    bool m_jitWasOn = true;
+#endif
+};
+
+#endif // EULUNAHOOK_HPP
@@ -24,8 +24,13 @@
 #define EULUNAINTERFACE_HPP
 
 #include "eulunatools.hpp"
+#include "eulunatrace.hpp"
 #include "eulunaexception.hpp"
 #include "eulunacompat.hpp"
+#include "eulunaallocator.hpp"
+#include "eulunawatchdog.hpp"
+#include "eulunacallqueue.hpp"
+#include "eulunabindingstats.hpp"
 
 // Interface for managing lua state
 class EulunaInterface {
@@ -41,26 +46,43 @@ public:
             throw EulunaRuntimeError("Invalid lua state");
     }
 
+    // creates a new lua state using the given allocator function
+    EulunaInterface(lua_Alloc allocator, void *ud) : L(lua_newstate(allocator, ud)), m_ownState(true) {
+        if(!L)
+            throw EulunaRuntimeError("Unable to create new lua state");
+        lua_atpanic(L, [](lua_State *L) -> int {
+            fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+            return 0;
+        });
+        openLibs();
+    }
+
     ~EulunaInterface() {
-        if(m_ownState)
+        closeState();
+    }
+
+    // closes the lua state if owned, needed when the state must be closed before members of a derived class are destroyed
+    void closeState() {
+        if(m_ownState && L)
             lua_close(L);
+        m_ownState = false;
     }
 
     // load and call with exception
     int safeCall(int numArgs = 0, int numRets = 0) {
-        // saves the current stack size for calculating the number of results later
-        int savedStackSize = stackSize() - numArgs - 1;
-        // pushes error function
-        int errorFuncIndex = savedStackSize + 1;
-        pushCFunction([](lua_State* L) -> int {
-            EulunaInterface lua(L);
-            // pops the error message
-            std::string error = lua.popString();
-            // push error with traceback information
-            lua.traceback(error, 1);
-            return 1;
-        });
+        // pushes error function below the function and its arguments
+        pushErrorHandler();
+        int errorFuncIndex = stackSize() - numArgs - 1;
         insert(errorFuncIndex);
+        return safeCall(numArgs, numRets, errorFuncIndex);
+    }
+
+    // calls with the handler of pushErrorHandler already at errorFuncIndex, right below the function,
+    // callers pushing it before the function save moving the function and its arguments
+    int safeCall(int numArgs, int numRets, int errorFuncIndex) {
+        EULUNA_TRACE_SCOPE("safeCall", "lua");
+        // saves the current stack size for calculating the number of results later
+        int savedStackSize = errorFuncIndex - 1;
         // call the function
         int err = pcall(numArgs, numRets, errorFuncIndex);
         //  remove error func
@@ -78,6 +100,34 @@ public:
         return rets;
     }
 
+    // pushes the message handler used by safeCall, it's created once per state
+    // and kept in a registry ref, so protected calls don't create closures,
+    // the ref is only trusted while it still holds the handler function, the slot may have been released and reused
+    void pushErrorHandler() {
+        if(m_errorHandlerRef != LUA_NOREF) {
+            getRef(m_errorHandlerRef);
+            if(lua_tocfunction(L, -1) == &EulunaInterface::errorHandler)
+                return;
+            pop();
+        }
+        // find the handler ref for this state
+        lua_rawgetp(L, LUA_REGISTRYINDEX, errorHandlerKey());
+        m_errorHandlerRef = isNumber() ? toInteger() : LUA_NOREF;
+        pop();
+        if(m_errorHandlerRef != LUA_NOREF) {
+            getRef(m_errorHandlerRef);
+            if(lua_tocfunction(L, -1) == &EulunaInterface::errorHandler)
+                return;
+            pop();
+        }
+        // create the handler
+        pushCFunction(&EulunaInterface::errorHandler);
+        pushValue();
+        m_errorHandlerRef = ref();
+        pushInteger(m_errorHandlerRef);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, errorHandlerKey());
+    }
+
     void safeLoadBuffer(const std::string& buffer, const std::string& source = "") {
         // parse lua code
         int err = loadBuffer(buffer, source);
@@ -85,6 +135,21 @@ public:
         handleLuaError(err);
     }
 
+    void safeLoadChunk(const char* data, size_t size, const std::string& source) {
+        // parse lua code or bytecode
+        int err = loadChunk(data, size, source);
+        // throw if any error
+        handleLuaError(err);
+    }
+
+    void safeLoadFile(const std::string& fileName) {
+        // map the file in memory instead of reading it into a buffer
+        euluna_tools::mapped_file file(fileName);
+        if(!file.isOpen())
+            throw EulunaFileError(euluna_tools::format("cannot open '%s'", fileName));
+        safeLoadChunk(file.data(), file.size(), "@" + fileName);
+    }
+
     int safeDoBuffer(const std::string& buffer, const std::string& source = "", int numRets = 0) {
         // parse lua code
         safeLoadBuffer(buffer, source);
@@ -94,8 +159,13 @@ public:
 
     // state manipulation
     lua_State* newThread() { return lua_newthread(L); }
+    bool isMainThread() {
+        bool ret = lua_pushthread(L) == 1;
+        pop();
+        return ret;
+    }
     lua_State *luaState() { return L; }
-    void setLuaState(lua_State *state) { L = state; m_ownState = false; }
+    void setLuaState(lua_State *state) { L = state; m_ownState = false; m_errorHandlerRef = LUA_NOREF; }
 
     // basic stack manipulation
     int getTop() const { return lua_gettop(L); }
@@ -169,68 +239,21 @@ public:
     void pushString(const std::string& v) { lua_pushlstring(L, v.c_str(), v.length()); }
     void pushLightUserdata(void* p) { lua_pushlightuserdata(L, p); }
     void pushThread() { lua_pushthread(L); }
+    void pushGlobalTable() { lua_pushglobaltable(L); }
     void pushCFunction(LuaCFunction func, int n = 0) { lua_pushcclosure(L, func, n); }
     void pushCppFunction(EulunaCppFunction* func, const std::string& name = std::string()) {
         assert(func);
         // create a pointer to func (this pointer DOESN'T hold the function existence)
         pushLightUserdata(func);
-        pushString(name);
-        // actually pushes a C function callback that will call the cpp function
-        pushCFunction([](lua_State* L) -> int {
-            EulunaInterface lua(L);
-            // retrieves function pointer from userdata
-            auto funcPtr = static_cast<EulunaCppFunction*>(lua.toUserdata(lua.upvalueIndex(1)));
-            const char* funcName = lua.toCString(lua.upvalueIndex(2));
-            assert(funcPtr);
-            int numRets;
-            // do the call
-            try {
-                numRets = (*funcPtr)(&lua);
-                assert(numRets == lua.stackSize());
-            } catch(std::exception& e) {
-                numRets = 0;
-                lua.clearStack();
-                lua.traceback(euluna_tools::format("C++ exception %s: in call of '%s': %s", euluna_tools::demangle_type(e), funcName, e.what()));
-                lua.error();
-            }
-            return numRets;
-        }, 2);
+        pushCppFunctionTrampoline<BorrowedFunctionCaller>(name);
     }
-    void pushCppFunction(EulunaCppFunction func, const std::string& name = std::string()) {
-        // create a pointer to func (this pointer holds the function existence)
-        new(newUserdata(sizeof(EulunaCppFunctionPtr))) EulunaCppFunctionPtr(new EulunaCppFunction(std::move(func)));
-        // sets the userdata __gc metamethod, needed to free the function pointer when it gets collected
-        newTable();
-        pushCFunction([](lua_State* L) -> int {
-            EulunaInterface lua(L);
-            auto funcPtr = static_cast<EulunaCppFunctionPtr*>(lua.popUserdata());
-            assert(funcPtr);
-            funcPtr->reset();
-            return 0;
-        });
-        setField("__gc");
-        setMetatable();
-        pushString(name);
-        // actually pushes a C function callback that will call the cpp function
-        pushCFunction([](lua_State* L) -> int {
-            EulunaInterface lua(L);
-            // retrieves function pointer from userdata
-            auto funcPtr = static_cast<EulunaCppFunctionPtr*>(lua.toUserdata(lua.upvalueIndex(1)));
-            const char* funcName = lua.toCString(lua.upvalueIndex(2));
-            assert(funcPtr);
-            int numRets;
-            // do the call
-            try {
-                numRets = (*(funcPtr->get()))(&lua);
-                assert(numRets == lua.stackSize());
-            } catch(std::exception& e) {
-                numRets = 0;
-                lua.clearStack();
-                lua.traceback(euluna_tools::format("C++ exception %s: in call of '%s': %s", euluna_tools::demangle_type(e), funcName, e.what()));
-                lua.error();
-            }
-            return numRets;
-        }, 2);
+    // the callable is moved into the userdata of the closure (the userdata holds the function existence),
+    // so lambdas are pushed without any C++ heap allocation
+    template<typename F>
+    typename std::enable_if<euluna_traits::is_callable_with<typename std::decay<F>::type, int, EulunaInterface*>::value>::type
+    pushCppFunction(F&& func, const std::string& name = std::string()) {
+        typedef typename std::decay<F>::type Function;
+        pushInlineFunction<Function>(std::forward<F>(func), name);
     }
 
     // get functions
@@ -273,13 +296,59 @@ public:
     void setRegistryField(const std::string& key) { lua_setfield(L, LUA_REGISTRYINDEX, key.c_str()); }
 
     // load and call
-    int pcall(int numArgs = 0, int numRets = 0, int errorFuncIndex = 0) { return lua_pcall(L, numArgs, numRets, errorFuncIndex); }
+    int pcall(int numArgs = 0, int numRets = 0, int errorFuncIndex = 0) {
+        EulunaAllocator::ProtectedScope scope(L);
+        return lua_pcall(L, numArgs, numRets, errorFuncIndex);
+    }
     void call(int numArgs = 0, int numRets = 0) { lua_call(L, numArgs, numRets); }
-    int loadBuffer(const std::string& buffer, const std::string& source = "") { return luaL_loadbuffer(L, buffer.c_str(), buffer.length(), source.c_str()); }
+    int yield(int numRets = 0) { return lua_yield(L, numRets); }
+    int resume(lua_State *thread, int numArgs = 0) {
+        EulunaAllocator::ProtectedScope scope(L);
+        // the debug hook belongs to each lua thread, resumed coroutines take the current one of this state,
+        // so budgets and samplers installed after the coroutine was created also apply to it
+        lua_sethook(thread, lua_gethook(L), lua_gethookmask(L), lua_gethookcount(L));
+#if LUA_VERSION_NUM >= 504
+        int numRets;
+        return lua_resume(thread, L, numArgs, &numRets);
+#elif LUA_VERSION_NUM >= 502
+        return lua_resume(thread, L, numArgs);
+#else
+        return lua_resume(thread, numArgs);
+#endif
+    }
+    int loadBuffer(const std::string& buffer, const std::string& source = "") {
+        EulunaAllocator::ProtectedScope scope(L);
+        return luaL_loadbuffer(L, buffer.c_str(), buffer.length(), source.c_str());
+    }
+    int loadChunk(const char* data, size_t size, const std::string& source) {
+        // reader that feeds the whole memory block to lua at once
+        struct ChunkReader { const char *data; size_t size; } reader = { data, size };
+        auto readFunc = [](lua_State*, void *ud, size_t *size) -> const char* {
+            ChunkReader *reader = static_cast<ChunkReader*>(ud);
+            *size = reader->size;
+            reader->size = 0;
+            return *size > 0 ? reader->data : nullptr;
+        };
+        EulunaAllocator::ProtectedScope scope(L);
+#if LUA_VERSION_NUM >= 502
+        return lua_load(L, readFunc, &reader, source.c_str(), nullptr);
+#else
+        return lua_load(L, readFunc, &reader, source.c_str());
+#endif
+    }
+    bool dump(std::string& bytecode, bool strip = false) {
+        // dumps the lua function at the top of the stack
+        bytecode.clear();
+        auto writeFunc = [](lua_State*, const void *p, size_t size, void *ud) -> int {
+            static_cast<std::string*>(ud)->append(static_cast<const char*>(p), size);
+            return 0;
+        };
+        return isLuaFunction() && lua_dump(L, writeFunc, &bytecode, strip) == 0;
+    }
     int doBuffer(const std::string& buffer, const std::string& source = "") {
-        int err = luaL_loadbuffer(L, buffer.c_str(), buffer.length(), source.c_str());
+        int err = loadBuffer(buffer, source);
         if(err == 0)
-            err = lua_pcall(L, 0, LUA_MULTRET, 0);
+            err = pcall(0, LUA_MULTRET, 0);
         return err;
     }
 
@@ -296,7 +365,10 @@ public:
     const char* typeName(int type) { return lua_typename(L, type); }
     void traceback(const char* msg, int level = 0) { luaL_traceback(L, L, msg, level); }
     void traceback(const std::string& msg, int level = 0) { luaL_traceback(L, L, msg.c_str(), level); }
-    void collect() { gc(LUA_GCCOLLECT, 0); }
+    void collect() {
+        EULUNA_TRACE_SCOPE("collect", "gc");
+        gc(LUA_GCCOLLECT, 0);
+    }
     void newGlobalTable(const std::string& name) {
         getGlobal(name);
         if(isNil()) {
@@ -376,8 +448,9 @@ public:
         remove(-2);
     }
     int weakRef() {
-        static int id = 0;
-        ++id;
+        // shared by every lua state, states may live in different threads
+        static std::atomic<int> nextId(0);
+        int id = ++nextId;
         assert(id < 2147483647);
         getWeakTable();
         insert(-2);
@@ -409,6 +482,13 @@ public:
 
             // set object metatable
             getRegistryField(euluna_tools::demangle_type(obj) + "_mt");
+            if(!isTable()) {
+                // with lazy bindings the class is registered when its global is first accessed
+                pop();
+                getGlobal(euluna_tools::demangle_type(obj));
+                pop();
+                getRegistryField(euluna_tools::demangle_type(obj) + "_mt");
+            }
             if(!isTable())
                 throw EulunaEngineError(euluna_tools::format("Unable to push object of type '%s' because its metatable was not found, did you bind it?",
                                         euluna_tools::demangle_type(obj)));
@@ -494,13 +574,47 @@ public:
     template<class T>
     bool polymorphicPull(T& v, int index = -1);
 
+    // calls the function at the top, the handler is inserted before pushing the arguments so only the function moves
     template<typename R, typename... T>
     R polymorphicSafeCall(const T&... args) {
+        pushErrorHandler();
+        insert(-2);
+        return polymorphicHandledCall<R>(stackSize() - 1, args...);
+    }
+
+    template<typename R, typename... T>
+    R polymorphicSafeMultiCall(const T&... args) {
+        pushErrorHandler();
+        insert(-2);
+        return polymorphicHandledMultiCall<R>(stackSize() - 1, args...);
+    }
+
+    // calls the function at the top with the handler of pushErrorHandler right below it at errorFuncIndex
+    template<typename R, typename... T>
+    R polymorphicHandledCall(int errorFuncIndex, const T&... args) {
         int numArgs = polymorphicPush(args...);
-        safeCall(numArgs, 1);
+        safeCall(numArgs, 1, errorFuncIndex);
         return polymorphicPop<R>();
     }
 
+    // requests one result for each tuple element when R is a tuple
+    template<typename R, typename... T>
+    typename std::enable_if<euluna_traits::is_tuple<R>::value, R>::type polymorphicHandledMultiCall(int errorFuncIndex, const T&... args) {
+        enum { N = std::tuple_size<R>::value };
+        int numArgs = polymorphicPush(args...);
+        safeCall(numArgs, N, errorFuncIndex);
+        return polymorphicPopResults<R>();
+    }
+
+    template<typename R, typename... T>
+    typename std::enable_if<!euluna_traits::is_tuple<R>::value, R>::type polymorphicHandledMultiCall(int errorFuncIndex, const T&... args) {
+        return polymorphicHandledCall<R>(errorFuncIndex, args...);
+    }
+
+    // pops the results at the top of the stack into a tuple
+    template<typename R>
+    R polymorphicPopResults();
+
     template<typename R>
     R polymorphicSafeDoBuffer(const std::string& buffer, const std::string& source = "") {
         // parse lua code
@@ -509,10 +623,145 @@ public:
     }
 
 protected:
+    // header of callables stored in userdata, aligned like lua userdata
+    union InlineFunctionHeader {
+        void (*destroy)(InlineFunctionHeader*);
+        double alignDouble;
+        long alignLong;
+    };
+
+    // callers used by the trampoline to call the function in upvalue 1
+    struct BorrowedFunctionCaller {
+        static int call(EulunaInterface* lua) {
+            auto funcPtr = static_cast<EulunaCppFunction*>(lua->toUserdata(lua->upvalueIndex(1)));
+            assert(funcPtr);
+            return (*funcPtr)(lua);
+        }
+    };
+    template<typename Function>
+    struct InlineFunctionCaller {
+        static int call(EulunaInterface* lua) {
+            auto header = static_cast<InlineFunctionHeader*>(lua->toUserdata(lua->upvalueIndex(1)));
+            assert(header);
+            return (*inlineFunction<Function>(header))(lua);
+        }
+    };
+
+    // the callable follows the header, over aligned callables are placed at the next aligned address
+    // of the padding allocated after it
+    template<typename Function>
+    static Function* inlineFunction(InlineFunctionHeader* header) {
+        if(alignof(Function) <= alignof(InlineFunctionHeader))
+            return reinterpret_cast<Function*>(header + 1);
+        uintptr_t address = reinterpret_cast<uintptr_t>(header + 1);
+        address = (address + alignof(Function) - 1) & ~(uintptr_t)(alignof(Function) - 1);
+        return reinterpret_cast<Function*>(address);
+    }
+
+    template<typename Function, typename F>
+    void pushInlineFunction(F&& func, const std::string& name) {
+        size_t padding = alignof(Function) > alignof(InlineFunctionHeader) ? alignof(Function) - 1 : 0;
+        auto header = static_cast<InlineFunctionHeader*>(newUserdata(sizeof(InlineFunctionHeader) + sizeof(Function) + padding));
+        new(inlineFunction<Function>(header)) Function(std::forward<F>(func));
+        // only callables with a destructor need the __gc metamethod
+        if(!std::is_trivially_destructible<Function>::value) {
+            header->destroy = [](InlineFunctionHeader* header) { inlineFunction<Function>(header)->~Function(); };
+            pushInlineFunctionMetatable();
+            setMetatable();
+        }
+        pushCppFunctionTrampoline<InlineFunctionCaller<Function>>(name);
+    }
+
+    // metatable shared by the userdata of every inline function in the state
+    void pushInlineFunctionMetatable() {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, inlineFunctionMetatableKey());
+        if(!isNil())
+            return;
+        pop();
+        newTable();
+        pushCFunction([](lua_State* L) -> int {
+            auto header = static_cast<InlineFunctionHeader*>(lua_touserdata(L, 1));
+            assert(header);
+            header->destroy(header);
+            return 0;
+        });
+        setField("__gc");
+        pushValue();
+        lua_rawsetp(L, LUA_REGISTRYINDEX, inlineFunctionMetatableKey());
+    }
+
+    static void* inlineFunctionMetatableKey() {
+        static char key;
+        return &key;
+    }
+
+    // pushes the C function calling the cpp function at the top of the stack, when the state has
+    // binding stats enabled the trampoline also measures the calls
+    template<typename Caller>
+    void pushCppFunctionTrampoline(const std::string& name) {
+        pushString(name);
+        if(EulunaBindingStats *stats = EulunaBindingStats::get(L)) {
+            pushLightUserdata(stats->getBinding(name));
+            pushCFunction([](lua_State* L) -> int {
+                auto binding = static_cast<EulunaBindingStats::Binding*>(lua_touserdata(L, lua_upvalueindex(3)));
+                binding->calls++;
+                if(--binding->untilSample != 0)
+                    return callCppFunction<Caller>(L);
+                binding->untilSample = binding->sampleInterval;
+                uint64_t start = euluna_tools::cpu_cycles();
+                int numRets = callCppFunction<Caller>(L);
+                binding->cycles.record(euluna_tools::cpu_cycles() - start);
+                return numRets;
+            }, 3);
+        } else
+            pushCFunction(&callCppFunction<Caller>, 2);
+    }
+
+    // trampoline of cpp functions, upvalue 1 is the function and upvalue 2 its name
+    template<typename Caller>
+    static int callCppFunction(lua_State* L) {
+        EulunaInterface lua(L);
+        const char* funcName = lua.toCString(lua.upvalueIndex(2));
+        int numRets;
+        // do the call
+        try {
+            EULUNA_TRACE_BEGIN(traceStart);
+            numRets = Caller::call(&lua);
+            EULUNA_TRACE_END(traceStart, funcName, "binding");
+            assert(numRets == lua.stackSize() || numRets == EULUNA_YIELD);
+        } catch(std::exception& e) {
+            numRets = 0;
+            lua.clearStack();
+            lua.traceback(euluna_tools::format("C++ exception %s: in call of '%s': %s", euluna_tools::demangle_type(e), funcName, e.what()));
+            lua.error();
+        }
+        // the function is waiting for an async result
+        if(numRets == EULUNA_YIELD)
+            return lua.yield(0);
+        return numRets;
+    }
+
+    static int errorHandler(lua_State* L) {
+        EulunaInterface lua(L);
+        // pops the error message
+        std::string error = lua.popString();
+        // push error with traceback information
+        lua.traceback(error, 1);
+        return 1;
+    }
+
+    static void* errorHandlerKey() {
+        static char key;
+        return &key;
+    }
+
     void handleLuaError(int err) {
         if(err == LUA_OK)
             return;
         std::string msg = popString();
+        // errors of calls whose watchdog budget ran out
+        if((err == LUA_ERRRUN || err == LUA_ERRERR) && EulunaWatchdog::isTripped(L))
+            throw EulunaBudgetExceededError(msg);
         switch(err) {
         case LUA_ERRSYNTAX:
             throw EulunaSyntaxError(msg);
@@ -523,6 +772,9 @@ protected:
         case LUA_ERRERR:
             throw EulunaErrorError(msg);
             break;
+        case LUA_ERRFILE:
+            throw EulunaFileError(msg);
+            break;
         case LUA_ERRRUN:
         default:
             throw EulunaRuntimeError(msg);
@@ -532,8 +784,12 @@ protected:
 
     lua_State *L;
     bool m_ownState;
+    int m_errorHandlerRef = LUA_NOREF;
 };
 
+inline EulunaWatchdog::EulunaWatchdog(EulunaInterface *lua, std::chrono::microseconds timeLimit, uint64_t instructionLimit, int hookInterval) :
+    EulunaWatchdog(lua->luaState(), timeLimit, instructionLimit, hookInterval) { }
+
 #include "eulunacaster.hpp"
 
 template<typename T, typename... Args>
@@ -547,4 +803,57 @@ bool EulunaInterface::polymorphicPull(T& v, int index) {
     return euluna_caster::pull(this, index, v);
 }
 
+namespace euluna_binder {
+
+/// Pull results from lua stack into a tuple recursively, returns the index of the first bad result
+template<int N>
+struct pull_results_into_tuple {
+    template<typename Tuple>
+    static int call(Tuple& tuple, EulunaInterface* lua) {
+        enum { Size = std::tuple_size<Tuple>::value };
+        if(!lua->polymorphicPull(std::get<N-1>(tuple), N - 1 - Size))
+            return N;
+        return pull_results_into_tuple<N-1>::call(tuple, lua);
+    }
+};
+template<>
+struct pull_results_into_tuple<0> {
+    template<typename Tuple>
+    static int call(Tuple&, EulunaInterface*) { return 0; }
+};
+
+/// Name of a tuple element type
+template<int N>
+struct tuple_element_name {
+    template<typename Tuple>
+    static std::string call(int index) {
+        if(index == N)
+            return euluna_tools::demangle_type<typename std::tuple_element<N-1, Tuple>::type>();
+        return tuple_element_name<N-1>::template call<Tuple>(index);
+    }
+};
+template<>
+struct tuple_element_name<0> {
+    template<typename Tuple>
+    static std::string call(int) { return std::string(); }
+};
+
+}
+
+template<typename R>
+R EulunaInterface::polymorphicPopResults() {
+    enum { N = std::tuple_size<R>::value };
+    R ret;
+    int bad = euluna_binder::pull_results_into_tuple<N>::call(ret, this);
+    if(bad != 0) {
+        std::string typeName = toTypeName(bad - 1 - N);
+        pop(N);
+        traceback(euluna_tools::format("bad return #%d (%s expected, got %s)", bad,
+                                       euluna_binder::tuple_element_name<N>::template call<R>(bad), typeName));
+        handleLuaError(LUA_ERRRUN);
+    }
+    pop(N);
+    return ret;
+}
+
 #endif // EULUNAINTERFACE_HPP
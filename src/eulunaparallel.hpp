@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2016 Euluna <https://github.com/edubart/euluna>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef EULUNAPARALLEL_HPP
+#define EULUNAPARALLEL_HPP
+
+#include "eulunabinder.hpp"
+#include "eulunathreadpool.hpp"
+
+// Array of doubles owned by lua, kernels read and write it from other threads without touching the lua state
+class EulunaNumericBuffer {
+public:
+    explicit EulunaNumericBuffer(size_t size = 0, double value = 0) : m_values(size, value) { }
+    explicit EulunaNumericBuffer(std::vector<double> values) : m_values(std::move(values)) { }
+
+    static EulunaNumericBuffer* create(int size, double value) {
+        if(size < 0)
+            throw EulunaEngineError(euluna_tools::format("Invalid numeric buffer size %d", size));
+        return new EulunaNumericBuffer(size, value);
+    }
+    static EulunaNumericBuffer* fromTable(const std::vector<double>& values) { return new EulunaNumericBuffer(values); }
+
+    // indexes start at 1 like lua arrays
+    double get(int index) const { return m_values[checkIndex(index)]; }
+    void set(int index, double value) { m_values[checkIndex(index)] = value; }
+    void fill(double value) { std::fill(m_values.begin(), m_values.end(), value); }
+    int size() const { return m_values.size(); }
+    std::vector<double> toTable() const { return m_values; }
+
+    double *data() { return m_values.data(); }
+    const double *data() const { return m_values.data(); }
+    std::vector<double>& values() { return m_values; }
+
+private:
+    size_t checkIndex(int index) const {
+        if(index < 1 || (size_t)index > m_values.size())
+            throw EulunaEngineError(euluna_tools::format("Index %d out of the numeric buffer range [1, %d]", index, (int)m_values.size()));
+        return index - 1;
+    }
+
+    std::vector<double> m_values;
+};
+
+// Range of a kernel call, inputs and output have the same size and the range indexes start at 0
+struct EulunaKernelArgs {
+    double *output;
+    std::vector<const double*> inputs;
+    std::vector<double> params;
+    size_t begin;
+    size_t end;
+};
+
+// Runs named C++ kernels over numeric buffers on a pool of threads, from lua with
+// parallel.run(name, output, inputs..., params...), the calling thread works too and waits for the result.
+// Kernels run concurrently on disjoint ranges, so they must only write the output in their range
+class EulunaParallel {
+public:
+    typedef std::function<void(const EulunaKernelArgs&)> Kernel;
+
+    enum { DEFAULT_GRAIN_SIZE = 4096 };
+
+    explicit EulunaParallel(size_t numThreads = std::thread::hardware_concurrency()) {
+        setNumThreads(numThreads);
+        registerKernel("add", [](const EulunaKernelArgs& args) {
+            for(size_t i = args.begin; i < args.end; ++i)
+                args.output[i] = args.inputs.at(0)[i] + args.inputs.at(1)[i];
+        });
+        registerKernel("mul", [](const EulunaKernelArgs& args) {
+            for(size_t i = args.begin; i < args.end; ++i)
+                args.output[i] = args.inputs.at(0)[i] * args.inputs.at(1)[i];
+        });
+        // output = a * x + y
+        registerKernel("axpy", [](const EulunaKernelArgs& args) {
+            double a = args.params.at(0);
+            for(size_t i = args.begin; i < args.end; ++i)
+                args.output[i] = a * args.inputs.at(0)[i] + args.inputs.at(1)[i];
+        });
+    }
+
+    EulunaParallel(const EulunaParallel&) = delete;
+    EulunaParallel& operator=(const EulunaParallel&) = delete;
+
+    static EulunaParallel& instance() {
+        static EulunaParallel instance;
+        return instance;
+    }
+
+    // threads running the kernels including the calling one, must not be changed while kernels run
+    void setNumThreads(size_t numThreads) {
+        m_numThreads = std::max<size_t>(numThreads, 1);
+        m_pool.reset(m_numThreads > 1 ? new EulunaThreadPool(m_numThreads - 1) : nullptr);
+    }
+    size_t getNumThreads() const { return m_numThreads; }
+
+    // minimum number of elements given to a thread at once
+    void setGrainSize(size_t grainSize) { m_grainSize = std::max<size_t>(grainSize, 1); }
+
+    void registerKernel(const std::string& name, Kernel kernel) {
+        std::lock_guard<std::mutex> lock(m_kernelsMutex);
+        m_kernels[name] = std::make_shared<Kernel>(std::move(kernel));
+    }
+    bool hasKernel(const std::string& name) const {
+        std::lock_guard<std::mutex> lock(m_kernelsMutex);
+        return m_kernels.find(name) != m_kernels.end();
+    }
+
+    // throws EulunaEngineError for unknown kernels, mismatched sizes and kernels that failed
+    void run(const std::string& name, EulunaNumericBuffer *output, const std::vector<const EulunaNumericBuffer*>& inputs, const std::vector<double>& params) {
+        std::shared_ptr<Kernel> kernel;
+        {
+            std::lock_guard<std::mutex> lock(m_kernelsMutex);
+            auto it = m_kernels.find(name);
+            if(it == m_kernels.end())
+                throw EulunaEngineError(euluna_tools::format("Kernel '%s' is not registered", name));
+            kernel = it->second;
+        }
+        auto job = std::make_shared<Job>();
+        job->kernel = kernel;
+        job->args.output = output->data();
+        job->args.params = params;
+        size_t size = output->size();
+        for(const EulunaNumericBuffer *input : inputs) {
+            if((size_t)input->size() != size)
+                throw EulunaEngineError(euluna_tools::format("Input buffer of size %d differs from the output buffer of size %d", input->size(), (int)size));
+            job->args.inputs.push_back(input->data());
+        }
+        job->size = size;
+        job->chunkSize = std::max(m_grainSize, (size + m_numThreads * 4 - 1) / (m_numThreads * 4));
+        job->numChunks = (size + job->chunkSize - 1) / job->chunkSize;
+
+        // the workers help while there are chunks left, the calling thread takes chunks too
+        size_t helpers = m_pool ? std::min(m_pool->size(), job->numChunks > 0 ? job->numChunks - 1 : 0) : 0;
+        job->pending = helpers;
+        for(size_t i = 0; i < helpers; ++i) {
+            m_pool->post([job] {
+                work(*job);
+                std::lock_guard<std::mutex> lock(job->mutex);
+                if(--job->pending == 0)
+                    job->finished.notify_all();
+            });
+        }
+        work(*job);
+        std::unique_lock<std::mutex> lock(job->mutex);
+        job->finished.wait(lock, [&] { return job->pending == 0; });
+        if(!job->error.empty())
+            throw EulunaEngineError(euluna_tools::format("Kernel '%s' failed: %s", name, job->error));
+    }
+
+    // lua parallel.run(name, output, inputs..., params...)
+    int luaRun(EulunaInterface *lua) {
+        // checked before reading, reading a number as a string converts it in place
+        if(lua->type(1) != LUA_TSTRING)
+            throw EulunaEngineError(euluna_tools::format("bad argument #1 to 'run' (string expected, got %s)", lua->toTypeName(1)));
+        std::string name = lua->toString(1);
+        EulunaNumericBuffer *output = toBuffer(lua, 2);
+        std::vector<const EulunaNumericBuffer*> inputs;
+        std::vector<double> params;
+        int top = lua->stackSize();
+        for(int i = 3; i <= top; ++i) {
+            if(lua->type(i) == LUA_TNUMBER)
+                params.push_back(lua->toNumber(i));
+            else if(params.empty())
+                inputs.push_back(toBuffer(lua, i));
+            else
+                throw EulunaEngineError(euluna_tools::format("bad argument #%d to 'run' (number expected, got %s)", i, lua->toTypeName(i)));
+        }
+        lua->clearStack();
+        run(name, output, inputs, params);
+        return 0;
+    }
+
+    // binds the parallel singleton and the EulunaNumericBuffer class
+    void addBindings(EulunaBinder& binder) {
+        binder.singletonClass("parallel", this)
+            .def("run", &EulunaParallel::luaRun)
+            .def("hasKernel", &EulunaParallel::hasKernel)
+            .def("getNumThreads", &EulunaParallel::getNumThreads);
+        binder.managedClass("EulunaNumericBuffer")
+            .defStatic("create", &EulunaNumericBuffer::create)
+            .defStatic("fromTable", &EulunaNumericBuffer::fromTable)
+            .def("get", &EulunaNumericBuffer::get)
+            .def("set", &EulunaNumericBuffer::set)
+            .def("fill", &EulunaNumericBuffer::fill)
+            .def("size", &EulunaNumericBuffer::size)
+            .def("toTable", &EulunaNumericBuffer::toTable)
+            .releaseHandler<EulunaNumericBuffer>([](EulunaInterface* lua, EulunaNumericBuffer* buffer) { lua->releaseObject(buffer); delete buffer; });
+    }
+
+private:
+    struct Job {
+        std::shared_ptr<Kernel> kernel;
+        EulunaKernelArgs args;
+        size_t size;
+        size_t chunkSize;
+        size_t numChunks;
+        std::atomic<size_t> nextChunk{0};
+        size_t pending;
+        std::string error;
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+
+    static void work(Job& job) {
+        size_t chunk;
+        while((chunk = job.nextChunk++) < job.numChunks) {
+            EulunaKernelArgs args = job.args;
+            args.begin = chunk * job.chunkSize;
+            args.end = std::min(args.begin + job.chunkSize, job.size);
+            try {
+                (*job.kernel)(args);
+            } catch(std::exception& e) {
+                std::lock_guard<std::mutex> lock(job.mutex);
+                if(job.error.empty())
+                    job.error = e.what();
+            }
+        }
+    }
+
+    // only userdata of the EulunaNumericBuffer class are accepted, other objects can't be cast safely
+    static EulunaNumericBuffer *toBuffer(EulunaInterface *lua, int index) {
+        EulunaNumericBuffer *buffer = nullptr;
+        if(lua->isUserdata(index) && lua_getmetatable(lua->luaState(), index)) {
+            lua->getRegistryField("EulunaNumericBuffer_mt");
+            if(lua_rawequal(lua->luaState(), -1, -2))
+                buffer = lua->toObject<EulunaNumericBuffer>(index);
+            lua->pop(2);
+        }
+        if(!buffer)
+            throw EulunaEngineError(euluna_tools::format("bad argument #%d to 'run' (EulunaNumericBuffer expected, got %s)", index, lua->toTypeName(index)));
+        return buffer;
+    }
+
+    std::unique_ptr<EulunaThreadPool> m_pool;
+    size_t m_numThreads = 1;
+    size_t m_grainSize = DEFAULT_GRAIN_SIZE;
+    std::unordered_map<std::string, std::shared_ptr<Kernel>> m_kernels;
+    mutable std::mutex m_kernelsMutex;
+};
+
+#endif // EULUNAPARALLEL_HPP
@@ -24,7 +24,10 @@
 #define EULUNA_PREREQS
 
 #include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <cmath>
 #include <cassert>
 
 #include <string>
@@ -40,16 +43,28 @@
 #include <exception>
 #include <memory>
 #include <tuple>
+#include <algorithm>
 #include <type_traits>
+#include <future>
+#include <chrono>
+#include <limits>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
 #include <cxxabi.h>
 #include <lua.hpp>
 
 class EulunaInterface;
 class EulunaEngine;
+class EulunaAwaitable;
 
 typedef int (*LuaCFunction) (lua_State *L);
 typedef std::function<int(EulunaInterface*)> EulunaCppFunction;
 typedef std::unique_ptr<EulunaCppFunction> EulunaCppFunctionPtr;
 
+// returned by bound functions instead of the number of results to yield the running coroutine
+const int EULUNA_YIELD = -1;
+
 #endif // EULUNA_PREREQS
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2016 Euluna <https://github.com/edubart/euluna>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef EULUNAPROFILER_HPP
+#define EULUNAPROFILER_HPP
+
+#include "eulunainterface.hpp"
+
+#include <csignal>
+#include <sys/time.h>
+
+// Sampling profiler of the lua code run while it exists, each sample walks the lua stack
+// and counts it, the result is in the folded stacks format read by flamegraph tools.
+// Samples are taken every given number of instructions, or in the first hook after a
+// SIGPROF timer expires, so time spent inside C++ functions is only seen when they call back into lua
+class EulunaProfiler {
+public:
+    // samples every sampleInstructions lua instructions
+    EulunaProfiler(lua_State *L, int sampleInstructions = 10000) : L(L), m_hookInterval(std::max(sampleInstructions, 1)) {
+        install();
+    }
+    // samples about every samplePeriod of cpu time, checking the timer every hookInterval instructions
+    EulunaProfiler(lua_State *L, std::chrono::microseconds samplePeriod, int hookInterval = 100) :
+        L(L), m_hookInterval(std::max(hookInterval, 1)), m_timed(true) {
+        if(activeTimedProfiler().exchange(true))
+            throw EulunaEngineError("Unable to start a timed profiler because another one is running");
+        try {
+            install();
+        } catch(...) {
+            activeTimedProfiler() = false;
+            throw;
+        }
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = [](int) { timerExpired().store(true, std::memory_order_relaxed); };
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGPROF, &action, &m_oldAction);
+        long usec = std::max<long>(samplePeriod.count(), 1);
+        struct itimerval timer;
+        timer.it_interval.tv_sec = timer.it_value.tv_sec = usec / 1000000;
+        timer.it_interval.tv_usec = timer.it_value.tv_usec = usec % 1000000;
+        setitimer(ITIMER_PROF, &timer, nullptr);
+    }
+    EulunaProfiler(EulunaInterface *lua, int sampleInstructions = 10000) : EulunaProfiler(lua->luaState(), sampleInstructions) { }
+    EulunaProfiler(EulunaInterface *lua, std::chrono::microseconds samplePeriod, int hookInterval = 100) :
+        EulunaProfiler(lua->luaState(), samplePeriod, hookInterval) { }
+
+    ~EulunaProfiler() {
+        if(m_timed) {
+            struct itimerval timer;
+            memset(&timer, 0, sizeof(timer));
+            setitimer(ITIMER_PROF, &timer, nullptr);
+            sigaction(SIGPROF, &m_oldAction, nullptr);
+            timerExpired() = false;
+            activeTimedProfiler() = false;
+        }
+        EulunaHookDispatcher::remove(L, this);
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, profilerKey());
+        uninstallResume();
+    }
+
+    EulunaProfiler(const EulunaProfiler&) = delete;
+    EulunaProfiler& operator=(const EulunaProfiler&) = delete;
+
+    uint64_t getSampleCount() const { return m_sampleCount; }
+    const std::unordered_map<std::string, uint64_t>& getStacks() const { return m_stacks; }
+
+    // one line per distinct stack, frames from the outermost separated by ';' followed by the sample count
+    std::string getFoldedStacks() const {
+        std::vector<std::pair<std::string, uint64_t>> stacks(m_stacks.begin(), m_stacks.end());
+        std::sort(stacks.begin(), stacks.end());
+        std::string out;
+        for(auto& it : stacks)
+            out += euluna_tools::format("%s %" PRIu64 "\n", it.first, it.second);
+        return out;
+    }
+
+    bool writeFoldedStacks(const std::string& fileName) const {
+        std::string text = getFoldedStacks();
+        return euluna_tools::write_file_atomic(fileName, text.data(), text.size());
+    }
+
+    void reset() {
+        m_stacks.clear();
+        m_sampleCount = 0;
+    }
+
+private:
+    void install() {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, profilerKey());
+        bool hasProfiler = !lua_isnil(L, -1);
+        lua_pop(L, 1);
+        if(hasProfiler)
+            throw EulunaEngineError("Unable to start the profiler because the lua state already has one");
+        EulunaHookDispatcher::add(L, this, &EulunaProfiler::hook, m_hookInterval);
+        lua_pushlightuserdata(L, this);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, profilerKey());
+        installResume();
+    }
+
+    // the debug hook belongs to each lua thread, new coroutines copy it from their creator and the engine
+    // scheduler copies it when resuming, coroutine.resume is wrapped to do the same for coroutines
+    // created before the profiler and resumed from lua
+    void installResume() {
+        lua_getglobal(L, "coroutine");
+        if(lua_istable(L, -1)) {
+            lua_getfield(L, -1, "resume");
+            if(lua_iscfunction(L, -1) && lua_tocfunction(L, -1) != &EulunaProfiler::resumeWithHook) {
+                lua_pushcclosure(L, &EulunaProfiler::resumeWithHook, 1);
+                lua_setfield(L, -2, "resume");
+            } else
+                lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+
+    void uninstallResume() {
+        lua_getglobal(L, "coroutine");
+        if(lua_istable(L, -1)) {
+            lua_getfield(L, -1, "resume");
+            if(lua_tocfunction(L, -1) == &EulunaProfiler::resumeWithHook) {
+                lua_getupvalue(L, -1, 1);
+                lua_setfield(L, -3, "resume");
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+
+    static int resumeWithHook(lua_State *L) {
+        if(lua_State *thread = lua_tothread(L, 1))
+            lua_sethook(thread, lua_gethook(L), lua_gethookmask(L), lua_gethookcount(L));
+        lua_pushvalue(L, lua_upvalueindex(1));
+        lua_insert(L, 1);
+        lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+        return lua_gettop(L);
+    }
+
+    static void* profilerKey() {
+        static char key;
+        return &key;
+    }
+    static std::atomic<bool>& activeTimedProfiler() {
+        static std::atomic<bool> active{false};
+        return active;
+    }
+    static std::atomic<bool>& timerExpired() {
+        static std::atomic<bool> expired{false};
+        return expired;
+    }
+
+    static void hook(void *client, lua_State *L, uint64_t instructions) {
+        EulunaProfiler *profiler = static_cast<EulunaProfiler*>(client);
+        if(profiler->m_timed && !timerExpired().exchange(false, std::memory_order_relaxed))
+            return;
+        profiler->sample(L);
+    }
+
+    void sample(lua_State *L) {
+        m_frames.clear();
+        lua_Debug ar;
+        for(int level = 0; lua_getstack(L, level, &ar); ++level) {
+            lua_getinfo(L, "Snf", &ar);
+            m_frames.push_back(frameName(L, ar));
+            lua_pop(L, 1);
+        }
+        m_stack.clear();
+        for(auto it = m_frames.rbegin(); it != m_frames.rend(); ++it) {
+            if(!m_stack.empty())
+                m_stack += ';';
+            m_stack += *it;
+        }
+        m_stacks[m_stack]++;
+        m_sampleCount++;
+    }
+
+    // C++ bindings are named after the name upvalue of their trampoline, the function at the top of the stack
+    static std::string frameName(lua_State *L, lua_Debug& ar) {
+        std::string name;
+        if(ar.what[0] == 'C') {
+            if(lua_getupvalue(L, -1, 2)) {
+                if(lua_type(L, -1) == LUA_TSTRING)
+                    name = lua_tostring(L, -1);
+                lua_pop(L, 1);
+            }
+            if(name.empty())
+                name = ar.name ? ar.name : "?";
+            name = "[C] " + name;
+        } else if(ar.what[0] == 'm')
+            name = euluna_tools::format("main chunk (%s)", ar.short_src);
+        else if(ar.name)
+            name = euluna_tools::format("%s (%s:%d)", ar.name, ar.short_src, ar.linedefined);
+        else
+            name = euluna_tools::format("%s:%d", ar.short_src, ar.linedefined);
+        // ';' separates the frames and spaces are fine, but the count follows the last space
+        std::replace(name.begin(), name.end(), ';', ',');
+        return name;
+    }
+
+    lua_State *L;
+    int m_hookInterval;
+    bool m_timed = false;
+    struct sigaction m_oldAction;
+    uint64_t m_sampleCount = 0;
+    std::unordered_map<std::string, uint64_t> m_stacks;
+    std::vector<std::string> m_frames;
+    std::string m_stack;
+};
+
+#endif // EULUNAPROFILER_HPP
@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2016 Euluna <https://github.com/edubart/euluna>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef EULUNARELOADER_HPP
+#define EULUNARELOADER_HPP
+
+#include "eulunaengine.hpp"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+// Reloads changed scripts into a running lua state. Scripts returning a table are modules,
+// their functions are replaced on reload while the data already stored in the module is kept
+class EulunaScriptReloader {
+public:
+    explicit EulunaScriptReloader(EulunaEngine *euluna) : m_euluna(euluna) {
+#ifdef __linux__
+        m_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if(m_inotifyFd < 0)
+            throw EulunaEngineError("Unable to initialize inotify for script reloading");
+#endif
+    }
+
+    ~EulunaScriptReloader() {
+        for(auto& it : m_scripts)
+            m_euluna->unref(it.second.moduleRef);
+#ifdef __linux__
+        ::close(m_inotifyFd);
+#endif
+    }
+
+    EulunaScriptReloader(const EulunaScriptReloader&) = delete;
+    EulunaScriptReloader& operator=(const EulunaScriptReloader&) = delete;
+
+    // runs a script and starts watching its file
+    void safeWatchScript(const std::string& fileName) {
+        std::string dir, path;
+        splitPath(fileName, dir, path);
+        if(m_scripts.find(path) != m_scripts.end())
+            return;
+        watchDir(dir);
+        Script& script = m_scripts[path];
+        script.fileName = fileName;
+        try {
+            safeReloadScript(script);
+        } catch(...) {
+            m_scripts.erase(path);
+            throw;
+        }
+    }
+
+    // reloads the scripts changed since the last poll and returns how many were reloaded,
+    // a script that fails to reload keeps its old code and the first error is thrown after reloading the others
+    size_t safePoll() {
+        std::set<std::string> changed = collectChanges();
+        size_t reloaded = 0;
+        std::exception_ptr error;
+        for(const std::string& path : changed) {
+            auto it = m_scripts.find(path);
+            if(it == m_scripts.end())
+                continue;
+            try {
+                safeReloadScript(it->second);
+                reloaded++;
+            } catch(...) {
+                if(!error)
+                    error = std::current_exception();
+            }
+        }
+        if(error)
+            std::rethrow_exception(error);
+        return reloaded;
+    }
+
+    bool watchScript(const std::string& fileName) {
+        m_lastError.clear();
+        try {
+            safeWatchScript(fileName);
+            return true;
+        } catch(std::exception& e) {
+            m_lastError = e.what();
+            return false;
+        }
+    }
+
+    size_t poll() {
+        m_lastError.clear();
+        try {
+            return safePoll();
+        } catch(std::exception& e) {
+            m_lastError = e.what();
+            return 0;
+        }
+    }
+
+    size_t getWatchedCount() const { return m_scripts.size(); }
+    uint64_t getReloadCount() const { return m_reloadCount; }
+    std::string getLastError() { return m_lastError; }
+    bool hasError() { return !m_lastError.empty(); }
+
+private:
+    struct Script {
+        std::string fileName;
+        int moduleRef = LUA_NOREF;
+#ifndef __linux__
+        time_t modifiedTime = 0;
+#endif
+    };
+
+    static void splitPath(const std::string& fileName, std::string& dir, std::string& path) {
+        size_t pos = fileName.rfind('/');
+        dir = pos == std::string::npos ? "." : (pos == 0 ? "/" : fileName.substr(0, pos));
+        path = dir + "/" + (pos == std::string::npos ? fileName : fileName.substr(pos + 1));
+    }
+
+    void watchDir(const std::string& dir) {
+#ifdef __linux__
+        if(m_watchedDirs.find(dir) != m_watchedDirs.end())
+            return;
+        // editors often replace files by renaming, so the directory is watched instead of the file
+        int wd = inotify_add_watch(m_inotifyFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if(wd < 0)
+            throw EulunaFileError(euluna_tools::format("cannot watch directory '%s'", dir));
+        m_watchedDirs[dir] = wd;
+        m_watchDescriptors[wd] = dir;
+#endif
+    }
+
+    std::set<std::string> collectChanges() {
+        std::set<std::string> changed;
+#ifdef __linux__
+        alignas(struct inotify_event) char buffer[4096];
+        while(true) {
+            ssize_t len = ::read(m_inotifyFd, buffer, sizeof(buffer));
+            if(len <= 0)
+                break;
+            for(char *p = buffer; p < buffer + len; ) {
+                struct inotify_event *event = reinterpret_cast<struct inotify_event*>(p);
+                auto it = m_watchDescriptors.find(event->wd);
+                if(it != m_watchDescriptors.end() && event->len > 0)
+                    changed.insert(it->second + "/" + event->name);
+                p += sizeof(struct inotify_event) + event->len;
+            }
+        }
+#else
+        // without inotify every watched file is checked
+        for(auto& it : m_scripts) {
+            struct stat st;
+            if(stat(it.second.fileName.c_str(), &st) == 0 && st.st_mtime != it.second.modifiedTime)
+                changed.insert(it.first);
+        }
+#endif
+        return changed;
+    }
+
+    void safeReloadScript(Script& script) {
+#ifndef __linux__
+        struct stat st;
+        if(stat(script.fileName.c_str(), &st) == 0)
+            script.modifiedTime = st.st_mtime;
+#endif
+        // on errors the old module stays as it is
+        m_euluna->safeLoadScript(script.fileName);
+        m_euluna->safeCall(0, 1);
+        if(m_euluna->isTable()) {
+            if(script.moduleRef == LUA_NOREF) {
+                script.moduleRef = m_euluna->ref();
+            } else {
+                m_euluna->getRef(script.moduleRef);
+                mergeModule(m_euluna->stackSize(), m_euluna->stackSize() - 1);
+                m_euluna->pop(2);
+            }
+        } else
+            m_euluna->pop();
+
+        // function refs may point to replaced functions
+        m_euluna->invalidateFunctionRefs();
+        m_reloadCount++;
+    }
+
+    // moves the functions of the reloaded module into the module loaded before
+    void mergeModule(int module, int reloaded) {
+        EulunaEngine& lua = *m_euluna;
+        // functions removed from the script
+        lua.pushNil();
+        while(lua.next(module)) {
+            bool removed = false;
+            if(lua.isFunction()) {
+                lua.pushValue(-2);
+                lua.rawGet(reloaded);
+                removed = lua.isNil();
+                lua.pop();
+            }
+            lua.pop();
+            if(removed) {
+                lua.pushValue();
+                lua.pushNil();
+                lua.rawSet(module);
+            }
+        }
+        // new and changed functions, data is only added when not in the module yet
+        lua.pushNil();
+        while(lua.next(reloaded)) {
+            bool replace = lua.isFunction();
+            if(replace) {
+                rebindUpvalues(lua.stackSize(), reloaded, module);
+            } else {
+                lua.pushValue(-2);
+                lua.rawGet(module);
+                replace = lua.isNil();
+                lua.pop();
+            }
+            if(replace) {
+                lua.pushValue(-2);
+                lua.insert(-2);
+                lua.rawSet(module);
+            } else
+                lua.pop();
+        }
+        // globals and loaded packages pointing to the reloaded module now point to the old one
+        lua.pushGlobalTable();
+        redirectReferences(lua.stackSize(), reloaded, module);
+        lua.pop();
+        lua.getRegistryField("_LOADED");
+        if(lua.isTable())
+            redirectReferences(lua.stackSize(), reloaded, module);
+        lua.pop();
+    }
+
+    // functions of the reloaded chunk that use the module as upvalue (local M = {}) are pointed to the old module
+    void rebindUpvalues(int function, int reloaded, int module) {
+        lua_State *L = m_euluna->luaState();
+        for(int i = 1; lua_getupvalue(L, function, i); ++i) {
+            bool isModule = lua_rawequal(L, -1, reloaded);
+            lua_pop(L, 1);
+            if(isModule) {
+                lua_pushvalue(L, module);
+                lua_setupvalue(L, function, i);
+            }
+        }
+    }
+
+    void redirectReferences(int table, int from, int to) {
+        EulunaEngine& lua = *m_euluna;
+        lua.pushNil();
+        while(lua.next(table)) {
+            bool redirect = lua_rawequal(lua.luaState(), -1, from);
+            lua.pop();
+            if(redirect) {
+                lua.pushValue();
+                lua.pushValue(to);
+                lua.rawSet(table);
+            }
+        }
+    }
+
+    EulunaEngine *m_euluna;
+    std::map<std::string, Script> m_scripts;
+#ifdef __linux__
+    int m_inotifyFd = -1;
+    std::map<std::string, int> m_watchedDirs;
+    std::map<int, std::string> m_watchDescriptors;
+#endif
+    uint64_t m_reloadCount = 0;
+    std::string m_lastError;
+};
+
+#endif // EULUNARELOADER_HPP
@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2016 Euluna <https://github.com/edubart/euluna>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef EULUNASIGNAL_HPP
+#define EULUNASIGNAL_HPP
+
+#include "eulunaengine.hpp"
+
+// Event that lua functions connect to, emitting it calls every connected function with the same arguments.
+// Lua sees the signal as a global table:
+//   local id = onPlayerLogin.connect(function(name, level) end)
+//   onPlayerLogin.disconnect(id)
+// The signal must be destroyed before its engine, connect and disconnect functions kept by scripts
+// raise lua errors once it's destroyed.
+template<typename... Args>
+class EulunaSignal {
+    typedef std::tuple<typename std::decay<Args>::type...> ArgsTuple;
+
+public:
+    EulunaSignal(EulunaEngine *euluna, const std::string& name) : m_euluna(euluna), m_name(name) {
+        assert(euluna);
+        // the functions hold the handle instead of the signal, it's cleared when the signal is destroyed
+        m_handle = std::make_shared<EulunaSignal*>(this);
+        std::shared_ptr<EulunaSignal*> handle = m_handle;
+        m_euluna->newTable();
+        m_euluna->pushCppFunction([handle](EulunaInterface *lua) -> int {
+            EulunaSignal *self = get(handle);
+            if(!lua->isFunction(1)) {
+                // the message lives in lua, argError doesn't return
+                lua->pushString(euluna_tools::format("function expected, got %s", lua->toTypeName(1)));
+                return lua->argError(1, lua->toCString(-1));
+            }
+            lua->pushValue(1);
+            int id = self->connect();
+            lua->clearStack();
+            lua->pushInteger(id);
+            return 1;
+        }, m_name + ".connect");
+        m_euluna->setField("connect");
+        m_euluna->pushCppFunction([handle](EulunaInterface *lua) -> int {
+            EulunaSignal *self = get(handle);
+            if(!lua->isNumber(1)) {
+                lua->pushString(euluna_tools::format("number expected, got %s", lua->toTypeName(1)));
+                return lua->argError(1, lua->toCString(-1));
+            }
+            bool ret = self->disconnect(lua->toInteger(1));
+            lua->clearStack();
+            lua->pushBoolean(ret);
+            return 1;
+        }, m_name + ".disconnect");
+        m_euluna->setField("disconnect");
+        m_euluna->pushValue();
+        m_tableRef = m_euluna->ref();
+        m_euluna->setGlobal(m_name);
+    }
+
+    ~EulunaSignal() {
+        *m_handle = nullptr;
+        disconnectAll();
+        // tables still referenced by scripts can no longer connect
+        m_euluna->getRef(m_tableRef);
+        m_euluna->pushNil();
+        m_euluna->setField("connect");
+        m_euluna->pushNil();
+        m_euluna->setField("disconnect");
+        m_euluna->getGlobal(m_name);
+        if(lua_rawequal(m_euluna->luaState(), -1, -2)) {
+            m_euluna->pushNil();
+            m_euluna->setGlobal(m_name);
+        }
+        m_euluna->pop(2);
+        m_euluna->unref(m_tableRef);
+    }
+
+    EulunaSignal(const EulunaSignal&) = delete;
+    EulunaSignal& operator=(const EulunaSignal&) = delete;
+
+    // connects the function on the top of the stack, returns the id used to disconnect it
+    int connect() {
+        assert(m_euluna->isFunction());
+        m_refs.push_back(m_euluna->ref());
+        m_ids.push_back(++m_lastId);
+        return m_lastId;
+    }
+
+    bool disconnect(int id) {
+        // ids are given in increasing order and stay sorted
+        auto it = std::lower_bound(m_ids.begin(), m_ids.end(), id);
+        if(it == m_ids.end() || *it != id || m_refs[it - m_ids.begin()] == LUA_NOREF)
+            return false;
+        size_t i = it - m_ids.begin();
+        m_euluna->unref(m_refs[i]);
+        // listeners are removed in batches, so indexes also stay valid while emitting
+        m_refs[i] = LUA_NOREF;
+        m_numDisconnected++;
+        if(m_emitDepth == 0 && m_numDisconnected * 2 > m_refs.size())
+            compact();
+        return true;
+    }
+
+    void disconnectAll() {
+        for(int& ref : m_refs) {
+            if(ref != LUA_NOREF) {
+                m_euluna->unref(ref);
+                ref = LUA_NOREF;
+            }
+        }
+        m_numDisconnected = m_refs.size();
+        if(m_emitDepth == 0)
+            compact();
+    }
+
+    // calls every listener, errors are thrown after all listeners were called
+    void safeEmit(const Args&... args) {
+        std::string error = callListeners(args...);
+        if(!error.empty())
+            throw EulunaRuntimeError(error);
+    }
+
+    // queues an emit to be done by the next flush, emits with the same arguments as an already queued one are coalesced,
+    // requires the arguments to be comparable
+    void post(const Args&... args) {
+        ArgsTuple event(args...);
+        if(std::find(m_pending.begin(), m_pending.end(), event) == m_pending.end())
+            m_pending.push_back(std::move(event));
+    }
+
+    // emits the queued events, usually once per frame
+    void safeFlush() {
+        std::vector<ArgsTuple> pending;
+        pending.swap(m_pending);
+        std::string error;
+        for(const ArgsTuple& event : pending) {
+            std::string eventError = callListeners(event, euluna_traits::make_index_sequence<sizeof...(Args)>());
+            if(error.empty())
+                error = eventError;
+        }
+        if(!error.empty())
+            throw EulunaRuntimeError(error);
+    }
+
+    // functions that instead if throwing exception will set last error string
+    bool emit(const Args&... args) {
+        m_lastError.clear();
+        try {
+            safeEmit(args...);
+            return true;
+        } catch(std::exception& e) {
+            m_lastError = e.what();
+            return false;
+        }
+    }
+    bool flush() {
+        m_lastError.clear();
+        try {
+            safeFlush();
+            return true;
+        } catch(std::exception& e) {
+            m_lastError = e.what();
+            return false;
+        }
+    }
+
+    size_t getListenerCount() const { return m_refs.size() - m_numDisconnected; }
+    size_t getPendingCount() const { return m_pending.size(); }
+    const std::string& getName() const { return m_name; }
+    std::string getLastError() { return m_lastError; }
+    bool hasError() { return !m_lastError.empty(); }
+
+private:
+    static EulunaSignal* get(const std::shared_ptr<EulunaSignal*>& handle) {
+        if(!*handle)
+            throw EulunaRuntimeError("Attempt to use a destroyed signal");
+        return *handle;
+    }
+
+    // pushes the arguments once and calls the listeners from a single protected call,
+    // when a listener fails the remaining ones are called from a new protected call,
+    // returns the error of the first listener that failed
+    std::string callListeners(const Args&... args) {
+        std::string error;
+        if(m_refs.empty())
+            return error;
+        m_euluna->pushErrorHandler();
+        int errorHandler = m_euluna->stackSize();
+        int numArgs = m_euluna->polymorphicPush(args...);
+        // listeners connected while emitting are called on the next emit
+        size_t end = m_refs.size();
+        size_t next = 0;
+        m_emitDepth++;
+        while(next < end) {
+            m_euluna->pushCFunction(&EulunaSignal::dispatch);
+            m_euluna->pushLightUserdata(this);
+            m_euluna->pushLightUserdata(&next);
+            m_euluna->pushInteger(end);
+            for(int j = 1; j <= numArgs; ++j)
+                m_euluna->pushValue(errorHandler + j);
+            if(m_euluna->pcall(numArgs + 3, 0, errorHandler) != 0) {
+                std::string listenerError = m_euluna->popString();
+                if(error.empty())
+                    error = listenerError;
+                // skips the failed listener
+                next++;
+            }
+        }
+        m_emitDepth--;
+        m_euluna->pop(numArgs + 1);
+        if(m_emitDepth == 0 && m_numDisconnected * 2 > m_refs.size())
+            compact();
+        return error;
+    }
+
+    // called with the signal, the next listener index, the end index and the emit arguments
+    static int dispatch(lua_State *L) {
+        EulunaSignal *self = static_cast<EulunaSignal*>(lua_touserdata(L, 1));
+        size_t& next = *static_cast<size_t*>(lua_touserdata(L, 2));
+        size_t end = lua_tointeger(L, 3);
+        int numArgs = lua_gettop(L) - 3;
+        for(; next < end; ++next) {
+            int ref = self->m_refs[next];
+            if(ref == LUA_NOREF)
+                continue;
+            lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+            for(int j = 4; j <= numArgs + 3; ++j)
+                lua_pushvalue(L, j);
+            lua_call(L, numArgs, 0);
+        }
+        return 0;
+    }
+
+    template<int... I>
+    std::string callListeners(const ArgsTuple& event, euluna_traits::index_sequence<I...>) {
+        return callListeners(std::get<I>(event)...);
+    }
+
+    void compact() {
+        if(m_numDisconnected == 0)
+            return;
+        size_t n = 0;
+        for(size_t i = 0; i < m_refs.size(); ++i) {
+            if(m_refs[i] != LUA_NOREF) {
+                m_refs[n] = m_refs[i];
+                m_ids[n] = m_ids[i];
+                n++;
+            }
+        }
+        m_refs.resize(n);
+        m_ids.resize(n);
+        m_numDisconnected = 0;
+    }
+
+    EulunaEngine *m_euluna;
+    std::string m_name;
+    std::shared_ptr<EulunaSignal*> m_handle;
+    int m_tableRef = LUA_NOREF;
+    // listeners in connection order, the registry refs are kept dense for emitting
+    std::vector<int> m_refs;
+    std::vector<int> m_ids;
+    int m_lastId = 0;
+    int m_emitDepth = 0;
+    size_t m_numDisconnected = 0;
+    std::vector<ArgsTuple> m_pending;
+    std::string m_lastError;
+};
+
+#endif // EULUNASIGNAL_HPP
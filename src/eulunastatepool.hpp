@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2016 Euluna <https://github.com/edubart/euluna>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef EULUNASTATEPOOL_HPP
+#define EULUNASTATEPOOL_HPP
+
+#include "eulunaengine.hpp"
+#include "eulunabinder.hpp"
+
+// Pool of bootstrapped lua states, released states are reset to their checkpoint instead of being recreated
+class EulunaStatePool {
+public:
+    typedef std::function<void(EulunaEngine*)> Bootstrap;
+
+    // engine borrowed from the pool, it goes back to the pool when destroyed
+    class Lease {
+    public:
+        Lease() : m_pool(nullptr) { }
+        Lease(EulunaStatePool *pool, std::unique_ptr<EulunaEngine> engine) : m_pool(pool), m_engine(std::move(engine)) { }
+        Lease(Lease&& other) : m_pool(other.m_pool), m_engine(std::move(other.m_engine)) { other.m_pool = nullptr; }
+        Lease& operator=(Lease&& other) {
+            if(this != &other) {
+                release();
+                m_pool = other.m_pool;
+                m_engine = std::move(other.m_engine);
+                other.m_pool = nullptr;
+            }
+            return *this;
+        }
+        ~Lease() { release(); }
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        // returns the engine to the pool before the lease is destroyed
+        void release() {
+            if(m_pool && m_engine)
+                m_pool->release(std::move(m_engine));
+            m_pool = nullptr;
+        }
+
+        EulunaEngine *get() const { return m_engine.get(); }
+        EulunaEngine *operator->() const { return m_engine.get(); }
+        EulunaEngine& operator*() const { return *m_engine; }
+        explicit operator bool() const { return (bool)m_engine; }
+
+    private:
+        EulunaStatePool *m_pool;
+        std::unique_ptr<EulunaEngine> m_engine;
+    };
+
+    // the bootstrap runs once per created state, after registering the binder bindings
+    explicit EulunaStatePool(Bootstrap bootstrap, size_t maxIdle = 16, EulunaBinder *binder = &EulunaBinder::instance()) :
+        m_bootstrap(std::move(bootstrap)), m_binder(binder), m_maxIdle(maxIdle) { }
+
+    EulunaStatePool(const EulunaStatePool&) = delete;
+    EulunaStatePool& operator=(const EulunaStatePool&) = delete;
+
+    // creates states ahead so the first acquires don't pay for the bootstrap
+    void prewarm(size_t count) {
+        while(getIdleCount() < count && getIdleCount() < m_maxIdle) {
+            std::unique_ptr<EulunaEngine> engine = create();
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_idle.push_back(std::move(engine));
+        }
+    }
+
+    // the acquiring thread becomes the owner of the engine
+    Lease acquire() {
+        std::unique_ptr<EulunaEngine> engine;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if(!m_idle.empty()) {
+                engine = std::move(m_idle.back());
+                m_idle.pop_back();
+            }
+        }
+        if(!engine)
+            engine = create();
+        engine->getCallQueue()->setOwnerThread();
+        return Lease(this, std::move(engine));
+    }
+
+    // resets the engine and keeps it for the next acquire, engines that fail to reset are destroyed
+    void release(std::unique_ptr<EulunaEngine> engine) {
+        if(!engine)
+            return;
+        if(getIdleCount() >= m_maxIdle)
+            return;
+        try {
+            engine->resetToCheckpoint(m_gcStepSize);
+        } catch(std::exception&) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_idle.size() < m_maxIdle)
+            m_idle.push_back(std::move(engine));
+    }
+
+    // size in kilobytes of the incremental gc step done by resets, 0 does a basic step
+    void setGcStepSize(int size) { m_gcStepSize = size; }
+    void setMaxIdle(size_t maxIdle) { m_maxIdle = maxIdle; }
+
+    size_t getIdleCount() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_idle.size();
+    }
+    size_t getCreatedCount() const { return m_createdCount; }
+
+private:
+    std::unique_ptr<EulunaEngine> create() {
+        std::unique_ptr<EulunaEngine> engine(new EulunaEngine);
+        if(m_binder)
+            m_binder->registerBindings(engine.get());
+        if(m_bootstrap)
+            m_bootstrap(engine.get());
+        engine->checkpoint();
+        m_createdCount++;
+        return engine;
+    }
+
+    Bootstrap m_bootstrap;
+    EulunaBinder *m_binder;
+    std::atomic<size_t> m_maxIdle;
+    std::atomic<int> m_gcStepSize{0};
+    std::atomic<size_t> m_createdCount{0};
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<EulunaEngine>> m_idle;
+};
+
+#endif // EULUNASTATEPOOL_HPP
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2016 Euluna <https://github.com/edubart/euluna>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef EULUNATHREADPOOL_HPP
+#define EULUNATHREADPOOL_HPP
+
+#include "eulunaprereqs.hpp"
+
+
+// Pool of worker threads with work stealing,
+// tasks can also be pinned to a worker when they depend on its data
+class EulunaThreadPool {
+public:
+    typedef std::function<void()> Task;
+    typedef std::function<void(size_t)> WorkerHandler;
+
+    // start and stop handlers are called from each worker thread with its index
+    explicit EulunaThreadPool(size_t numWorkers, WorkerHandler onStart = nullptr, WorkerHandler onStop = nullptr) :
+        m_onStart(std::move(onStart)), m_onStop(std::move(onStop)) {
+        if(numWorkers == 0)
+            numWorkers = 1;
+        for(size_t i = 0; i < numWorkers; ++i)
+            m_workers.emplace_back(new Worker);
+        for(size_t i = 0; i < numWorkers; ++i)
+            m_workers[i]->thread = std::thread([this, i] { run(i); });
+    }
+
+    ~EulunaThreadPool() { stop(); }
+
+    EulunaThreadPool(const EulunaThreadPool&) = delete;
+    EulunaThreadPool& operator=(const EulunaThreadPool&) = delete;
+
+    // posts a task that any worker can run, tasks posted from a worker go to its own queue first
+    void post(Task task) {
+        size_t index;
+        if(currentPool() == this)
+            index = currentIndex();
+        else
+            index = m_nextWorker++ % m_workers.size();
+        Worker& worker = *m_workers[index];
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_waitMutex);
+            m_stealable++;
+        }
+        m_waitCondition.notify_one();
+    }
+
+    // posts a task that only the given worker runs
+    void post(size_t index, Task task) {
+        Worker& worker = *m_workers[index % m_workers.size()];
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.pinned.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_waitMutex);
+            worker.numPinned++;
+        }
+        m_waitCondition.notify_all();
+    }
+
+    // stops after running all the posted tasks
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(m_waitMutex);
+            if(m_stopping)
+                return;
+            m_stopping = true;
+        }
+        m_waitCondition.notify_all();
+        for(auto& worker : m_workers) {
+            if(worker->thread.joinable())
+                worker->thread.join();
+        }
+    }
+
+    size_t size() const { return m_workers.size(); }
+
+    // index of the worker running the calling thread, or -1 when not called from a worker of this pool
+    int currentWorker() const { return currentPool() == this ? (int)currentIndex() : -1; }
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+        std::deque<Task> pinned;
+        std::thread thread;
+        int numPinned = 0;
+    };
+
+    bool takeTask(size_t index, Task& task) {
+        Worker& worker = *m_workers[index];
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            if(!worker.pinned.empty()) {
+                task = std::move(worker.pinned.front());
+                worker.pinned.pop_front();
+                std::lock_guard<std::mutex> waitLock(m_waitMutex);
+                worker.numPinned--;
+                return true;
+            }
+            // newest local tasks first, they are likely to be hot in cache
+            if(!worker.tasks.empty()) {
+                task = std::move(worker.tasks.back());
+                worker.tasks.pop_back();
+                m_stealable--;
+                return true;
+            }
+        }
+        // steal the oldest tasks from other workers
+        for(size_t i = 1; i < m_workers.size(); ++i) {
+            Worker& victim = *m_workers[(index + i) % m_workers.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if(!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                m_stealable--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(size_t index) {
+        currentPool() = this;
+        currentIndex() = index;
+        if(m_onStart)
+            m_onStart(index);
+        Worker& worker = *m_workers[index];
+        while(true) {
+            Task task;
+            if(takeTask(index, task)) {
+                task();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m_waitMutex);
+            m_waitCondition.wait(lock, [&] { return m_stopping || m_stealable > 0 || worker.numPinned > 0; });
+            if(m_stopping && m_stealable <= 0 && worker.numPinned <= 0)
+                break;
+        }
+        if(m_onStop)
+            m_onStop(index);
+        currentPool() = nullptr;
+    }
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    WorkerHandler m_onStart;
+    WorkerHandler m_onStop;
+    std::mutex m_waitMutex;
+    std::condition_variable m_waitCondition;
+    std::atomic<int> m_stealable{0};
+    std::atomic<size_t> m_nextWorker{0};
+    bool m_stopping = false;
+
+    static EulunaThreadPool*& currentPool() { static thread_local EulunaThreadPool *pool = nullptr; return pool; }
+    static size_t& currentIndex() { static thread_local size_t index = 0; return index; }
+};
+
+#endif // EULUNATHREADPOOL_HPP
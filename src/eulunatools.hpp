@@ -25,12 +25,39 @@
 
 #include "eulunaprereqs.hpp"
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
 namespace euluna_traits {
 
 template<class T> struct replace_extent { typedef T type; };
 template<class T> struct replace_extent<T[]> { typedef const T* type; };
 template<class T, unsigned long N> struct replace_extent<T[N]> { typedef const T* type;};
 template<typename T> struct remove_const_ref { typedef typename std::remove_const<typename std::remove_reference<T>::type>::type type; };
+template<typename T> struct is_tuple : std::false_type { };
+template<typename... Args> struct is_tuple<std::tuple<Args...>> : std::true_type { };
+template<typename T> struct is_future : std::false_type { };
+template<typename T> struct is_future<std::future<T>> : std::true_type { };
+
+// Compile time sequence of indexes, used to expand tuples into arguments
+template<int... I> struct index_sequence { };
+template<int N, int... I> struct make_index_sequence : make_index_sequence<N-1, N-1, I...> { };
+template<int... I> struct make_index_sequence<0, I...> : index_sequence<I...> { };
+
+// Whether F can be called with an Arg returning something convertible to Ret
+template<typename F, typename Ret, typename Arg>
+struct is_callable_with {
+    template<typename G>
+    static typename std::is_convertible<decltype(std::declval<G&>()(std::declval<Arg>())), Ret>::type test(int);
+    template<typename G>
+    static std::false_type test(...);
+    enum { value = decltype(test<F>(0))::value };
+};
 
 template<typename Lambda>
 struct lambda_to_stdfunction {
@@ -125,6 +152,336 @@ std::string format(const std::string& format, const Args&... args) {
     }
 }
 
+// FNV-1a 64 bits hash, used for keying cached data by content
+inline uint64_t fnv1a_hash(const void* data, size_t len, uint64_t hash = 14695981039346656037ULL) {
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+    for(size_t i = 0; i < len; ++i) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+inline uint64_t fnv1a_hash(const std::string& str, uint64_t hash = 14695981039346656037ULL) {
+    return fnv1a_hash(str.data(), str.length(), hash);
+}
+
+// Cheap timestamp for measuring short durations, the cpu time stamp counter where available
+inline uint64_t cpu_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// cpu_cycles ticks per nanosecond, measured against the steady clock the first time it is called
+inline double cpu_cycles_per_ns() {
+    static double ratio = [] {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t startCycles = cpu_cycles();
+        std::chrono::nanoseconds elapsed;
+        do {
+            elapsed = std::chrono::steady_clock::now() - start;
+        } while(elapsed < std::chrono::milliseconds(2));
+        double ratio = (double)(cpu_cycles() - startCycles) / elapsed.count();
+        return ratio > 0 ? ratio : 1.0;
+    }();
+    return ratio;
+}
+
+// Read only memory mapped file
+class mapped_file {
+public:
+    mapped_file() { }
+    explicit mapped_file(const std::string& fileName) { open(fileName); }
+    ~mapped_file() { close(); }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    bool open(const std::string& fileName) {
+        close();
+        int fd = ::open(fileName.c_str(), O_RDONLY);
+        if(fd < 0)
+            return false;
+        struct stat st;
+        if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            ::close(fd);
+            return false;
+        }
+        m_size = st.st_size;
+        m_opened = true;
+        // empty files can't be mapped, but they are still valid files
+        if(m_size > 0) {
+            void *data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(data == MAP_FAILED) {
+                m_size = 0;
+                m_opened = false;
+            } else
+                m_data = static_cast<const char*>(data);
+        }
+        ::close(fd);
+        return m_opened;
+    }
+
+    void close() {
+        if(m_data)
+            munmap(const_cast<char*>(m_data), m_size);
+        m_data = nullptr;
+        m_size = 0;
+        m_opened = false;
+    }
+
+    bool isOpen() const { return m_opened; }
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+    bool m_opened = false;
+};
+
+// Write a file atomically by writing into a temporary file and then renaming it,
+// the temporary file is unique per call so threads writing the same file don't share it
+inline bool write_file_atomic(const std::string& fileName, const void* data, size_t len) {
+    static std::atomic<uint64_t> counter{0};
+    std::string tmpFileName = format("%s.%d.%" PRIu64 ".tmp", fileName, (int)getpid(), counter.fetch_add(1, std::memory_order_relaxed));
+    int fd = ::open(tmpFileName.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if(fd < 0)
+        return false;
+    const char *p = static_cast<const char*>(data);
+    while(len > 0) {
+        ssize_t n = ::write(fd, p, len);
+        if(n <= 0) {
+            ::close(fd);
+            ::unlink(tmpFileName.c_str());
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    ::close(fd);
+    if(::rename(tmpFileName.c_str(), fileName.c_str()) != 0) {
+        ::unlink(tmpFileName.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Histogram with power of two buckets, bucket i counts values in [2^(i-1), 2^i)
+class log_histogram {
+public:
+    enum { NUM_BUCKETS = 65 };
+
+    log_histogram() { reset(); }
+
+    void record(uint64_t value) {
+        m_buckets[bucket_of(value)]++;
+        if(m_count == 0 || value < m_min)
+            m_min = value;
+        if(value > m_max)
+            m_max = value;
+        m_count++;
+        m_sum += value;
+    }
+
+    void reset() {
+        std::memset(m_buckets, 0, sizeof(m_buckets));
+        m_count = m_sum = m_min = m_max = 0;
+    }
+
+    // upper bound of the bucket containing the given fraction of the recorded values
+    uint64_t percentile(double fraction) const {
+        if(m_count == 0)
+            return 0;
+        uint64_t target = (uint64_t)std::ceil(fraction * m_count);
+        uint64_t accumulated = 0;
+        for(int i = 0; i < NUM_BUCKETS; ++i) {
+            accumulated += m_buckets[i];
+            if(accumulated >= target && accumulated > 0)
+                return std::min(bucket_upper_bound(i), m_max);
+        }
+        return m_max;
+    }
+
+    static int bucket_of(uint64_t value) { return value == 0 ? 0 : 64 - __builtin_clzll(value); }
+    static uint64_t bucket_upper_bound(int bucket) { return bucket >= 64 ? UINT64_MAX : (1ULL << bucket) - 1; }
+
+    uint64_t bucket_count(int bucket) const { return m_buckets[bucket]; }
+    uint64_t count() const { return m_count; }
+    uint64_t sum() const { return m_sum; }
+    uint64_t min() const { return m_min; }
+    uint64_t max() const { return m_max; }
+    double mean() const { return m_count > 0 ? (double)m_sum / m_count : 0.0; }
+
+private:
+    uint64_t m_buckets[NUM_BUCKETS];
+    uint64_t m_count;
+    uint64_t m_sum;
+    uint64_t m_min;
+    uint64_t m_max;
+};
+
+// Fixed capacity buffer that overwrites its oldest values, index 0 is the oldest value
+template<typename T>
+class ring_buffer {
+public:
+    explicit ring_buffer(size_t capacity) : m_values(capacity > 0 ? capacity : 1) { }
+
+    void push(const T& value) {
+        m_values[(m_start + m_size) % m_values.size()] = value;
+        if(m_size < m_values.size())
+            m_size++;
+        else
+            m_start = (m_start + 1) % m_values.size();
+    }
+    void clear() { m_start = m_size = 0; }
+
+    const T& operator[](size_t i) const { return m_values[(m_start + i) % m_values.size()]; }
+    const T& back() const { return (*this)[m_size - 1]; }
+    size_t size() const { return m_size; }
+    size_t capacity() const { return m_values.size(); }
+    bool empty() const { return m_size == 0; }
+
+private:
+    std::vector<T> m_values;
+    size_t m_start = 0;
+    size_t m_size = 0;
+};
+
+// Lock free unbounded queue for many producer threads and a single consumer thread (Vyukov's MPSC queue),
+// pushing never blocks, T must be default constructible
+template<typename T>
+class mpsc_queue {
+    struct node {
+        std::atomic<node*> next;
+        T value;
+        node() : next(nullptr) { }
+        explicit node(T&& v) : next(nullptr), value(std::move(v)) { }
+    };
+
+public:
+    mpsc_queue() : m_head(new node), m_tail(m_head.load()) { }
+    ~mpsc_queue() {
+        while(m_tail) {
+            node *next = m_tail->next.load(std::memory_order_relaxed);
+            delete m_tail;
+            m_tail = next;
+        }
+    }
+
+    mpsc_queue(const mpsc_queue&) = delete;
+    mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+    // can be called from any thread
+    void push(T value) {
+        node *n = new node(std::move(value));
+        node *prev = m_head.exchange(n, std::memory_order_acq_rel);
+        prev->next.store(n, std::memory_order_release);
+    }
+
+    // must be called only from the consumer thread, returns false when empty
+    // or when a producer is in the middle of a push
+    bool pop(T& value) {
+        node *tail = m_tail;
+        node *next = tail->next.load(std::memory_order_acquire);
+        if(!next)
+            return false;
+        value = std::move(next->value);
+        next->value = T();
+        m_tail = next;
+        delete tail;
+        return true;
+    }
+
+private:
+    std::atomic<node*> m_head;
+    node *m_tail;
+};
+
+// Lock free bounded queue for many producer and many consumer threads (Vyukov's MPMC queue),
+// the capacity is rounded up to a power of two, T must be default constructible
+template<typename T>
+class mpmc_queue {
+    struct cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+public:
+    explicit mpmc_queue(size_t capacity) {
+        size_t size = 2;
+        while(size < capacity)
+            size *= 2;
+        m_mask = size - 1;
+        m_cells.reset(new cell[size]);
+        for(size_t i = 0; i < size; ++i)
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    mpmc_queue(const mpmc_queue&) = delete;
+    mpmc_queue& operator=(const mpmc_queue&) = delete;
+
+    // returns false when full, the value is only moved when pushed
+    bool try_push(T& value) {
+        size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+        cell *c;
+        while(true) {
+            c = &m_cells[pos & m_mask];
+            size_t seq = c->sequence.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if(dif == 0) {
+                if(m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if(dif < 0)
+                return false;
+            else
+                pos = m_enqueuePos.load(std::memory_order_relaxed);
+        }
+        c->value = std::move(value);
+        c->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // returns false when empty
+    bool try_pop(T& value) {
+        size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+        cell *c;
+        while(true) {
+            c = &m_cells[pos & m_mask];
+            size_t seq = c->sequence.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+            if(dif == 0) {
+                if(m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if(dif < 0)
+                return false;
+            else
+                pos = m_dequeuePos.load(std::memory_order_relaxed);
+        }
+        value = std::move(c->value);
+        c->value = T();
+        c->sequence.store(pos + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    // may be outdated when other threads are pushing or popping
+    size_t size() const {
+        size_t enqueuePos = m_enqueuePos.load(std::memory_order_relaxed);
+        size_t dequeuePos = m_dequeuePos.load(std::memory_order_relaxed);
+        return enqueuePos > dequeuePos ? enqueuePos - dequeuePos : 0;
+    }
+    size_t capacity() const { return m_mask + 1; }
+
+private:
+    std::unique_ptr<cell[]> m_cells;
+    size_t m_mask;
+    std::atomic<size_t> m_enqueuePos{0};
+    std::atomic<size_t> m_dequeuePos{0};
+};
+
 }
 
 
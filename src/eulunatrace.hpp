@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2016 Euluna <https://github.com/edubart/euluna>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef EULUNATRACE_HPP
+#define EULUNATRACE_HPP
+
+#include "eulunaprereqs.hpp"
+#include "eulunatools.hpp"
+
+// Timeline of calls between C++ and lua for chrome://tracing or Perfetto, every thread records
+// complete events in its own ring buffer without locking, only the newest events are kept.
+// The library traces safe calls, C++ bindings, gc steps and binding registrations when built with EULUNA_TRACE
+class EulunaTracer {
+public:
+    enum { BUFFER_SIZE = 64 * 1024, MAX_NAME_LENGTH = 47 };
+
+    struct Event {
+        char name[MAX_NAME_LENGTH + 1];
+        const char *category;
+        // in euluna_tools::cpu_cycles ticks, converted to time when written
+        uint64_t start;
+        uint64_t duration;
+    };
+
+    static uint64_t now() { return euluna_tools::cpu_cycles(); }
+
+    // the category must be a string literal, the name is copied
+    static void record(const char *name, const char *category, uint64_t start, uint64_t duration) {
+        if(!isEnabled())
+            return;
+        ThreadBuffer *buffer = threadBuffer();
+        uint64_t head = buffer->head.load(std::memory_order_relaxed);
+        Event& event = buffer->events[head & (BUFFER_SIZE - 1)];
+        size_t i = 0;
+        for(; i < MAX_NAME_LENGTH && name[i]; ++i)
+            event.name[i] = name[i];
+        event.name[i] = '\0';
+        event.category = category;
+        event.start = start;
+        event.duration = duration;
+        buffer->head.store(head + 1, std::memory_order_release);
+    }
+
+    // recording can be paused at runtime
+    static void setEnabled(bool enabled) { enabledFlag().store(enabled, std::memory_order_relaxed); }
+    static bool isEnabled() { return enabledFlag().load(std::memory_order_relaxed); }
+
+    // events of all threads that recorded any, can be called from any thread,
+    // events being overwritten while they are read are dropped
+    static std::vector<std::pair<uint32_t, Event>> events() {
+        std::vector<std::pair<uint32_t, Event>> events;
+        std::lock_guard<std::mutex> lock(registryMutex());
+        for(auto& buffer : buffers()) {
+            uint64_t head = buffer->head.load(std::memory_order_acquire);
+            uint64_t first = head > BUFFER_SIZE ? head - BUFFER_SIZE : 0;
+            size_t begin = events.size();
+            for(uint64_t i = first; i < head; ++i)
+                events.emplace_back(buffer->threadId, buffer->events[i & (BUFFER_SIZE - 1)]);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            // the writer may have overwritten the oldest events meanwhile
+            uint64_t newHead = buffer->head.load(std::memory_order_relaxed);
+            uint64_t valid = newHead >= BUFFER_SIZE ? newHead - BUFFER_SIZE + 1 : 0;
+            if(valid > first)
+                events.erase(events.begin() + begin, events.begin() + begin + std::min<uint64_t>(valid - first, head - first));
+        }
+        return events;
+    }
+
+    // forgets the recorded events, must not be called while other threads record
+    static void clear() {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        for(auto& buffer : buffers())
+            buffer->head.store(0, std::memory_order_relaxed);
+    }
+
+    // chrome trace_event JSON
+    static std::string toChromeTrace() {
+        double ticksPerUs = euluna_tools::cpu_cycles_per_ns() * 1000.0;
+        std::string out = "{\"traceEvents\":[";
+        bool first = true;
+        for(auto& it : events()) {
+            const Event& event = it.second;
+            out += euluna_tools::format("%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}",
+                                        first ? "" : ",", escape(event.name), event.category,
+                                        event.start / ticksPerUs, event.duration / ticksPerUs, (int)getpid(), it.first);
+            first = false;
+        }
+        out += "\n],\"displayTimeUnit\":\"ns\"}\n";
+        return out;
+    }
+
+    static bool writeChromeTrace(const std::string& fileName) {
+        std::string text = toChromeTrace();
+        return euluna_tools::write_file_atomic(fileName, text.data(), text.size());
+    }
+
+private:
+    struct ThreadBuffer {
+        uint32_t threadId;
+        std::atomic<uint64_t> head{0};
+        std::vector<Event> events;
+    };
+
+    static ThreadBuffer *threadBuffer() {
+        // buffers outlive their threads, so the events of finished threads can still be written
+        static thread_local ThreadBuffer *buffer = nullptr;
+        if(!buffer) {
+            std::shared_ptr<ThreadBuffer> newBuffer = std::make_shared<ThreadBuffer>();
+            newBuffer->events.resize(BUFFER_SIZE);
+            std::lock_guard<std::mutex> lock(registryMutex());
+            newBuffer->threadId = buffers().size() + 1;
+            buffers().push_back(newBuffer);
+            buffer = newBuffer.get();
+        }
+        return buffer;
+    }
+
+    static std::vector<std::shared_ptr<ThreadBuffer>>& buffers() {
+        static std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+        return buffers;
+    }
+    static std::mutex& registryMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+    static std::atomic<bool>& enabledFlag() {
+        static std::atomic<bool> enabled{true};
+        return enabled;
+    }
+
+    static std::string escape(const char *str) {
+        std::string escaped;
+        for(; *str; ++str) {
+            unsigned char c = *str;
+            if(c == '"' || c == '\\') {
+                escaped += '\\';
+                escaped += c;
+            } else if(c < 0x20)
+                escaped += euluna_tools::format("\\u%04x", (int)c);
+            else
+                escaped += c;
+        }
+        return escaped;
+    }
+};
+
+// records a complete event for the lifetime of the scope
+class EulunaTraceScope {
+public:
+    EulunaTraceScope(const char *name, const char *category) : m_name(name), m_category(category), m_start(EulunaTracer::now()) { }
+    ~EulunaTraceScope() { EulunaTracer::record(m_name, m_category, m_start, EulunaTracer::now() - m_start); }
+
+    EulunaTraceScope(const EulunaTraceScope&) = delete;
+    EulunaTraceScope& operator=(const EulunaTraceScope&) = delete;
+
+private:
+    const char *m_name;
+    const char *m_category;
+    uint64_t m_start;
+};
+
+#define EULUNA_TRACE_CONCAT_(a,b) a##b
+#define EULUNA_TRACE_CONCAT(a,b) EULUNA_TRACE_CONCAT_(a,b)
+
+// trace macros, they compile to nothing unless EULUNA_TRACE is defined
+#ifdef EULUNA_TRACE
+#define EULUNA_TRACE_SCOPE(name,category) EulunaTraceScope EULUNA_TRACE_CONCAT(__euluna_trace_scope_, __LINE__)(name, category)
+#define EULUNA_TRACE_BEGIN(var) uint64_t var = EulunaTracer::now()
+#define EULUNA_TRACE_END(var,name,category) EulunaTracer::record(name, category, var, EulunaTracer::now() - var)
+#else
+#define EULUNA_TRACE_SCOPE(name,category)
+#define EULUNA_TRACE_BEGIN(var)
+#define EULUNA_TRACE_END(var,name,category)
+#endif
+
+#endif // EULUNATRACE_HPP
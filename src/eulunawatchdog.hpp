@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2016 Euluna <https://github.com/edubart/euluna>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef EULUNAWATCHDOG_HPP
+#define EULUNAWATCHDOG_HPP
+
+#include "eulunaprereqs.hpp"
+#include "eulunatools.hpp"
+#include "eulunaexception.hpp"
+#include "eulunahook.hpp"
+
+// Limits the instructions and the time used by lua calls made while it exists,
+// calls exceeding the budget fail with EulunaBudgetExceededError
+class EulunaWatchdog {
+public:
+    // zero limits are disabled, the budget is checked every hookInterval instructions
+    EulunaWatchdog(lua_State *L, std::chrono::microseconds timeLimit, uint64_t instructionLimit = 0, int hookInterval = 1000) :
+        L(L), m_timeLimit(timeLimit), m_instructionLimit(instructionLimit), m_hookInterval(std::max(hookInterval, 1)) {
+        // without budget there is nothing to check, so no hook slows down the calls
+        if(m_timeLimit.count() <= 0 && m_instructionLimit == 0)
+            return;
+        lua_rawgetp(L, LUA_REGISTRYINDEX, watchdogKey());
+        bool hasWatchdog = !lua_isnil(L, -1);
+        lua_pop(L, 1);
+        if(hasWatchdog)
+            throw EulunaEngineError("Unable to set an execution budget because the lua state already has a watchdog");
+        m_deadline = std::chrono::steady_clock::now() + m_timeLimit;
+        EulunaHookDispatcher::add(L, this, &EulunaWatchdog::hook, m_hookInterval);
+        lua_pushlightuserdata(L, this);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, watchdogKey());
+        m_installed = true;
+    }
+    EulunaWatchdog(EulunaInterface *lua, std::chrono::microseconds timeLimit, uint64_t instructionLimit = 0, int hookInterval = 1000);
+
+    ~EulunaWatchdog() {
+        if(!m_installed)
+            return;
+        EulunaHookDispatcher::remove(L, this);
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, watchdogKey());
+    }
+
+    EulunaWatchdog(const EulunaWatchdog&) = delete;
+    EulunaWatchdog& operator=(const EulunaWatchdog&) = delete;
+
+    bool isTripped() const { return m_tripped; }
+    // instructions executed while the watchdog exists, rounded to the hook interval
+    uint64_t getInstructionCount() const { return m_instructionCount; }
+
+    // whether the lua state has a watchdog whose budget was exceeded
+    static bool isTripped(lua_State *L) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, watchdogKey());
+        EulunaWatchdog *watchdog = static_cast<EulunaWatchdog*>(lua_touserdata(L, -1));
+        lua_pop(L, 1);
+        return watchdog && watchdog->m_tripped;
+    }
+
+private:
+    static void* watchdogKey() {
+        static char key;
+        return &key;
+    }
+
+    static void hook(void *client, lua_State *L, uint64_t instructions) {
+        EulunaWatchdog *watchdog = static_cast<EulunaWatchdog*>(client);
+        watchdog->m_instructionCount += instructions;
+        if(watchdog->m_escalated)
+            ; // the script caught the errors to keep running, now every instruction fails
+        else if(watchdog->m_instructionLimit > 0 && watchdog->m_instructionCount - watchdog->m_budgetStart >= watchdog->m_instructionLimit)
+            watchdog->m_reason = euluna_tools::format("instruction budget of %" PRIu64 " exceeded", watchdog->m_instructionLimit);
+        else if(watchdog->m_timeLimit.count() > 0 && std::chrono::steady_clock::now() >= watchdog->m_deadline)
+            watchdog->m_reason = euluna_tools::format("time budget of %" PRId64 "us exceeded", (int64_t)watchdog->m_timeLimit.count());
+        else
+            return;
+        if(!watchdog->m_tripped) {
+            // the error is raised once and the budget restarts, so error handlers and __gc metamethods can run
+            watchdog->m_tripped = true;
+            watchdog->m_budgetStart = watchdog->m_instructionCount;
+            watchdog->m_deadline = std::chrono::steady_clock::now() + watchdog->m_timeLimit;
+        } else if(!watchdog->m_escalated) {
+            // the grace budget ran out too
+            watchdog->m_escalated = true;
+            EulunaHookDispatcher::setInterval(L, watchdog, 1);
+        }
+        luaL_error(L, "%s", watchdog->m_reason.c_str());
+    }
+
+    lua_State *L;
+    std::chrono::microseconds m_timeLimit;
+    uint64_t m_instructionLimit;
+    int m_hookInterval;
+    std::chrono::steady_clock::time_point m_deadline;
+    uint64_t m_instructionCount = 0;
+    uint64_t m_budgetStart = 0;
+    std::string m_reason;
+    bool m_tripped = false;
+    bool m_escalated = false;
+    bool m_installed = false;
+};
+
+#endif // EULUNAWATCHDOG_HPP
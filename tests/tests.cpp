@@ -1,6 +1,7 @@
 #include <gtest/gtest.h>
 #include "../src/euluna.hpp"
 #include <iostream>
+#include <dirent.h>
 
 EulunaBinder& g_binder = EulunaBinder::instance();
 EulunaEngine& g_lua = EulunaEngine::instance();
@@ -448,3 +449,1393 @@ TEST(Euluna, CallLuaFunctions) {
 
 //////////////////////
 
+static std::string makeTempDir() {
+    char dir[] = "/tmp/eulunatestXXXXXX";
+    EXPECT_TRUE(mkdtemp(dir) != nullptr);
+    return dir;
+}
+
+static size_t countFiles(const std::string& dirName) {
+    size_t count = 0;
+    if(DIR *dir = opendir(dirName.c_str())) {
+        while(struct dirent *entry = readdir(dir)) {
+            if(entry->d_name[0] != '.')
+                count++;
+        }
+        closedir(dir);
+    }
+    return count;
+}
+
+static void writeFile(const std::string& fileName, const std::string& content) {
+    EXPECT_TRUE(euluna_tools::write_file_atomic(fileName, content.data(), content.size()));
+}
+
+TEST(Euluna, WriteFileAtomic) {
+    std::string dir = makeTempDir();
+    std::string fileName = dir + "/shared.txt";
+    // threads writing the same file each leave a complete content
+    std::vector<std::thread> writers;
+    for(int i = 0; i < 4; ++i) {
+        writers.emplace_back([fileName, i] {
+            std::string content(64 * 1024, (char)('a' + i));
+            for(int j = 0; j < 50; ++j)
+                EXPECT_TRUE(euluna_tools::write_file_atomic(fileName, content.data(), content.size()));
+        });
+    }
+    for(std::thread& writer : writers)
+        writer.join();
+    euluna_tools::mapped_file file(fileName);
+    ASSERT_TRUE(file.isOpen());
+    std::string content(file.data(), file.size());
+    ASSERT_EQ(content.size(), 64u * 1024);
+    EXPECT_EQ(content, std::string(content.size(), content[0]));
+    EXPECT_EQ(countFiles(dir), 1u);
+}
+
+TEST(Euluna, RunScript) {
+    std::string dir = makeTempDir();
+    std::string script = dir + "/script.lua";
+    writeFile(script, "return 'hello ' .. 'script'");
+
+    EulunaEngine euluna;
+    EXPECT_EQ(euluna.runScript<std::string>(script), "hello script");
+    EXPECT_FALSE(euluna.hasError());
+    euluna.runScript(dir + "/missing.lua");
+    EXPECT_TRUE(euluna.hasError());
+    EXPECT_THROW(euluna.safeRunScript(dir + "/missing.lua"), EulunaFileError);
+    writeFile(script, "return +");
+    EXPECT_THROW(euluna.safeRunScript(script), EulunaSyntaxError);
+    EXPECT_EQ(euluna.stackSize(), 0);
+}
+
+TEST(Euluna, ScriptBytecodeCache) {
+    std::string dir = makeTempDir();
+    std::string script = dir + "/script.lua";
+    writeFile(script, "function cachedFunc() error('fail') end return 1");
+
+    EulunaEngine euluna;
+    EXPECT_TRUE(euluna.setScriptCacheDir(dir + "/cache"));
+    // cold load compiles and writes the cache entry
+    EXPECT_EQ(euluna.safeRunScript<int>(script), 1);
+    std::string cacheFile = euluna.getScriptCacheFile("@" + script);
+    EXPECT_TRUE(euluna_tools::mapped_file(cacheFile).isOpen());
+
+    // warm load uses the cached bytecode, keeping the original chunk name
+    EXPECT_EQ(euluna.safeRunScript<int>(script), 1);
+    euluna.callGlobal("cachedFunc");
+    EXPECT_NE(euluna.getLastError().find("script.lua:1:"), std::string::npos);
+
+    // corrupt cache entries fall back to the source
+    writeFile(cacheFile, "EULUNAC garbage");
+    EXPECT_EQ(euluna.safeRunScript<int>(script), 1);
+    std::string cache;
+    {
+        euluna_tools::mapped_file file(cacheFile);
+        cache.assign(file.data(), file.size());
+    }
+    cache[cache.size()-1] ^= 0xff;
+    writeFile(cacheFile, cache);
+    EXPECT_EQ(euluna.safeRunScript<int>(script), 1);
+
+    // changed sources are compiled again and replace their entry
+    writeFile(script, "return 2");
+    EXPECT_EQ(euluna.safeRunScript<int>(script), 2);
+    EXPECT_EQ(euluna.safeRunScript<int>(script), 2);
+    EXPECT_EQ(euluna.getScriptCacheFile("@" + script), cacheFile);
+
+    // a valid entry compiled from another source is not loaded
+    std::string other = dir + "/other.lua";
+    writeFile(other, "return 3");
+    EXPECT_EQ(euluna.safeRunScript<int>(other), 3);
+    {
+        euluna_tools::mapped_file file(euluna.getScriptCacheFile("@" + other));
+        cache.assign(file.data(), file.size());
+    }
+    writeFile(cacheFile, cache);
+    EXPECT_EQ(euluna.safeRunScript<int>(script), 2);
+
+    // dirs writable by other users are not used
+    EXPECT_EQ(mkdir((dir + "/shared").c_str(), 0777), 0);
+    EXPECT_EQ(chmod((dir + "/shared").c_str(), 0777), 0);
+    EXPECT_FALSE(euluna.setScriptCacheDir(dir + "/shared"));
+    EXPECT_EQ(euluna.getScriptCacheDir(), "");
+    EXPECT_EQ(euluna.stackSize(), 0);
+}
+
+TEST(Euluna, FunctionRef) {
+    EulunaEngine euluna;
+    euluna.runBuffer(R"(
+        counter = 0
+        function onThink(a, b) counter = counter + 1 return a + b end
+        events = { player = { onStep = function(s) return 'step ' .. s end } }
+    )");
+    EulunaFunctionRef onThink(&euluna, "onThink");
+    EulunaFunctionRef onStep(&euluna, "events.player.onStep", true);
+    EulunaFunctionRef missing(&euluna, "events.missing.onStep");
+    EXPECT_TRUE(onThink.isValid());
+    EXPECT_TRUE(onStep.isValid());
+    EXPECT_FALSE(missing.isValid());
+    for(int i = 0; i < 10; ++i)
+        EXPECT_EQ(onThink.call<int>(i, 1), i + 1);
+    EXPECT_EQ(euluna.runBuffer<int>("return counter"), 10);
+    EXPECT_EQ(onStep.call<std::string>("one"), "step one");
+    EXPECT_EQ(missing.call<int>(), 0);
+
+    // refs resolve again when new code is loaded
+    euluna.runBuffer(R"(
+        function onThink(a, b) return a * b end
+        events.player.onStep = function(s) return 'new step ' .. s end
+        function swap()
+            onThink = function(a, b) return a - b end
+            events.player.onStep = function(s) return 'swapped ' .. s end
+        end
+    )");
+    EXPECT_EQ(onThink.call<int>(2, 3), 6);
+    EXPECT_EQ(onStep.call<std::string>("two"), "new step two");
+
+    // only auto resolving refs see functions reassigned by lua code called since then
+    euluna.callGlobal("swap");
+    EXPECT_EQ(onThink.call<int>(2, 3), 6);
+    EXPECT_EQ(onStep.call<std::string>("two"), "swapped two");
+    onThink.resolve();
+    EXPECT_EQ(onThink.call<int>(2, 3), -1);
+
+    euluna.runBuffer("function onThink() error('fail') end");
+    onThink.resolve();
+    EXPECT_THROW(onThink.call(), EulunaRuntimeError);
+
+    // functions reassigned by lua code itself are picked up too
+    EulunaFunctionRef getVersion(&euluna, "getVersion", true);
+    EXPECT_FALSE(getVersion.isValid());
+    euluna.runBuffer(R"(
+        function getVersion() return 1 end
+        function upgrade() getVersion = function() return 2 end end
+    )");
+    EXPECT_EQ(getVersion.call<int>(), 1);
+    euluna.callGlobal("upgrade");
+    EXPECT_EQ(getVersion.call<int>(), 2);
+    euluna.callGlobal("upgrade");
+    EXPECT_EQ(getVersion.call<int>(), 2);
+    euluna.runBuffer("getVersion = nil");
+    EXPECT_FALSE(getVersion.isValid());
+    EXPECT_EQ(getVersion.call<int>(), 0);
+
+    EulunaFunctionRef moved(std::move(onStep));
+    EXPECT_FALSE(onStep.isValid());
+    EXPECT_EQ(moved.call<std::string>("three"), "swapped three");
+    EXPECT_EQ(euluna.stackSize(), 0);
+}
+
+TEST(Euluna, ErrorHandler) {
+    EulunaEngine euluna;
+    euluna.runBuffer("function fail() error('failed') end");
+    for(int i = 0; i < 3; ++i) {
+        euluna.callGlobal("fail");
+        EXPECT_NE(euluna.getLastError().find("failed"), std::string::npos);
+        EXPECT_NE(euluna.getLastError().find("stack traceback"), std::string::npos);
+    }
+    // the handler is shared by every interface of the same state
+    EulunaInterface lua(euluna.luaState());
+    euluna.pushErrorHandler();
+    lua.pushErrorHandler();
+    EXPECT_TRUE(lua_rawequal(euluna.luaState(), -1, -2));
+    euluna.pop();
+
+    // a released handler ref reused by another function is not taken for the handler
+    lua_State *L = euluna.luaState();
+    int slot = 0;
+    for(int i = 1; !slot && i < 1000; ++i) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, i);
+        if(lua_rawequal(L, -1, -2))
+            slot = i;
+        euluna.pop();
+    }
+    ASSERT_NE(slot, 0);
+    euluna.pop();
+    luaL_unref(L, LUA_REGISTRYINDEX, slot);
+    euluna.pushCFunction([](lua_State *L) { lua_pushstring(L, "not a traceback"); return 1; });
+    int reused = luaL_ref(L, LUA_REGISTRYINDEX);
+    EXPECT_EQ(reused, slot);
+    euluna.callGlobal("fail");
+    EXPECT_NE(euluna.getLastError().find("stack traceback"), std::string::npos);
+    euluna.unref(reused);
+    EXPECT_EQ(euluna.stackSize(), 0);
+}
+
+TEST(Euluna, MultipleReturns) {
+    EulunaEngine euluna;
+    euluna.runBuffer(R"(
+        function divmod(a, b) return math.floor(a / b), a % b, 'ok' end
+        function onlyone() return 1 end
+        lib = { divmod = divmod }
+    )");
+    typedef std::tuple<int,int,std::string> Rets;
+    EXPECT_EQ(euluna.callGlobal<Rets>("divmod", 7, 2), Rets(3, 1, "ok"));
+    EXPECT_EQ(euluna.callGlobalField<Rets>("lib", "divmod", 9, 4), Rets(2, 1, "ok"));
+    EulunaFunctionRef divmod(&euluna, "lib.divmod");
+    EXPECT_EQ(divmod.call<Rets>(5, 5), Rets(1, 0, "ok"));
+    // missing results are nil
+    EXPECT_EQ((euluna.callGlobal<std::tuple<int,int>>("onlyone")), std::make_tuple(1, 0));
+    EXPECT_THROW((euluna.safeCallGlobal<std::tuple<int,int,int>>("divmod", 1, 1)), EulunaRuntimeError);
+    EXPECT_EQ(euluna.stackSize(), 0);
+}
+
+////////////////////
+std::promise<int> g_asyncPromise;
+
+std::future<int> asyncValue() {
+    g_asyncPromise = std::promise<int>();
+    return g_asyncPromise.get_future();
+}
+
+std::future<std::string> asyncFail() {
+    return std::async(std::launch::deferred, []() -> std::string { throw EulunaEngineError("lookup failed"); });
+}
+
+EULUNA_BEGIN_GLOBAL_FUNCTIONS(asyncglobals)
+EULUNA_FUNC(asyncValue)
+EULUNA_FUNC(asyncFail)
+EULUNA_END()
+
+TEST(Euluna, AsyncCalls) {
+    EulunaEngine euluna;
+    EulunaBinder::registerGlobalBindings(&euluna);
+    euluna.runBuffer(R"(
+        function handler(mul)
+            local v = asyncValue()
+            result = v * mul
+        end
+        function failing()
+            local v, err = asyncFail()
+            failure = err
+        end
+        function broken()
+            asyncValue()
+            error('broken')
+        end
+    )");
+    EXPECT_TRUE(euluna.safeCallGlobalAsync("handler", 2));
+    EXPECT_EQ(euluna.safePollAsync(), 1u);
+    g_asyncPromise.set_value(21);
+    EXPECT_EQ(euluna.safePollAsync(), 0u);
+    EXPECT_EQ(euluna.runBuffer<int>("return result"), 42);
+
+    // futures that throw return nil plus the error
+    EXPECT_TRUE(euluna.safeCallGlobalAsync("failing"));
+    EXPECT_EQ(euluna.safePollAsync(), 0u);
+    EXPECT_NE(euluna.runBuffer<std::string>("return failure").find("lookup failed"), std::string::npos);
+
+    // errors after resuming are reported by poll
+    EXPECT_TRUE(euluna.callGlobalAsync("broken"));
+    g_asyncPromise.set_value(0);
+    EXPECT_EQ(euluna.pollAsync(), 0u);
+    EXPECT_NE(euluna.getLastError().find("broken"), std::string::npos);
+
+    // plain yields wait for the next poll
+    EXPECT_TRUE(euluna.safeRunBufferAsync("coroutine.yield() yielded = true"));
+    EXPECT_EQ(euluna.safePollAsync(), 0u);
+    EXPECT_TRUE(euluna.runBuffer<bool>("return yielded"));
+
+    // awaiting outside async calls is an error
+    euluna.runBuffer("asyncValue()");
+    EXPECT_NE(euluna.getLastError().find("outside of an async call"), std::string::npos);
+
+    // coroutines are reused
+    EulunaScheduler& scheduler = euluna.getScheduler();
+    size_t created = scheduler.getCreatedCount();
+    for(int i = 0; i < 100; ++i)
+        EXPECT_FALSE(euluna.safeRunBufferAsync("local a = 1"));
+    EXPECT_EQ(scheduler.getCreatedCount(), created);
+    EXPECT_EQ(euluna.stackSize(), 0);
+}
+
+TEST(Euluna, EnginePool) {
+    EulunaEnginePool pool(4, [](EulunaEngine* euluna) {
+        euluna->runBuffer("counter = 0 function square(x) counter = counter + 1 return x * x end");
+    });
+    EXPECT_EQ(pool.size(), 4u);
+    EXPECT_EQ(pool.currentEngine(), nullptr);
+
+    std::vector<std::future<int>> results;
+    for(int i = 0; i < 100; ++i)
+        results.push_back(pool.submit([i](EulunaEngine* euluna) { return euluna->callGlobal<int>("square", i); }));
+    for(int i = 0; i < 100; ++i)
+        EXPECT_EQ(results[i].get(), i * i);
+
+    // jobs with the same key share the same lua state
+    std::vector<std::future<void>> pinned;
+    for(int i = 0; i < 10; ++i)
+        pinned.push_back(pool.submit(7, [](EulunaEngine* euluna) { euluna->runBuffer("pinned = (pinned or 0) + 1"); }));
+    for(auto& future : pinned)
+        future.get();
+    EXPECT_EQ(pool.submit(7, [](EulunaEngine* euluna) { return euluna->runBuffer<int>("return pinned"); }).get(), 10);
+
+    std::atomic<int> total(0);
+    pool.broadcast([&](EulunaEngine* euluna) { total += euluna->runBuffer<int>("return counter"); });
+    EXPECT_EQ(total, 100);
+
+    // exceptions are forwarded through the futures
+    auto failed = pool.submit([](EulunaEngine* euluna) { euluna->safeRunBuffer("error('job failed')"); });
+    EXPECT_THROW(failed.get(), EulunaRuntimeError);
+
+    // bootstrap errors are reported by the constructor
+    EXPECT_THROW(EulunaEnginePool(2, [](EulunaEngine* euluna) { euluna->safeRunBuffer("error('bad bootstrap')"); }), EulunaRuntimeError);
+}
+
+TEST(Euluna, StatePool) {
+    EulunaStatePool pool([](EulunaEngine* euluna) {
+        euluna->runBuffer(R"(
+            config = { limit = 10, nested = { deep = { value = 1 } } }
+            config.nested.deep.root = config
+            local count = 0
+            function counter() count = count + 1 return count end
+            function limit() return config.limit end
+        )");
+    });
+    pool.prewarm(2);
+    EXPECT_EQ(pool.getIdleCount(), 2u);
+    EXPECT_EQ(pool.getCreatedCount(), 2u);
+
+    lua_State *L;
+    {
+        EulunaStatePool::Lease euluna = pool.acquire();
+        L = euluna->luaState();
+        EXPECT_TRUE(euluna->hasCheckpoint());
+        euluna->runBuffer(R"(
+            config.limit = 20
+            config.extra = true
+            requestData = {}
+            string.custom = function() end
+            function limit() return -1 end
+            config.nested.deep.value = 2
+            config.nested.deep.extra = {}
+            counter() counter()
+        )");
+        EXPECT_EQ(euluna->callGlobal<int>("limit"), -1);
+        EulunaFunctionRef ref(euluna.get(), "limit");
+        EXPECT_EQ(ref.call<int>(), -1);
+        EXPECT_TRUE(euluna->runBufferAsync("coroutine.yield()"));
+    }
+    EXPECT_EQ(pool.getIdleCount(), 2u);
+
+    // the released state is reused and restored
+    EulunaStatePool::Lease euluna = pool.acquire();
+    EXPECT_EQ(euluna->luaState(), L);
+    EXPECT_EQ(euluna->callGlobal<int>("limit"), 10);
+    EXPECT_FALSE(euluna->runBuffer<bool>("return config.extra"));
+    EXPECT_TRUE(euluna->runBuffer<bool>("return requestData == nil and string.custom == nil"));
+    // nested tables of any depth, cycles and upvalues are restored too
+    EXPECT_EQ(euluna->runBuffer<int>("return config.nested.deep.value"), 1);
+    EXPECT_TRUE(euluna->runBuffer<bool>("return config.nested.deep.extra == nil and config.nested.deep.root == config"));
+    EXPECT_EQ(euluna->callGlobal<int>("counter"), 1);
+
+    // registry refs taken after the reset still work
+    EulunaFunctionRef ref(euluna.get(), "limit");
+    EXPECT_EQ(ref.call<int>(), 10);
+    EXPECT_EQ(pool.getCreatedCount(), 2u);
+
+    EulunaEngine fresh;
+    EXPECT_THROW(fresh.resetToCheckpoint(), EulunaEngineError);
+
+    // values of the caller are kept on the stack
+    fresh.pushInteger(42);
+    fresh.checkpoint();
+    EXPECT_EQ(fresh.stackSize(), 1);
+    EXPECT_EQ(fresh.toInteger(), 42);
+    fresh.resetToCheckpoint();
+    EXPECT_EQ(fresh.stackSize(), 0);
+}
+
+TEST(Euluna, StateResetMetatables) {
+    EulunaEngine euluna;
+    euluna.runBuffer(R"(
+        local mt = { __index = function() return 'default' end }
+        config = setmetatable({}, mt)
+        function configMetatable() return mt end
+    )");
+    euluna.checkpoint();
+    euluna.runBuffer(R"(
+        setmetatable(_G, { __index = function() return 'leaked' end })
+        setmetatable(string, { __index = function() return 'leaked' end })
+        setmetatable(config, { __index = function() return 'replaced' end })
+    )");
+    EXPECT_EQ(euluna.runBuffer<std::string>("return undefinedGlobal"), "leaked");
+    euluna.resetToCheckpoint();
+    EXPECT_TRUE(euluna.runBuffer<bool>("return getmetatable(_G) == nil and undefinedGlobal == nil"));
+    EXPECT_TRUE(euluna.runBuffer<bool>("return getmetatable(string) == nil and string.undefined == nil"));
+    EXPECT_TRUE(euluna.runBuffer<bool>("return getmetatable(config) == configMetatable() and config.missing == 'default'"));
+
+    // removed metatables come back too
+    euluna.runBuffer("setmetatable(config, nil)");
+    euluna.resetToCheckpoint();
+    EXPECT_EQ(euluna.runBuffer<std::string>("return config.missing"), "default");
+    EXPECT_EQ(euluna.stackSize(), 0);
+}
+
+#if LUA_VERSION_NUM < 502
+TEST(Euluna, StateResetEnvironments) {
+    EulunaEngine euluna;
+    euluna.runBuffer(R"(
+        sandbox = { value = 'sandboxed' }
+        function global() return value end
+        sandboxed = setfenv(function() return value end, sandbox)
+        value = 'global'
+    )");
+    euluna.checkpoint();
+    euluna.runBuffer(R"(
+        setfenv(global, { value = 'replaced' })
+        setfenv(sandboxed, _G)
+        sandbox.value = 'changed'
+    )");
+    EXPECT_EQ(euluna.callGlobal<std::string>("global"), "replaced");
+    EXPECT_EQ(euluna.callGlobal<std::string>("sandboxed"), "global");
+    euluna.resetToCheckpoint();
+    EXPECT_EQ(euluna.callGlobal<std::string>("global"), "global");
+    EXPECT_EQ(euluna.callGlobal<std::string>("sandboxed"), "sandboxed");
+    EXPECT_TRUE(euluna.runBuffer<bool>("return getfenv(global) == _G and getfenv(sandboxed) == sandbox"));
+    EXPECT_EQ(euluna.stackSize(), 0);
+}
+#endif
+
+static int lazyAdd(int a, int b) { return a + b; }
+
+TEST(Euluna, LazyBindings) {
+    EulunaEngine euluna;
+    EulunaBinder::registerGlobalBindingsLazy(&euluna);
+    EXPECT_TRUE(euluna.runBuffer<bool>("return rawget(_G, 'Rectangle') == nil and rawget(_G, 'Polygon') == nil"));
+    EXPECT_TRUE(euluna.runBuffer<bool>("return rawget(_G, 'concat') == nil and rawget(_G, 'mathex') == nil"));
+
+    // classes are created on first access, together with their base classes
+    EXPECT_EQ(euluna.runBuffer<float>("local a = Rectangle.new(); a:setValues(2,3); return a:getArea()"), 6.0f);
+    EXPECT_TRUE(euluna.runBuffer<bool>("return rawget(_G, 'Polygon') ~= nil and rawget(_G, 'Triangle') == nil"));
+    EXPECT_EQ(euluna.runBuffer<double>("return mathex.lerp(0,10,0.5)"), 5.0);
+    EXPECT_EQ(euluna.runBuffer<std::string>("return concat('hello',' world!')"), "hello world!");
+    EXPECT_TRUE(euluna.runBuffer<bool>("return undefinedGlobal == nil"));
+
+    // or when an object of the class is pushed
+    Triangle *triangle = new Triangle;
+    triangle->setValues(2, 3);
+    euluna.pushObject(triangle);
+    euluna.setGlobal("triangle");
+    EXPECT_EQ(euluna.runBuffer<float>("return triangle:getArea()"), 3.0f);
+    euluna.runBuffer("triangle = nil");
+    euluna.collect();
+    EXPECT_FALSE(euluna.hasError());
+    EXPECT_EQ(euluna.stackSize(), 0);
+
+    // lazy bindings can't replace another globals metatable
+    EulunaEngine strict;
+    strict.runBuffer("setmetatable(_G, { __index = function() error('undefined global') end })");
+    EXPECT_THROW(EulunaBinder::registerGlobalBindingsLazy(&strict), EulunaEngineError);
+
+    // the hook is removed once every name was registered
+    EulunaBinder few;
+    few.globals().def("lazyOne", lazyAdd);
+    few.globals().def("lazyTwo", lazyAdd);
+    EulunaEngine small;
+    few.registerBindingsLazy(&small);
+    EXPECT_EQ(small.runBuffer<int>("return lazyOne(1, 1)"), 2);
+    EXPECT_TRUE(small.runBuffer<bool>("return getmetatable(_G).__index ~= nil"));
+    EXPECT_EQ(small.runBuffer<int>("return lazyTwo(2, 2)"), 4);
+    EXPECT_TRUE(small.runBuffer<bool>("return getmetatable(_G) == nil and undefinedGlobal == nil"));
+    EXPECT_EQ(small.stackSize(), 0);
+
+    // states keep resolving names while other states are hooked with an index rebuilt for new binders
+    EulunaBinder binder;
+    binder.globals().def("lazyFirst", lazyAdd);
+    // never accessed, so the hook of the first state stays
+    binder.globals().def("lazyUnused", lazyAdd);
+    EulunaEngine first;
+    binder.registerBindingsLazy(&first);
+    std::thread reader([&] {
+        for(int i = 0; i < 200; ++i) {
+            first.runBuffer("lazyFirst = nil");
+            EXPECT_EQ(first.runBuffer<int>("return lazyFirst(1, 2)"), 3);
+        }
+    });
+    binder.globals().def("lazySecond", lazyAdd);
+    for(int i = 0; i < 20; ++i) {
+        EulunaEngine second;
+        binder.registerBindingsLazy(&second);
+        EXPECT_EQ(second.runBuffer<int>("return lazySecond(2, 2)"), 4);
+    }
+    reader.join();
+    EXPECT_TRUE(first.runBuffer<bool>("return lazySecond == nil"));
+}
+
+TEST(Euluna, GcControl) {
+    euluna_tools::log_histogram histogram;
+    for(uint64_t v : {0, 1, 2, 3, 100, 1000})
+        histogram.record(v);
+    EXPECT_EQ(histogram.count(), 6u);
+    EXPECT_EQ(histogram.max(), 1000u);
+    EXPECT_EQ(histogram.bucket_count(euluna_tools::log_histogram::bucket_of(3)), 2u);
+    EXPECT_EQ(histogram.percentile(0.5), 3u);
+    EXPECT_EQ(histogram.percentile(1.0), 1000u);
+
+    EulunaEngine euluna;
+    euluna.setGcRunning(false);
+    EXPECT_EQ(euluna.setGcPause(150), 200);
+    EXPECT_EQ(euluna.setGcPause(200), 150);
+    EXPECT_EQ(euluna.setGcStepMul(400), 200);
+#if LUA_VERSION_NUM >= 504
+    EXPECT_TRUE(euluna.setGcGenerational(true));
+    EXPECT_TRUE(euluna.setGcGenerational(false));
+#else
+    EXPECT_FALSE(euluna.setGcGenerational(true));
+#endif
+
+    euluna.runBuffer("garbage = {} for i=1,20000 do garbage[i] = { i } end garbage = nil");
+    size_t before = euluna.gcMemoryUsage();
+    int slices = 0;
+    while(!euluna.gcStep(std::chrono::microseconds(100)))
+        slices++;
+    EXPECT_LT(euluna.gcMemoryUsage(), before);
+    EXPECT_TRUE(euluna.gcStepBytes(1 << 20));
+
+    const EulunaGcStats& stats = euluna.getGcStats();
+    EXPECT_GE(stats.cycles, 2u);
+    EXPECT_GT(stats.stepDurations.count(), 0u);
+    EXPECT_EQ(stats.heapTrend.size(), (size_t)slices + 2);
+    EXPECT_EQ(stats.toJson().find("{\"steps\":"), 0u);
+    euluna.resetGcStats();
+    EXPECT_EQ(euluna.getGcStats().stepDurations.count(), 0u);
+}
+
+TEST(Euluna, Allocator) {
+    EulunaPoolAllocator *allocator = new EulunaPoolAllocator;
+    {
+        EulunaEngine euluna{std::unique_ptr<EulunaAllocator>(allocator)};
+        EXPECT_EQ(euluna.getAllocator(), allocator);
+        EXPECT_EQ(allocator->getLiveBytes(), euluna.gcMemoryUsage());
+
+        euluna.runBuffer("t = {} for i=1,10000 do t[i] = { i, tostring(i) } end");
+        size_t live = allocator->getLiveBytes();
+        EXPECT_EQ(live, euluna.gcMemoryUsage());
+        EXPECT_GE(allocator->getPeakBytes(), live);
+        EXPECT_GT(allocator->getReservedBytes(), 0u);
+        euluna.runBuffer("t = nil");
+        euluna.collect();
+        EXPECT_LT(allocator->getLiveBytes(), live);
+        EXPECT_GE(allocator->getPeakBytes(), live);
+
+        // allocations above the limit fail with memory errors
+        allocator->setMemoryLimit(allocator->getLiveBytes() + 64 * 1024);
+        EXPECT_THROW(euluna.safeRunBuffer("local t = {} for i=1,100000 do t[i] = { i } end"), EulunaMemoryError);
+        EXPECT_LE(allocator->getLiveBytes(), allocator->getMemoryLimit());
+        euluna.collect();
+        EXPECT_EQ(euluna.runBuffer<int>("return 1 + 1"), 2);
+        allocator->setMemoryLimit(0);
+        euluna.runBuffer("local t = {} for i=1,100000 do t[i] = { i } end");
+        EXPECT_FALSE(euluna.hasError());
+    }
+}
+
+TEST(Euluna, Watchdog) {
+    EulunaEngine euluna;
+    euluna.runBuffer(R"(
+        function forever() while true do end end
+        function catching() while true do pcall(forever) end end
+        function quick(n) local s = 0 for i=1,n do s = s + i end return s end
+    )");
+
+    {
+        EulunaWatchdog watchdog(&euluna, std::chrono::microseconds(0), 100000);
+        EXPECT_THROW(euluna.safeCallGlobal("forever"), EulunaBudgetExceededError);
+        EXPECT_TRUE(watchdog.isTripped());
+        EXPECT_GE(watchdog.getInstructionCount(), 100000u);
+    }
+    {
+        // scripts catching the error still stop
+        EulunaWatchdog watchdog(&euluna, std::chrono::milliseconds(20));
+        EXPECT_THROW(euluna.safeCallGlobal("catching"), EulunaBudgetExceededError);
+    }
+    {
+        EulunaWatchdog watchdog(&euluna, std::chrono::seconds(10), 1000000);
+        EXPECT_EQ(euluna.safeCallGlobal<int>("quick", 100), 5050);
+        EXPECT_FALSE(watchdog.isTripped());
+        EXPECT_THROW(EulunaWatchdog(&euluna, std::chrono::seconds(1)), EulunaEngineError);
+    }
+    {
+        // the error is raised once, so handlers can run before the script is stopped
+        EulunaWatchdog watchdog(&euluna, std::chrono::microseconds(0), 100000);
+        EXPECT_EQ(euluna.safeRunBuffer<std::string>("local ok = pcall(forever) local t = {} for i=1,100 do t[i] = i end return 'handled ' .. #t"),
+                  "handled 100");
+        EXPECT_TRUE(watchdog.isTripped());
+    }
+    {
+        // coroutines pooled before the watchdog existed are interrupted too
+        EXPECT_FALSE(euluna.safeRunBufferAsync("local a = 1"));
+        EulunaWatchdog watchdog(&euluna, std::chrono::milliseconds(20));
+        EXPECT_THROW(euluna.safeRunBufferAsync("while true do end"), EulunaBudgetExceededError);
+        EXPECT_FALSE(euluna.safeRunBufferAsync("local a = 1"));
+    }
+    // the hook is removed with the watchdog, also from the pooled coroutines when they are resumed
+    EXPECT_EQ(lua_gethook(euluna.luaState()), nullptr);
+    EXPECT_THROW(euluna.safeRunBuffer("error('plain')"), EulunaRuntimeError);
+    EXPECT_FALSE(euluna.safeRunBufferAsync("for i=1,100000 do end"));
+    {
+        EulunaWatchdog watchdog(&euluna, std::chrono::microseconds(0));
+        EXPECT_EQ(lua_gethook(euluna.luaState()), nullptr);
+    }
+    EXPECT_EQ(euluna.stackSize(), 0);
+}
+
+TEST(Euluna, ScriptReloader) {
+    std::string dir = makeTempDir();
+    std::string quest = dir + "/quest.lua";
+    std::string other = dir + "/other.lua";
+    writeFile(quest, R"(
+        local M = { counter = 0 }
+        quest = M
+        function M.step() M.counter = M.counter + 1 return M.counter end
+        function M.removed() end
+        return M
+    )");
+    writeFile(other, "otherLoads = (otherLoads or 0) + 1");
+
+    EulunaEngine euluna;
+    euluna.setScriptCacheDir(dir + "/cache");
+    EulunaScriptReloader reloader(&euluna);
+    EXPECT_TRUE(reloader.watchScript(quest));
+    EXPECT_TRUE(reloader.watchScript(other));
+    EXPECT_FALSE(reloader.watchScript(dir + "/missing.lua"));
+    EXPECT_EQ(reloader.getWatchedCount(), 2u);
+    EXPECT_EQ(reloader.poll(), 0u);
+
+    EulunaFunctionRef step(&euluna, "quest.step", true);
+    EulunaFunctionRef plainStep(&euluna, "quest.step");
+    EXPECT_EQ(step.call<int>(), 1);
+    EXPECT_EQ(step.call<int>(), 2);
+
+    // functions are replaced while the module data is kept
+    writeFile(quest, R"(
+        local M = { counter = 0, added = 'new' }
+        quest = M
+        function M.step() M.counter = M.counter + 10 return M.counter end
+        return M
+    )");
+    EXPECT_EQ(reloader.poll(), 1u);
+    EXPECT_EQ(step.call<int>(), 12);
+    // refs resolved before the reload call the new functions too
+    EXPECT_EQ(plainStep.call<int>(), 22);
+    EXPECT_EQ(euluna.runBuffer<std::string>("return quest.added"), "new");
+    EXPECT_TRUE(euluna.runBuffer<bool>("return quest.removed == nil"));
+    EXPECT_EQ(euluna.runBuffer<int>("return otherLoads"), 1);
+
+    // broken scripts keep the old code
+    writeFile(quest, "local M = {");
+    EXPECT_EQ(reloader.poll(), 0u);
+    EXPECT_TRUE(reloader.hasError());
+    EXPECT_EQ(step.call<int>(), 32);
+
+    // reloaded scripts replace their bytecode cache entry
+    writeFile(other, "otherLoads = otherLoads + 10");
+    EXPECT_EQ(reloader.poll(), 1u);
+    EXPECT_EQ(euluna.runBuffer<int>("return otherLoads"), 11);
+    EXPECT_EQ(countFiles(dir + "/cache"), 2u);
+    EXPECT_EQ(reloader.getReloadCount(), 4u);
+    EXPECT_EQ(euluna.stackSize(), 0);
+}
+
+enum class FfiColor : uint8_t { Red, Green };
+enum class FfiMode { Fast, Safe };
+EULUNA_CHECKED_ENUM(FfiMode)
+static int ffiThrowing(int a) { if(a < 0) throw std::runtime_error("negative"); return a; }
+
+static double ffiLerp(double a, double b, double t) noexcept { return a + (b - a) * t; }
+static int32_t ffiAdd(int32_t a, int32_t b) noexcept { return a + b; }
+
+EULUNA_BEGIN_SINGLETON(ffiutil)
+EULUNA_FUNC_NAMED("checked", ffiThrowing)
+EULUNA_FUNC_NAMED("lerp", ffiLerp)
+EULUNA_FUNC_NAMED("add", ffiAdd)
+EULUNA_END()
+
+TEST(Euluna, FfiSignatures) {
+    // functions that may throw are never called through the FFI
+    typedef double(*Lerp)(double, double, double);
+    EXPECT_FALSE(euluna_ffi::signature<Lerp>::value);
+    EXPECT_FALSE(euluna_ffi::signature<decltype(&ffiThrowing)>::value);
+    EXPECT_FALSE((euluna_ffi::signature<int64_t(*)(int)>::value));
+    EXPECT_FALSE((euluna_ffi::signature<std::function<int()>>::value));
+#ifdef __cpp_noexcept_function_type
+    typedef double(*NoexceptLerp)(double, double, double) noexcept;
+    EXPECT_TRUE(euluna_ffi::signature<NoexceptLerp>::value);
+    EXPECT_EQ(euluna_ffi::signature<NoexceptLerp>::str(), "double(*)(double, double, double)");
+    EXPECT_EQ((euluna_ffi::signature<void(*)() noexcept>::str()), "void(*)()");
+    EXPECT_EQ((euluna_ffi::signature<bool(*)(int, unsigned short, float, FfiColor) noexcept>::str()), "bool(*)(int32_t, uint16_t, float, uint8_t)");
+    EXPECT_FALSE((euluna_ffi::signature<int64_t(*)(int) noexcept>::value));
+    EXPECT_FALSE((euluna_ffi::signature<int(*)(const std::string&) noexcept>::value));
+    EXPECT_FALSE((euluna_ffi::signature<Dummy*(*)() noexcept>::value));
+    // bools and checked enums are pulled with the lua C API rules
+    EXPECT_FALSE((euluna_ffi::signature<int(*)(bool) noexcept>::value));
+    EXPECT_FALSE((euluna_ffi::signature<int(*)(FfiMode) noexcept>::value));
+#endif
+
+    // with or without the FFI the bindings behave the same
+    EulunaEngine euluna;
+    EulunaBinder::registerGlobalBindings(&euluna);
+    EXPECT_EQ(euluna.safeRunBuffer<double>("local s = 0 for i=1,1000 do s = s + ffiutil.lerp(0, 10, 0.5) end return s"), 5000.0);
+    EXPECT_EQ(euluna.safeRunBuffer<int>("local s = 0 for i=1,1000 do s = ffiutil.add(s, i) end return s"), 500500);
+    EXPECT_EQ(euluna.safeRunBuffer<int>("return ffiutil.add(-2147483647, -1)"), INT32_MIN);
+    EXPECT_EQ(euluna.runBuffer<std::string>("return concat('a', 'b')"), "ab");
+    EXPECT_EQ(euluna.runBuffer<std::string>("return type(mathex.lerp)"), "function");
+#if defined(EULUNA_LUAJIT_FFI) && defined(__cpp_noexcept_function_type)
+    EXPECT_EQ(euluna.runBuffer<std::string>("return type(ffiutil.lerp)"), "cdata");
+    EXPECT_EQ(euluna.runBuffer<std::string>("return type(ffiutil.add)"), "cdata");
+#else
+    EXPECT_EQ(euluna.runBuffer<std::string>("return type(ffiutil.lerp)"), "function");
+#endif
+    // exceptions of bindings become lua errors on both paths
+    EXPECT_EQ(euluna.runBuffer<std::string>("return type(ffiutil.checked)"), "function");
+    EXPECT_NE(euluna.runBuffer<std::string>("return select(2, pcall(ffiutil.checked, -1))").find("negative"), std::string::npos);
+    EXPECT_EQ(euluna.stackSize(), 0);
+}
+
+TEST(Euluna, Signal) {
+    EulunaEngine euluna;
+    {
+        EulunaSignal<std::string, int> onLogin(&euluna, "onLogin");
+        euluna.safeRunBuffer(R"(
+            logins = {}
+            first = onLogin.connect(function(name, level) logins[#logins+1] = name .. level end)
+            second = onLogin.connect(function(name) error('bad listener') end)
+            third = onLogin.connect(function(name) logins[#logins+1] = 'third' onLogin.disconnect(third) end)
+        )");
+        EXPECT_EQ(onLogin.getListenerCount(), 3u);
+
+        // a failing listener does not stop the others
+        EXPECT_FALSE(onLogin.emit("bob", 10));
+        EXPECT_NE(onLogin.getLastError().find("bad listener"), std::string::npos);
+        EXPECT_EQ(euluna.runBuffer<int>("return #logins"), 2);
+        EXPECT_EQ(onLogin.getListenerCount(), 2u);
+        EXPECT_THROW(onLogin.safeEmit("bob", 10), EulunaRuntimeError);
+        EXPECT_TRUE(euluna.runBuffer<bool>("return onLogin.disconnect(second)"));
+        EXPECT_FALSE(euluna.runBuffer<bool>("return onLogin.disconnect(second)"));
+        EXPECT_TRUE(onLogin.emit("alice", 2));
+        EXPECT_EQ(euluna.runBuffer<std::string>("return logins[#logins]"), "alice2");
+
+        // duplicated posts are coalesced until the flush
+        onLogin.post("carl", 1);
+        onLogin.post("carl", 1);
+        onLogin.post("dave", 1);
+        EXPECT_EQ(onLogin.getPendingCount(), 2u);
+        EXPECT_TRUE(onLogin.flush());
+        EXPECT_EQ(onLogin.getPendingCount(), 0u);
+        EXPECT_EQ(euluna.runBuffer<int>("return #logins"), 6);
+        EXPECT_FALSE(euluna.runBuffer<bool>("return pcall(onLogin.connect, 1)"));
+        EXPECT_NE(euluna.runBuffer<std::string>("return select(2, pcall(onLogin.disconnect, 'x'))").find("number expected, got string"), std::string::npos);
+
+        // listeners keep their order while others are disconnected
+        euluna.safeRunBuffer(R"(
+            order = {}
+            ids = {}
+            for i=1,100 do ids[i] = onLogin.connect(function() order[#order+1] = i end) end
+            for i=1,100 do if i % 3 ~= 0 then assert(onLogin.disconnect(ids[i])) end end
+            assert(not onLogin.disconnect(ids[1]))
+        )");
+        EXPECT_EQ(onLogin.getListenerCount(), 34u);
+        EXPECT_TRUE(onLogin.emit("erin", 1));
+        EXPECT_TRUE(euluna.runBuffer<bool>("for j=1,#order do if order[j] ~= j * 3 then return false end end return #order == 33"));
+    }
+    // scripts keeping the table can no longer connect
+    EXPECT_TRUE(euluna.runBuffer<bool>("return onLogin == nil"));
+    {
+        EulunaSignal<int> onTick(&euluna, "onTick");
+        euluna.safeRunBuffer("connectTick, disconnectTick = onTick.connect, onTick.disconnect tickId = connectTick(function() end)");
+        EXPECT_EQ(onTick.getListenerCount(), 1u);
+    }
+    // nor the ones keeping its functions
+    EXPECT_THROW(euluna.safeRunBuffer("connectTick(function() end)"), EulunaRuntimeError);
+    EXPECT_NE(euluna.runBuffer<std::string>("return select(2, pcall(disconnectTick, tickId))").find("destroyed signal"), std::string::npos);
+    EXPECT_EQ(euluna.stackSize(), 0);
+}
+
+TEST(Euluna, CrossThreadCalls) {
+    EulunaEngine euluna;
+    euluna.safeRunBuffer(R"(
+        calls = 0
+        function add(a, b) calls = calls + 1 return a + b end
+        function fail() error('failed') end
+        weak = setmetatable({}, {__mode='v'})
+        weak.callback = function() end
+    )");
+    auto add = euluna.safeRunBuffer<std::function<int(int,int)>>("return add");
+    auto addAsync = euluna.safeRunBuffer<std::function<std::future<int>(int,int)>>("return add");
+    auto notify = euluna.safeRunBuffer<std::function<void(int,int)>>("return add");
+    auto fail = euluna.safeRunBuffer<std::function<std::future<void>()>>("return fail");
+    auto callback = euluna.safeRunBuffer<std::function<void()>>("return weak.callback");
+
+    // calls from the owner thread are made right away
+    EXPECT_EQ(add(1, 2), 3);
+    EXPECT_EQ(addAsync(2, 3).get(), 5);
+
+    // calls from other threads wait for the owner to drain them
+    std::future<int> result;
+    std::future<void> failed;
+    std::thread worker([&] {
+        result = addAsync(20, 22);
+        failed = fail();
+        notify(1, 1);
+        // the unref is deferred to the owner thread too
+        callback = nullptr;
+    });
+    worker.join();
+    euluna.gc(LUA_GCCOLLECT, 0);
+    EXPECT_FALSE(euluna.runBuffer<bool>("return weak.callback == nil"));
+    EXPECT_EQ(euluna.getCallQueue()->getPendingCount(), 4u);
+    EXPECT_EQ(euluna.drainCalls(1), 1u);
+    EXPECT_EQ(result.get(), 42);
+    EXPECT_EQ(euluna.drainCalls(), 3u);
+    EXPECT_THROW(failed.get(), EulunaRuntimeError);
+    EXPECT_EQ(euluna.runBuffer<int>("return calls"), 4);
+    euluna.gc(LUA_GCCOLLECT, 0);
+    EXPECT_TRUE(euluna.runBuffer<bool>("return weak.callback == nil"));
+
+    // callbacks with results can't wait for the owner from other threads, they must return futures
+    bool rejected = false;
+    std::thread other([&] {
+        try {
+            add(5, 5);
+        } catch(EulunaRuntimeError&) {
+            rejected = true;
+        }
+    });
+    other.join();
+    EXPECT_TRUE(rejected);
+    EXPECT_EQ(euluna.getCallQueue()->getPendingCount(), 0u);
+    EXPECT_EQ(euluna.runBuffer<int>("return calls"), 4);
+    EXPECT_EQ(euluna.stackSize(), 0);
+}
+
+TEST(Euluna, CallQueueClose) {
+    std::unique_ptr<EulunaEngine> euluna(new EulunaEngine);
+    std::shared_ptr<EulunaCallQueue> queue = euluna->getCallQueue()->shared_from_this();
+    std::vector<std::future<int>> futures;
+    std::mutex mutex;
+    std::atomic<bool> stop{false};
+    std::thread poster([&] {
+        while(!stop) {
+            auto promise = std::make_shared<std::promise<int>>();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                futures.push_back(promise->get_future());
+            }
+            queue->post([promise] { promise->set_value(1); });
+        }
+    });
+    while(queue->getPendingCount() < 100)
+        std::this_thread::yield();
+    // closing while the other thread keeps posting
+    euluna.reset();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    stop = true;
+    poster.join();
+
+    // tasks are dropped, whether they were queued before or after the close, so no future waits forever
+    for(auto& future : futures) {
+        ASSERT_EQ(future.wait_for(std::chrono::seconds(1)), std::future_status::ready);
+        EXPECT_THROW(future.get(), std::future_error);
+    }
+    EXPECT_EQ(queue->getPendingCount(), 0u);
+}
+
+TEST(Euluna, Channel) {
+    auto channel = std::make_shared<EulunaChannel>(4);
+    EulunaEngine producer;
+    EulunaEngine consumer;
+    channel->bind(&producer, "jobs");
+    channel->bind(&consumer, "jobs");
+    EXPECT_EQ(channel->capacity(), 4u);
+
+    // values are copied between the states
+    EXPECT_TRUE(producer.runBuffer<bool>("return jobs.send({ id = 1, name = 'job', tags = { true, false, 2.5 }, [10] = 'ten' })"));
+    EXPECT_TRUE(producer.runBuffer<bool>("return jobs.send(string.rep('x', 1024*1024))"));
+    EXPECT_EQ(producer.runBuffer<int>("return jobs.size()"), 2);
+    consumer.safeRunBuffer("ok, job = jobs.receive(0)");
+    EXPECT_TRUE(consumer.runBuffer<bool>("return ok and job.id == 1 and job.name == 'job' and job[10] == 'ten'"));
+    EXPECT_TRUE(consumer.runBuffer<bool>("return job.tags[1] == true and job.tags[2] == false and job.tags[3] == 2.5"));
+    EXPECT_EQ(consumer.runBuffer<int>("local ok, payload = jobs.receive(0) return #payload"), 1024*1024);
+    EXPECT_TRUE(consumer.runBuffer<bool>("local ok, err = jobs.receive(0) return not ok and err == 'timeout'"));
+    EXPECT_FALSE(producer.runBuffer<bool>("return pcall(jobs.send, print)"));
+    EXPECT_FALSE(producer.runBuffer<bool>("local t = {} t.self = t return pcall(jobs.send, t)"));
+
+    // bounded
+    EXPECT_TRUE(producer.runBuffer<bool>("for i=1,4 do assert(jobs.send(i)) end return not jobs.send(5, 0.001)"));
+    EXPECT_EQ(consumer.runBuffer<int>("local sum = 0 for i=1,4 do local ok, v = jobs.receive() sum = sum + v end return sum"), 10);
+
+    // async calls yield until a message arrives
+    EXPECT_TRUE(consumer.runBufferAsync("local ok, v = jobs.receive() received = v"));
+    EXPECT_EQ(consumer.pollAsync(), 1u);
+    producer.safeRunBuffer("jobs.send('hello')");
+    EXPECT_EQ(consumer.pollAsync(), 0u);
+    EXPECT_EQ(consumer.runBuffer<std::string>("return received"), "hello");
+
+    // blocking receive from another thread
+    std::thread worker([channel] {
+        EulunaEngine engine;
+        channel->bind(&engine, "jobs");
+        engine.safeRunBuffer("local ok, v = jobs.receive() jobs.send(v * 2)");
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    producer.safeRunBuffer("jobs.send(21)");
+    worker.join();
+    EXPECT_EQ(consumer.runBuffer<int>("local ok, v = jobs.receive(1) return v"), 42);
+
+    // string lengths are 64 bits, lengths over 4GB are not truncated
+    std::string message = "s";
+    uint64_t hugeLength = (1ull << 32) + 3;
+    message.append(reinterpret_cast<const char*>(&hugeLength), sizeof(hugeLength));
+    message += "abc";
+    size_t pos = 0;
+    EXPECT_THROW(EulunaChannel::deserialize(&consumer, message, pos), EulunaEngineError);
+    consumer.clearStack();
+    EXPECT_EQ(producer.stackSize(), 0);
+    EXPECT_EQ(consumer.stackSize(), 0);
+}
+
+struct StaticPoint {
+    static StaticPoint* create(int x) { StaticPoint *p = new StaticPoint; p->m_x = x; return p; }
+    int getX() const { return m_x; }
+    void setX(int x) { m_x = x; }
+    void fail() { throw std::runtime_error("point failure"); }
+    int m_x = 0;
+};
+
+static int static_add(int a, int b) { return a + b; }
+static std::string static_greet(const std::string& name) { return "hello " + name; }
+
+EULUNA_BEGIN_STATIC_GLOBAL_FUNCTIONS(static_globals)
+EULUNA_STATIC_FUNC(static_add)
+EULUNA_STATIC_FUNC_NAMED("static_greet", static_greet)
+EULUNA_END_STATIC()
+
+EULUNA_BEGIN_STATIC_SINGLETON(staticmath)
+EULUNA_STATIC_FUNC_NAMED("add", static_add)
+EULUNA_END_STATIC()
+
+EULUNA_BEGIN_STATIC_MANAGED_CLASS(StaticPoint)
+EULUNA_STATIC_CLASS_STATIC(StaticPoint, create)
+EULUNA_STATIC_CLASS_MEMBER(StaticPoint, getX)
+EULUNA_STATIC_CLASS_MEMBER(StaticPoint, setX)
+EULUNA_STATIC_CLASS_MEMBER(StaticPoint, fail)
+EULUNA_END_STATIC_WITH_GENERIC_HANDLERS(StaticPoint)
+
+TEST(Euluna, StaticBindings) {
+    EulunaEngine euluna;
+    EulunaBinder::registerGlobalBindings(&euluna);
+    EXPECT_EQ(euluna.runBuffer<int>("return static_add(1, 2)"), 3);
+    EXPECT_EQ(euluna.runBuffer<std::string>("return static_greet('lua')"), "hello lua");
+    EXPECT_EQ(euluna.runBuffer<int>("return staticmath.add(2, 3)"), 5);
+    EXPECT_EQ(euluna.runBuffer<int>("local p = StaticPoint.create(4) p:setX(p:getX() + 1) return p:getX()"), 5);
+    EXPECT_EQ(euluna.runBuffer<std::string>("return select(2, pcall(static_add, 'a', 1))").find("bad argument #1"), 0u);
+    std::string error = euluna.runBuffer<std::string>("return select(2, pcall(function() local p = StaticPoint.create(1) p:fail() end))");
+    EXPECT_NE(error.find("in call of 'fail': point failure"), std::string::npos);
+    EXPECT_EQ(euluna.stackSize(), 0);
+
+    // static tables are also registered lazily
+    EulunaEngine lazy;
+    EulunaBinder::registerGlobalBindingsLazy(&lazy);
+    EXPECT_EQ(lazy.runBuffer<int>("return static_add(1, 2) + staticmath.add(1, 1)"), 5);
+}
+
+enum class TestColor { Red = 1, Green = 2, Blue = 4 };
+enum TestShape { TestShapeCircle, TestShapeSquare };
+
+EULUNA_CHECKED_ENUM(TestColor)
+
+EULUNA_BEGIN_ENUM(TestColor)
+EULUNA_ENUM_VALUE(TestColor, Red)
+EULUNA_ENUM_VALUE(TestColor, Green)
+EULUNA_ENUM_VALUE(TestColor, Blue)
+EULUNA_END()
+
+EULUNA_BEGIN_ENUM_NAMED("Shape", TestShape)
+EULUNA_ENUM_VALUE_NAMED("Circle", TestShapeCircle)
+EULUNA_ENUM_VALUE_NAMED("Square", TestShapeSquare)
+EULUNA_END()
+
+static int colorValue(TestColor color) { return (int)color; }
+static int shapeValue(TestShape shape) { return (int)shape; }
+
+EULUNA_BEGIN_GLOBAL_FUNCTIONS(enums)
+EULUNA_FUNC(colorValue)
+EULUNA_FUNC(shapeValue)
+EULUNA_END()
+
+TEST(Euluna, Enums) {
+    TestColor color;
+    EXPECT_TRUE(EulunaEnum<TestColor>::fromName("Blue", color));
+    EXPECT_EQ(color, TestColor::Blue);
+    EXPECT_FALSE(EulunaEnum<TestColor>::fromName("Purple", color));
+    EXPECT_TRUE(EulunaEnum<TestColor>::isValid(2));
+    EXPECT_FALSE(EulunaEnum<TestColor>::isValid(3));
+    EXPECT_STREQ(EulunaEnum<TestColor>::toName(TestColor::Green), "Green");
+    // the same enum bound again by another binder keeps its enumerators
+    EulunaBinder binder;
+    binder.enumeration<TestColor>("Colors").value("Red", TestColor::Red).value("Green", TestColor::Green);
+    EXPECT_EQ(EulunaEnum<TestColor>::entries().size(), 3u);
+    EXPECT_THROW(EulunaEnum<TestColor>::add("Red", TestColor::Blue), EulunaEngineError);
+    EXPECT_TRUE(EulunaEnum<TestColor>::fromName("Red", color));
+    EXPECT_EQ(color, TestColor::Red);
+
+    EulunaEngine euluna;
+    EulunaBinder::registerGlobalBindings(&euluna);
+    EXPECT_EQ(euluna.runBuffer<int>("return TestColor.Blue + Shape.Square"), 5);
+    EXPECT_EQ(euluna.runBuffer<int>("return colorValue(TestColor.Green)"), 2);
+    EXPECT_EQ(euluna.runBuffer<int>("return colorValue('Blue')"), 4);
+    EXPECT_NE(euluna.runBuffer<std::string>("return select(2, pcall(colorValue, 3))").find("bad argument #1 to '?' (invalid TestColor '3')"), std::string::npos);
+    EXPECT_NE(euluna.runBuffer<std::string>("return select(2, pcall(colorValue, 'Purple'))").find("invalid TestColor 'Purple'"), std::string::npos);
+    EXPECT_NE(euluna.runBuffer<std::string>("return select(2, pcall(colorValue, {}))").find("TestColor expected, got table"), std::string::npos);
+    // numbers that don't convert to the underlying type are rejected before converting them
+    for(const char *bad : {"0/0", "1/0", "-1/0", "2^40", "-2^40", "2.5", "4 + 2^-30"})
+        EXPECT_FALSE(euluna.runBuffer<bool>(euluna_tools::format("return (pcall(colorValue, %s))", bad))) << bad;
+    // unchecked enums are still plain integers
+    EXPECT_EQ(euluna.runBuffer<int>("return shapeValue(1)"), 1);
+    EXPECT_EQ(euluna.stackSize(), 0);
+}
+
+static int statsAdd(int a, int b) { return a + b; }
+static void statsFail() { throw std::runtime_error("fail"); }
+
+TEST(Euluna, BindingStats) {
+    EulunaEngine euluna;
+#ifdef EULUNA_BINDING_STATS
+    EXPECT_NE(euluna.getBindingStats(), nullptr);
+#else
+    EXPECT_EQ(euluna.getBindingStats(), nullptr);
+#endif
+    EulunaBindingStats *stats = euluna.enableBindingStats();
+    EXPECT_EQ(euluna.getBindingStats(), stats);
+
+    EulunaCppFunction add = euluna_binder::bind_fun(statsAdd);
+    EulunaCppFunction fail = euluna_binder::bind_fun(statsFail);
+    euluna.registerGlobalFunction("statsAdd", &add);
+    euluna.registerGlobalFunction("statsFail", &fail);
+    EXPECT_EQ(euluna.runBuffer<int>("local s = 0 for i=1,100 do s = statsAdd(s, 1) end pcall(statsFail) return s"), 100);
+
+    // other bindings of the state may be measured too
+    auto findSnapshot = [&](const std::string& name) {
+        for(auto& snapshot : stats->snapshot()) {
+            if(snapshot.name == name)
+                return snapshot;
+        }
+        return EulunaBindingStats::Snapshot{name, 0, 0, 0, 0, 0, 0};
+    };
+    auto addStats = findSnapshot("statsAdd");
+    EXPECT_EQ(addStats.calls, 100u);
+    EXPECT_GT(addStats.totalNs, 0);
+    EXPECT_LE(addStats.p50Ns, addStats.maxNs);
+    EXPECT_EQ(findSnapshot("statsFail").calls, 1u);
+
+    EXPECT_EQ(euluna.runBuffer<int>("return euluna.stats().statsAdd.calls"), 100);
+    EXPECT_TRUE(euluna.runBuffer<bool>("return euluna.stats().statsAdd.mean_ns > 0"));
+
+    std::string text = stats->toPrometheus();
+    EXPECT_NE(text.find("euluna_binding_calls_total{binding=\"statsAdd\"} 100\n"), std::string::npos);
+    EXPECT_NE(text.find("euluna_binding_duration_seconds_bucket{binding=\"statsAdd\",le=\"+Inf\"} 100\n"), std::string::npos);
+    EXPECT_NE(text.find("euluna_binding_duration_seconds_count{binding=\"statsAdd\"} 100\n"), std::string::npos);
+
+    stats->reset();
+    EXPECT_EQ(findSnapshot("statsAdd").calls, 0u);
+
+    // with sampling every call is counted but only some are timed
+    stats->setSampleInterval(10);
+    euluna.runBuffer("for i=1,100 do statsAdd(i, 1) end");
+    EXPECT_EQ(findSnapshot("statsAdd").calls, 100u);
+    EXPECT_NE(stats->toPrometheus().find("euluna_binding_duration_seconds_count{binding=\"statsAdd\"} 10\n"), std::string::npos);
+
+    // functions pushed before enabling the stats are not measured
+    EulunaEngine other;
+    other.registerGlobalFunction("statsAdd", &add);
+    other.enableBindingStats();
+    other.runBuffer("statsAdd(1, 2)");
+#ifdef EULUNA_BINDING_STATS
+    // unless the stats were enabled when the state was created
+    EXPECT_EQ(other.getBindingStats()->getBinding("statsAdd")->calls, 1u);
+#else
+    EXPECT_TRUE(other.getBindingStats()->snapshot().empty());
+#endif
+}
+
+static void profilerCall(const std::function<void()>& f) { f(); }
+
+TEST(Euluna, Profiler) {
+    EulunaEngine euluna;
+    EulunaCppFunction call = euluna_binder::bind_fun(profilerCall);
+    euluna.registerGlobalFunction("profilerCall", &call);
+    euluna.runBuffer(R"(
+        function busy(n) local s = 0 for i=1,n do s = s + i % 3 end return s end
+        function outer() busy(20000) profilerCall(function() busy(20000) end) end
+    )", "@profiled.lua");
+    {
+        EulunaProfiler profiler(&euluna, 100);
+        euluna.callGlobal("outer");
+        EXPECT_GT(profiler.getSampleCount(), 100u);
+        std::string folded = profiler.getFoldedStacks();
+        EXPECT_NE(folded.find("profiled.lua:3;busy (profiled.lua:2) "), std::string::npos);
+        EXPECT_NE(folded.find("profiled.lua:3;[C] profilerCall;profiled.lua:3;busy (profiled.lua:2) "), std::string::npos);
+        uint64_t total = 0;
+        for(auto& it : profiler.getStacks())
+            total += it.second;
+        EXPECT_EQ(total, profiler.getSampleCount());
+        EXPECT_THROW(EulunaProfiler(&euluna, 100), EulunaEngineError);
+    }
+    {
+        EulunaProfiler profiler(&euluna, std::chrono::microseconds(1000));
+        auto start = std::chrono::steady_clock::now();
+        while(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(100))
+            euluna.callGlobal("outer");
+        EXPECT_GT(profiler.getSampleCount(), 0u);
+        EXPECT_THROW(EulunaProfiler(&euluna, std::chrono::microseconds(1000)), EulunaEngineError);
+    }
+    EXPECT_EQ(lua_gethook(euluna.luaState()), nullptr);
+
+    // coroutines created before the profiler are sampled when the scheduler or lua resumes them
+    euluna.runBufferAsync("busy(1)");
+    EXPECT_TRUE(euluna.runBufferAsync("coroutine.yield() busy(20000)", "@waiting.lua"));
+    euluna.runBuffer("co = coroutine.create(function() coroutine.yield() busy(20000) end) coroutine.resume(co) originalResume = coroutine.resume", "@coroutine.lua");
+    {
+        EulunaProfiler profiler(&euluna, 100);
+        EXPECT_FALSE(euluna.runBufferAsync("busy(20000)", "@pooled.lua"));
+        euluna.safePollAsync();
+        euluna.runBuffer("assert(coroutine.resume(co))");
+        std::string folded = profiler.getFoldedStacks();
+        EXPECT_NE(folded.find("main chunk (pooled.lua);busy (profiled.lua:2) "), std::string::npos);
+        EXPECT_NE(folded.find("main chunk (waiting.lua);busy (profiled.lua:2) "), std::string::npos);
+        EXPECT_NE(folded.find("coroutine.lua:1;busy (profiled.lua:2) "), std::string::npos);
+    }
+    EXPECT_TRUE(euluna.runBuffer<bool>("return coroutine.resume == originalResume"));
+    EXPECT_EQ(euluna.stackSize(), 0);
+}
+
+static void foreignHook(lua_State *L, lua_Debug *ar) { }
+
+TEST(Euluna, ProfilerWithWatchdog) {
+    EulunaEngine euluna;
+    euluna.runBuffer(R"(
+        function busy(n) local s = 0 for i=1,n do s = s + i % 3 end return s end
+        function forever() while true do busy(10) end end
+    )", "@both.lua");
+    {
+        EulunaProfiler profiler(&euluna, 100);
+        {
+            EulunaWatchdog watchdog(&euluna, std::chrono::microseconds(0), 200000);
+            EXPECT_EQ(euluna.safeCallGlobal<int>("busy", 1000), 1000);
+            EXPECT_THROW(euluna.safeCallGlobal("forever"), EulunaBudgetExceededError);
+            EXPECT_TRUE(watchdog.isTripped());
+            EXPECT_GE(watchdog.getInstructionCount(), 200000u);
+        }
+        // the profiler keeps sampling after the watchdog is gone
+        uint64_t samples = profiler.getSampleCount();
+        EXPECT_GT(samples, 1000u);
+        EXPECT_NE(profiler.getFoldedStacks().find("both.lua:3;busy (both.lua:2) "), std::string::npos);
+        euluna.callGlobal("busy", 20000);
+        EXPECT_GT(profiler.getSampleCount(), samples);
+        {
+            // and a watchdog escalating every instruction to stop a script catching its errors
+            EulunaWatchdog watchdog(&euluna, std::chrono::milliseconds(20));
+            EXPECT_THROW(euluna.safeRunBuffer("while true do pcall(forever) end"), EulunaBudgetExceededError);
+        }
+        EXPECT_EQ(euluna.safeCallGlobal<int>("busy", 1000), 1000);
+#ifdef LUAJIT_VERSION
+        EXPECT_FALSE(euluna.runBuffer<bool>("return jit.status()"));
+#endif
+    }
+    EXPECT_EQ(lua_gethook(euluna.luaState()), nullptr);
+#ifdef LUAJIT_VERSION
+    // compiled traces skip the hook, so the JIT is off only while it is installed
+    EXPECT_TRUE(euluna.runBuffer<bool>("return jit.status()"));
+#endif
+
+    // hooks set outside of euluna are not replaced
+    lua_sethook(euluna.luaState(), &foreignHook, LUA_MASKCOUNT, 1000);
+    EXPECT_THROW(EulunaProfiler(&euluna, 100), EulunaEngineError);
+    EXPECT_THROW(EulunaWatchdog(&euluna, std::chrono::seconds(1)), EulunaEngineError);
+    EXPECT_EQ(lua_gethook(euluna.luaState()), &foreignHook);
+    lua_sethook(euluna.luaState(), nullptr, 0, 0);
+    EXPECT_EQ(euluna.stackSize(), 0);
+}
+
+static std::vector<int> trackingMakeList(int n) { return std::vector<int>(n, 1); }
+
+TEST(Euluna, TrackingAllocator) {
+    typedef EulunaTrackingAllocator<EulunaPoolAllocator> Tracking;
+    Tracking *allocator = new Tracking(256);
+    EulunaEngine euluna{std::unique_ptr<EulunaAllocator>(allocator)};
+    EulunaCppFunction makeList = euluna_binder::bind_fun(trackingMakeList);
+    euluna.registerGlobalFunction("makeList", &makeList);
+    euluna.runBuffer(R"(
+        retained = {}
+        function leak(n) for i=1,n do retained[#retained+1] = string.rep('x', 100) .. i end end
+        function bigList() keptList = makeList(10000) end
+    )", "@tracked.lua");
+
+    auto before = allocator->snapshot();
+    euluna.callGlobal("leak", 1000);
+    euluna.callGlobal("bigList");
+    euluna.collect();
+    auto after = allocator->snapshot();
+
+    auto diffs = Tracking::diff(before, after);
+    ASSERT_FALSE(diffs.empty());
+    bool foundLeak = false, foundList = false;
+    for(auto& diff : diffs) {
+        if(diff.location == "tracked.lua:3" && diff.binding.empty()) {
+            foundLeak = true;
+            EXPECT_GT(diff.liveBytesDelta, 100000);
+            EXPECT_GT(diff.allocatedBytesPerSecond, 0);
+        }
+        if(diff.location == "tracked.lua:4" && diff.binding == "makeList") {
+            foundList = true;
+            EXPECT_GT(diff.liveBytesDelta, 10000 * (int)sizeof(double));
+        }
+    }
+    EXPECT_TRUE(foundLeak);
+    EXPECT_TRUE(foundList);
+
+    // freed memory leaves the live bytes of its site
+    euluna.runBuffer("retained = nil keptList = nil");
+    euluna.collect();
+    for(auto& diff : Tracking::diff(after, allocator->snapshot())) {
+        if(diff.location == "tracked.lua:3") {
+            EXPECT_LT(diff.liveBytesDelta, -100000);
+        }
+    }
+}
+
+TEST(Euluna, Tracer) {
+    EulunaTracer::clear();
+    {
+        EulunaTraceScope scope("frame \"1\"", "test");
+        EulunaTraceScope inner("update", "test");
+    }
+    std::thread([] { EulunaTraceScope scope("worker", "test"); }).join();
+#ifndef EULUNA_TRACE
+    // disabled trace macros compile to nothing
+    EULUNA_TRACE_SCOPE("nothing", "test");
+#endif
+
+    auto events = EulunaTracer::events();
+    ASSERT_EQ(events.size(), 3u);
+    EXPECT_STREQ(events[0].second.name, "update");
+    EXPECT_STREQ(events[1].second.name, "frame \"1\"");
+    EXPECT_LE(events[1].second.start, events[0].second.start);
+    EXPECT_GE(events[1].second.duration, events[0].second.duration);
+    EXPECT_NE(events[2].first, events[0].first);
+
+    std::string json = EulunaTracer::toChromeTrace();
+    EXPECT_EQ(json.find("{\"traceEvents\":["), 0u);
+    EXPECT_NE(json.find("\"name\":\"frame \\\"1\\\"\",\"cat\":\"test\",\"ph\":\"X\""), std::string::npos);
+
+    // only the newest events are kept
+    for(int i = 0; i < EulunaTracer::BUFFER_SIZE + 10; ++i)
+        EulunaTracer::record("overflow", "test", i, 1);
+    events = EulunaTracer::events();
+    size_t overflow = 0;
+    for(auto& it : events)
+        overflow += strcmp(it.second.name, "overflow") == 0;
+    // the oldest slot is dropped too, a writer could be overwriting it while it is read
+    EXPECT_EQ(overflow, (size_t)EulunaTracer::BUFFER_SIZE - 1);
+
+    EulunaTracer::setEnabled(false);
+    EulunaTracer::clear();
+    { EulunaTraceScope scope("paused", "test"); }
+    EXPECT_TRUE(EulunaTracer::events().empty());
+    EulunaTracer::setEnabled(true);
+}
+
+TEST(Euluna, Parallel) {
+    EulunaBinder binder;
+    EulunaParallel parallel(4);
+    EulunaEngine euluna;
+    parallel.setGrainSize(16);
+    parallel.registerKernel("square", [](const EulunaKernelArgs& args) {
+        for(size_t i = args.begin; i < args.end; ++i)
+            args.output[i] = args.inputs.at(0)[i] * args.inputs.at(0)[i];
+    });
+    parallel.registerKernel("fail", [](const EulunaKernelArgs& args) {
+        throw std::runtime_error("broken");
+    });
+    parallel.addBindings(binder);
+    binder.registerBindings(&euluna);
+    euluna.safeRunBuffer(R"(
+        local x = EulunaNumericBuffer.create(1000, 2)
+        local y = EulunaNumericBuffer.create(1000)
+        for i=1,1000 do y:set(i, i) end
+        local out = EulunaNumericBuffer.create(1000)
+        parallel.run('axpy', out, x, y, 3)
+        for i=1,1000 do assert(out:get(i) == 6 + i) end
+        parallel.run('square', out, y)
+        for i=1,1000 do assert(out:get(i) == i * i) end
+        local small = EulunaNumericBuffer.fromTable({1, 2, 3})
+        parallel.run('add', small, small, small)
+        local t = small:toTable()
+        assert(#t == 3 and t[1] == 2 and t[3] == 6 and small:size() == 3)
+        assert(parallel.hasKernel('square') and not parallel.hasKernel('cube'))
+        assert(parallel.getNumThreads() == 4)
+        assert(not pcall(parallel.run, 'cube', out, y))
+        assert(not pcall(parallel.run, 'add', out, small, y))
+        assert(not pcall(parallel.run, 'add', out, {}, y))
+        assert(not pcall(parallel.run, 'fail', out))
+        local ok, err = pcall(parallel.run, 5, out)
+        assert(not ok and err:find('string expected, got number'))
+        assert(not pcall(out.get, out, 1001))
+    )");
+
+    EulunaNumericBuffer output(100000), input(100000, 3);
+    parallel.run("square", &output, {&input}, {});
+    for(double value : output.values())
+        ASSERT_EQ(value, 9);
+    EXPECT_THROW(parallel.run("fail", &output, {}, {}), EulunaEngineError);
+    EXPECT_EQ(euluna.stackSize(), 0);
+}
+
+struct alignas(32) OverAlignedCounter {
+    int operator()(EulunaInterface* lua) {
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(this) % 32, 0u);
+        lua->pushInteger(++count);
+        return 1;
+    }
+    int count = 0;
+};
+
+TEST(Euluna, InlineFunctions) {
+    EulunaEngine euluna;
+    auto token = std::make_shared<int>(3);
+    int calls = 0;
+    euluna.pushCppFunction([token, &calls](EulunaInterface* lua) {
+        calls++;
+        lua->pushInteger(*token + lua->popInteger());
+        return 1;
+    }, "addToken");
+    euluna.setGlobal("addToken");
+    euluna.pushCppFunction([](EulunaInterface* lua) { throw std::runtime_error("inline failure"); return 0; }, "inlineThrow");
+    euluna.setGlobal("inlineThrow");
+    euluna.pushCppFunction(OverAlignedCounter(), "overAligned");
+    euluna.setGlobal("overAligned");
+    EXPECT_EQ(token.use_count(), 2);
+    EXPECT_EQ(euluna.runBuffer<int>("return addToken(4)"), 7);
+    EXPECT_EQ(euluna.runBuffer<int>("overAligned() return overAligned()"), 2);
+    EXPECT_THROW(euluna.safeRunBuffer("inlineThrow()"), EulunaRuntimeError);
+    EXPECT_EQ(calls, 1);
+
+    // the callable is destroyed when its closure is collected
+    euluna.runBuffer("addToken = nil");
+    euluna.collect();
+    EXPECT_EQ(token.use_count(), 1);
+
+    // std::function callbacks are stored inline too
+    auto callback = std::function<int(int)>([token](int a) { return a * *token; });
+    euluna.polymorphicPush(callback);
+    euluna.setGlobal("triple");
+    EXPECT_EQ(euluna.runBuffer<int>("return triple(5)"), 15);
+    EXPECT_EQ(token.use_count(), 3);
+    callback = nullptr;
+    euluna.runBuffer("triple = nil");
+    euluna.collect();
+    EXPECT_EQ(token.use_count(), 1);
+    EXPECT_EQ(euluna.stackSize(), 0);
+}